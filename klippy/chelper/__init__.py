@@ -18,15 +18,16 @@ COMPILE_ARGS = ("-Wall -g -O2 -shared -fPIC"
 SSE_FLAGS = "-mfpmath=sse -msse2"
 SOURCE_FILES = [
     'pyhelper.c', 'serialqueue.c', 'stepcompress.c', 'itersolve.c', 'trapq.c',
-    'pollreactor.c', 'msgblock.c', 'trdispatch.c',
+    'pollreactor.c', 'msgblock.c', 'trdispatch.c', 'bulk_decode.c',
+    'accel_monitor.c', 'transform.c', 'move_limits.c',
     'kin_cartesian.c', 'kin_corexy.c', 'kin_corexz.c', 'kin_delta.c',
     'kin_deltesian.c', 'kin_polar.c', 'kin_rotary_delta.c', 'kin_winch.c',
-    'kin_extruder.c', 'kin_shaper.c',
+    'kin_extruder.c', 'kin_shaper.c', 'kin_bed_mesh.c',
 ]
 DEST_LIB = "c_helper.so"
 OTHER_FILES = [
     'list.h', 'serialqueue.h', 'stepcompress.h', 'itersolve.h', 'pyhelper.h',
-    'trapq.h', 'pollreactor.h', 'msgblock.h'
+    'trapq.h', 'pollreactor.h', 'msgblock.h', 'shm_ring.h'
 ]
 
 defs_stepcompress = """
@@ -39,8 +40,11 @@ defs_stepcompress = """
     struct stepcompress *stepcompress_alloc(uint32_t oid);
     void stepcompress_fill(struct stepcompress *sc, uint32_t max_error
         , int32_t queue_step_msgtag, int32_t set_next_step_dir_msgtag);
+    void stepcompress_set_error_ratio(struct stepcompress *sc
+        , double error_ratio);
     void stepcompress_set_invert_sdir(struct stepcompress *sc
         , uint32_t invert_sdir);
+    uint64_t stepcompress_get_msg_bytes(struct stepcompress *sc);
     void stepcompress_free(struct stepcompress *sc);
     int stepcompress_reset(struct stepcompress *sc, uint64_t last_step_clock);
     int stepcompress_set_last_position(struct stepcompress *sc
@@ -81,17 +85,27 @@ defs_trapq = """
     struct pull_move {
         double print_time, move_t;
         double start_v, accel;
+        double scurve_c3, scurve_c4;
         double start_x, start_y, start_z;
         double x_r, y_r, z_r;
+        double arc_ax, arc_ay, arc_az, arc_bx, arc_by, arc_bz, arc_k;
     };
 
     struct trapq *trapq_alloc(void);
     void trapq_free(struct trapq *tq);
+    void trapq_set_scurve(struct trapq *tq, int scurve);
     void trapq_append(struct trapq *tq, double print_time
         , double accel_t, double cruise_t, double decel_t
         , double start_pos_x, double start_pos_y, double start_pos_z
         , double axes_r_x, double axes_r_y, double axes_r_z
         , double start_v, double cruise_v, double accel);
+    void trapq_append_arc(struct trapq *tq, double print_time
+        , double accel_t, double cruise_t, double decel_t
+        , double start_pos_x, double start_pos_y, double start_pos_z
+        , double axes_r_x, double axes_r_y, double axes_r_z
+        , double arc_a_x, double arc_a_y, double arc_a_z
+        , double arc_b_x, double arc_b_y, double arc_b_z, double arc_k
+        , double start_v, double cruise_v, double accel);
     void trapq_finalize_moves(struct trapq *tq, double print_time);
     void trapq_set_position(struct trapq *tq, double print_time
         , double pos_x, double pos_y, double pos_z);
@@ -148,11 +162,37 @@ defs_kin_shaper = """
         struct stepper_kinematics *sk);
     int input_shaper_set_shaper_params(struct stepper_kinematics *sk, char axis
         , int n, double a[], double t[]);
+    int input_shaper_set_smoother_params(struct stepper_kinematics *sk
+        , char axis, int n, double c[], double smooth_time);
     int input_shaper_set_sk(struct stepper_kinematics *sk
         , struct stepper_kinematics *orig_sk);
     struct stepper_kinematics * input_shaper_alloc(void);
 """
 
+defs_kin_bed_mesh = """
+    struct z_mesh *zmesh_alloc(void);
+    void zmesh_free(struct z_mesh *zm);
+    int zmesh_build(struct z_mesh *zm, char algo, int px_count
+        , int py_count, int x_mult, int y_mult, double tension
+        , double min_x, double min_y, double max_x, double max_y
+        , double *probed);
+    void zmesh_copy_table(struct z_mesh *zm, struct z_mesh *src);
+    void zmesh_get_table(struct z_mesh *zm, double *out);
+    void zmesh_set_offsets(struct z_mesh *zm, double x_offset
+        , double y_offset);
+    void zmesh_set_fade(struct z_mesh *zm, double fade_start
+        , double fade_end, double fade_target);
+    void zmesh_set_enabled(struct z_mesh *zm, int enabled);
+    double zmesh_calc_z(struct z_mesh *zm, double x, double y);
+    double zmesh_calc_offset(struct z_mesh *zm, double x, double y
+        , double z);
+    int bed_mesh_set_sk(struct stepper_kinematics *sk
+        , struct stepper_kinematics *orig_sk, struct z_mesh *zm);
+    void bed_mesh_set_xy_active(struct stepper_kinematics *sk
+        , int xy_active);
+    struct stepper_kinematics *bed_mesh_stepper_alloc(void);
+"""
+
 defs_serialqueue = """
     #define MESSAGE_MAX 64
     struct pull_queue_message {
@@ -197,6 +237,62 @@ defs_trdispatch = """
         , uint64_t expire_ticks, uint64_t min_extend_ticks);
 """
 
+defs_bulk_decode = """
+    struct bulk_decode_info {
+        int64_t last_sequence, last_chip_clock;
+        int error_count;
+    };
+
+    struct bulk_decoder *bulk_decoder_alloc(char sensor_type
+        , int samples_per_block);
+    void bulk_decoder_set_axis(struct bulk_decoder *bd, int axis, int pos
+        , double scale);
+    int bulk_decoder_extract(struct bulk_decoder *bd, uint8_t *data
+        , int *block_lens, int *sequences, int block_count
+        , double time_base, double chip_base, double inv_freq
+        , double *out_time, double *out_x, double *out_y, double *out_z
+        , int max_samples, struct bulk_decode_info *info);
+    int bulk_resample(double *times, double *x, double *y, double *z
+        , int count, double start_time, double step, double max_gap
+        , double *out, int grid_count);
+"""
+
+defs_accel_monitor = """
+    struct accel_monitor *accel_monitor_alloc(int num_bands
+        , double min_freq, double freq_step, double window_time);
+    void accel_monitor_free(struct accel_monitor *am);
+    void accel_monitor_reset(struct accel_monitor *am);
+    void accel_monitor_update(struct accel_monitor *am, double *times
+        , double *x, double *y, double *z, int count);
+    int64_t accel_monitor_extract(struct accel_monitor *am
+        , double *band_power, double *level, double *sample_rate);
+"""
+
+defs_transform = """
+    struct transform_pipeline *transform_pipeline_alloc(void);
+    int transform_pipeline_add_stage(struct transform_pipeline *tp);
+    int transform_pipeline_set_stage(struct transform_pipeline *tp
+        , int stage, double *matrix);
+    void transform_pipeline_apply(struct transform_pipeline *tp
+        , double *coords, int count);
+    void transform_pipeline_unapply(struct transform_pipeline *tp
+        , double *coords, int count);
+"""
+
+defs_move_limits = """
+    struct move_limits *move_limits_alloc(void);
+    void move_limits_set_range(struct move_limits *ml, int axis
+        , double min_pos, double max_pos);
+    void move_limits_set_z_limits(struct move_limits *ml
+        , double max_z_velocity, double max_z_accel);
+    void move_limits_set_delta(struct move_limits *ml, double radius
+        , double min_arm_length, double limit_z, double max_xy2
+        , double slow_xy2, double very_slow_xy2
+        , double max_velocity, double max_accel);
+    int move_limits_check(struct move_limits *ml, double *start_pos
+        , double *coords, int count, double *limits, int *moves);
+"""
+
 defs_pyhelper = """
     void set_python_logging_callback(void (*func)(const char *));
     double get_monotonic(void);
@@ -208,10 +304,12 @@ defs_std = """
 
 defs_all = [
     defs_pyhelper, defs_serialqueue, defs_std, defs_stepcompress,
-    defs_itersolve, defs_trapq, defs_trdispatch,
+    defs_itersolve, defs_trapq, defs_trdispatch, defs_bulk_decode,
+    defs_accel_monitor, defs_transform, defs_move_limits,
     defs_kin_cartesian, defs_kin_corexy, defs_kin_corexz, defs_kin_delta,
-    defs_kin_deltesian, defs_kin_polar, defs_kin_rotary_delta, defs_kin_winch,
-    defs_kin_extruder, defs_kin_shaper,
+    defs_kin_deltesian, defs_kin_polar,
+    defs_kin_rotary_delta, defs_kin_winch, defs_kin_extruder,
+    defs_kin_shaper, defs_kin_bed_mesh,
 ]
 
 # Update filenames to an absolute path
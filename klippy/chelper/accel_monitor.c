@@ -0,0 +1,177 @@
+// Rolling band energy tracking of accelerometer samples
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <math.h> // exp
+#include <stdint.h> // int64_t
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "pyhelper.h" // errorf
+
+// Each band is tracked with a damped complex resonator (an
+// exponentially weighted sliding DFT bin).  The resonator output
+// power is then averaged over 'window_time' seconds.  The memory and
+// per-sample cost only depend on the number of bands.
+struct accel_monitor {
+    int num_bands;
+    double min_freq, freq_step, window_time;
+    // Coefficients (recalculated when the sample rate changes)
+    double coeff_rate, gain, avg_alpha, dc_alpha;
+    double *rot;
+    // Per axis state
+    double *state, *power;
+    double dc[3], level[3];
+    // Sample rate tracking
+    double sample_rate;
+    int64_t sample_count;
+};
+
+// Recalculate the band resonator coefficients for a sample rate
+static void
+calc_coeffs(struct accel_monitor *am, double rate)
+{
+    // Resonator bandwidth is chosen so that adjacent bands overlap
+    // at their -3dB points
+    double r = exp(-M_PI * am->freq_step / rate);
+    int i;
+    for (i=0; i<am->num_bands; i++) {
+        double w = 2. * M_PI * (am->min_freq + i * am->freq_step) / rate;
+        am->rot[i*2] = r * cos(w);
+        am->rot[i*2+1] = r * sin(w);
+    }
+    // Scale so a sinusoid of amplitude A reports a power of A^2/2
+    am->gain = 2. * (1. - r) * (1. - r);
+    am->avg_alpha = 1. - exp(-1. / (rate * am->window_time));
+    am->dc_alpha = 1. - exp(-M_PI * am->min_freq / rate);
+    am->coeff_rate = rate;
+}
+
+// Allocate a monitor for 'num_bands' bands starting at 'min_freq'
+struct accel_monitor * __visible
+accel_monitor_alloc(int num_bands, double min_freq, double freq_step
+                    , double window_time)
+{
+    if (num_bands <= 0 || min_freq <= 0. || freq_step <= 0.
+        || window_time <= 0.) {
+        errorf("Invalid accel_monitor parameters");
+        return NULL;
+    }
+    struct accel_monitor *am = malloc(sizeof(*am));
+    memset(am, 0, sizeof(*am));
+    am->num_bands = num_bands;
+    am->min_freq = min_freq;
+    am->freq_step = freq_step;
+    am->window_time = window_time;
+    am->rot = malloc(sizeof(am->rot[0]) * num_bands * 2);
+    am->state = malloc(sizeof(am->state[0]) * num_bands * 2 * 3);
+    am->power = malloc(sizeof(am->power[0]) * num_bands * 3);
+    memset(am->rot, 0, sizeof(am->rot[0]) * num_bands * 2);
+    memset(am->state, 0, sizeof(am->state[0]) * num_bands * 2 * 3);
+    memset(am->power, 0, sizeof(am->power[0]) * num_bands * 3);
+    return am;
+}
+
+// Free memory associated with a monitor
+void __visible
+accel_monitor_free(struct accel_monitor *am)
+{
+    if (!am)
+        return;
+    free(am->rot);
+    free(am->state);
+    free(am->power);
+    free(am);
+}
+
+// Discard all accumulated state
+void __visible
+accel_monitor_reset(struct accel_monitor *am)
+{
+    int num_bands = am->num_bands;
+    memset(am->state, 0, sizeof(am->state[0]) * num_bands * 2 * 3);
+    memset(am->power, 0, sizeof(am->power[0]) * num_bands * 3);
+    memset(am->dc, 0, sizeof(am->dc));
+    memset(am->level, 0, sizeof(am->level));
+    am->sample_rate = am->coeff_rate = 0.;
+    am->sample_count = 0;
+}
+
+// Track the actual sample rate of the sensor from the sample times
+static void
+update_rate(struct accel_monitor *am, double *times, int count)
+{
+    double first_time = times[0], last_time = times[count-1];
+    if (count >= 2 && last_time > first_time) {
+        double rate = (count - 1) / (last_time - first_time);
+        if (!am->sample_rate)
+            am->sample_rate = rate;
+        else
+            am->sample_rate += .1 * (rate - am->sample_rate);
+    }
+    double rate = am->sample_rate;
+    if (rate && fabs(rate - am->coeff_rate) > .0005 * rate)
+        calc_coeffs(am, rate);
+}
+
+// Process one axis of a block of samples
+static void
+update_axis(struct accel_monitor *am, int axis, double *values, int count)
+{
+    int num_bands = am->num_bands, i, j;
+    double *rot = am->rot, *state = &am->state[axis * num_bands * 2];
+    double *power = &am->power[axis * num_bands];
+    double gain = am->gain, avg_alpha = am->avg_alpha;
+    double dc_alpha = am->dc_alpha, dc = am->dc[axis];
+    double level = am->level[axis];
+    if (!am->sample_count)
+        dc = values[0];
+    for (i=0; i<count; i++) {
+        double v = values[i];
+        dc += dc_alpha * (v - dc);
+        v -= dc;
+        level += avg_alpha * (v*v - level);
+        for (j=0; j<num_bands; j++) {
+            double re = state[j*2], im = state[j*2+1];
+            double rc = rot[j*2], rs = rot[j*2+1];
+            double nre = re * rc - im * rs + v, nim = re * rs + im * rc;
+            state[j*2] = nre;
+            state[j*2+1] = nim;
+            double p = gain * (nre * nre + nim * nim);
+            power[j] += avg_alpha * (p - power[j]);
+        }
+    }
+    am->dc[axis] = dc;
+    am->level[axis] = level;
+}
+
+// Add 'count' samples stored in separate 'times', 'x', 'y', and 'z'
+// arrays
+void __visible
+accel_monitor_update(struct accel_monitor *am, double *times, double *x
+                     , double *y, double *z, int count)
+{
+    if (count <= 0)
+        return;
+    update_rate(am, times, count);
+    if (!am->coeff_rate)
+        // Sample rate not yet known
+        return;
+    update_axis(am, 0, x, count);
+    update_axis(am, 1, y, count);
+    update_axis(am, 2, z, count);
+    am->sample_count += count;
+}
+
+// Copy the band powers (num_bands per axis) and the overall
+// vibration power of each axis.  Returns the number of samples
+// processed since the last reset.
+int64_t __visible
+accel_monitor_extract(struct accel_monitor *am, double *band_power
+                      , double *level, double *sample_rate)
+{
+    memcpy(band_power, am->power, sizeof(am->power[0]) * am->num_bands * 3);
+    memcpy(level, am->level, sizeof(am->level));
+    *sample_rate = am->sample_rate;
+    return am->sample_count;
+}
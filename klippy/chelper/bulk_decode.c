@@ -0,0 +1,201 @@
+// Decoding of bulk sensor sample blocks
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <math.h> // nearbyint, NAN
+#include <stdint.h> // uint8_t
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "pyhelper.h" // errorf
+
+typedef int (*decode_sample_cb)(uint8_t *d, int32_t *raw_xyz);
+
+struct bulk_decoder {
+    decode_sample_cb decode_cb;
+    int bytes_per_sample, samples_per_block;
+    int axes_pos[3];
+    double axes_scale[3];
+};
+
+// Sequence tracking (provided by caller) and decoding results
+struct bulk_decode_info {
+    int64_t last_sequence, last_chip_clock;
+    int error_count;
+};
+
+
+/****************************************************************
+ * Sensor specific sample formats
+ ****************************************************************/
+
+// ADXL345 - 13bit values packed into 5 bytes with an error flag
+static int
+decode_adxl345(uint8_t *d, int32_t *raw_xyz)
+{
+    uint_fast8_t xlow = d[0], ylow = d[1], zlow = d[2];
+    uint_fast8_t xzhigh = d[3], yzhigh = d[4];
+    if (yzhigh & 0x80)
+        return -1;
+    raw_xyz[0] = (xlow | ((xzhigh & 0x1f) << 8)) - ((xzhigh & 0x10) << 9);
+    raw_xyz[1] = (ylow | ((yzhigh & 0x1f) << 8)) - ((yzhigh & 0x10) << 9);
+    raw_xyz[2] = ((zlow | ((xzhigh & 0xe0) << 3) | ((yzhigh & 0xe0) << 6))
+                  - ((yzhigh & 0x40) << 7));
+    return 0;
+}
+
+// MPU9250 - big-endian 16bit values
+static int
+decode_mpu9250(uint8_t *d, int32_t *raw_xyz)
+{
+    raw_xyz[0] = (int16_t)((d[0] << 8) | d[1]);
+    raw_xyz[1] = (int16_t)((d[2] << 8) | d[3]);
+    raw_xyz[2] = (int16_t)((d[4] << 8) | d[5]);
+    return 0;
+}
+
+
+/****************************************************************
+ * Block decoding
+ ****************************************************************/
+
+// Allocate a decoder for the given sensor type
+struct bulk_decoder * __visible
+bulk_decoder_alloc(char sensor_type, int samples_per_block)
+{
+    struct bulk_decoder *bd = malloc(sizeof(*bd));
+    memset(bd, 0, sizeof(*bd));
+    switch (sensor_type) {
+    case 'a':
+        bd->decode_cb = decode_adxl345;
+        bd->bytes_per_sample = 5;
+        break;
+    case 'm':
+        bd->decode_cb = decode_mpu9250;
+        bd->bytes_per_sample = 6;
+        break;
+    default:
+        errorf("Unknown bulk sensor type '%c'", sensor_type);
+        free(bd);
+        return NULL;
+    }
+    bd->samples_per_block = samples_per_block;
+    int i;
+    for (i=0; i<3; i++) {
+        bd->axes_pos[i] = i;
+        bd->axes_scale[i] = 1.;
+    }
+    return bd;
+}
+
+// Set the raw chip axis and scale reported for the given output axis
+void __visible
+bulk_decoder_set_axis(struct bulk_decoder *bd, int axis, int pos
+                      , double scale)
+{
+    if (axis < 0 || axis >= 3 || pos < 0 || pos >= 3)
+        return;
+    bd->axes_pos[axis] = pos;
+    bd->axes_scale[axis] = scale;
+}
+
+// Round to the precision reported to API clients (values within an ulp
+// of a halfway case may round differently than Python round(v, 6))
+static inline double
+round6(double v)
+{
+    return nearbyint(v * 1000000.) / 1000000.;
+}
+
+// Decode a series of sample blocks into separate time, x, y, and z
+// arrays (each with room for 'max_samples').  Each block is
+// 'block_lens[i]' bytes of 'data' with a 16bit sequence number of
+// 'sequences[i]'.  Sample times are calculated from the chip clock
+// (sequence * samples_per_block + index) using the given linear
+// translation.  Returns the number of samples stored.
+int __visible
+bulk_decoder_extract(struct bulk_decoder *bd, uint8_t *data, int *block_lens
+                     , int *sequences, int block_count
+                     , double time_base, double chip_base, double inv_freq
+                     , double *out_time, double *out_x, double *out_y
+                     , double *out_z, int max_samples
+                     , struct bulk_decode_info *info)
+{
+    int x_pos = bd->axes_pos[0], y_pos = bd->axes_pos[1];
+    int z_pos = bd->axes_pos[2];
+    double x_scale = bd->axes_scale[0], y_scale = bd->axes_scale[1];
+    double z_scale = bd->axes_scale[2];
+    int bps = bd->bytes_per_sample, spb = bd->samples_per_block;
+    int64_t last_sequence = info->last_sequence, last_chip_clock = -1;
+    int count = 0, b, i;
+    for (b=0; b<block_count; b++) {
+        int32_t seq_diff = (last_sequence - sequences[b]) & 0xffff;
+        seq_diff -= (seq_diff & 0x8000) << 1;
+        int64_t seq = last_sequence - seq_diff;
+        double msg_cdiff = seq * spb - chip_base;
+        int samples = block_lens[b] / bps;
+        if (samples)
+            last_chip_clock = seq * spb + samples - 1;
+        for (i=0; i<samples; i++) {
+            int32_t raw_xyz[3];
+            int ret = bd->decode_cb(&data[i*bps], raw_xyz);
+            if (ret) {
+                info->error_count++;
+                continue;
+            }
+            if (count >= max_samples)
+                break;
+            out_time[count] = round6(time_base + (msg_cdiff + i) * inv_freq);
+            out_x[count] = round6(raw_xyz[x_pos] * x_scale);
+            out_y[count] = round6(raw_xyz[y_pos] * y_scale);
+            out_z[count] = round6(raw_xyz[z_pos] * z_scale);
+            count++;
+        }
+        data += block_lens[b];
+    }
+    if (last_chip_clock >= 0)
+        info->last_chip_clock = last_chip_clock;
+    return count;
+}
+
+
+/****************************************************************
+ * Resampling
+ ****************************************************************/
+
+// Linearly interpolate 'count' decoded samples (stored in separate
+// 'times', 'x', 'y', and 'z' arrays) onto 'grid_count' times starting
+// at 'start_time' and spaced 'step' apart.  The x, y, and z results
+// are stored in separate arrays (each 'grid_count' long) in 'out'.
+// Grid times that fall into a gap of more than 'max_gap' seconds
+// between samples are set to NAN.  Returns the number of grid times
+// stored.
+int __visible
+bulk_resample(double *times, double *x, double *y, double *z, int count
+              , double start_time, double step, double max_gap
+              , double *out, int grid_count)
+{
+    double *out_x = out, *out_y = &out[grid_count];
+    double *out_z = &out[grid_count*2];
+    int pos = 0, i;
+    if (count < 2)
+        return 0;
+    for (i=0; i<grid_count; i++) {
+        double t = start_time + i * step;
+        while (pos < count - 2 && times[pos+1] <= t)
+            pos++;
+        double t0 = times[pos], t1 = times[pos+1];
+        if (t < t0 || t > t1)
+            break;
+        double dt = t1 - t0;
+        if (dt > max_gap || dt <= 0.) {
+            out_x[i] = out_y[i] = out_z[i] = NAN;
+            continue;
+        }
+        double r = (t - t0) / dt;
+        out_x[i] = x[pos] + (x[pos+1] - x[pos]) * r;
+        out_y[i] = y[pos] + (y[pos+1] - y[pos]) * r;
+        out_z[i] = z[pos] + (z[pos+1] - z[pos]) * r;
+    }
+    return i;
+}
@@ -19,10 +19,31 @@
  ****************************************************************/
 
 struct timepos {
-    double time, position;
+    double time, position, velocity;
 };
 
 #define SEEK_TIME_RESET 0.000100
+#define NEWTON_OVERSHOOT 0.05
+#define NEWTON_MAX_ERROR 0.000000000100
+
+// Refine the time of a step that 'guess' has moved past using the
+// stepper velocity.  Returns 1 if the estimated error of the refined
+// time (.5 * accel * dt**2 / velocity, with accel estimated from the
+// previous guess) is negligible.
+static inline int
+newton_refine(struct timepos *guess, struct timepos *old_guess
+              , double target, double low_time)
+{
+    double rt = (target - guess->position) / guess->velocity;
+    double step_time = guess->time + rt, dt = guess->time - old_guess->time;
+    double err = .5 * fabs((guess->velocity - old_guess->velocity) * rt * rt);
+    if (!(step_time > low_time && step_time < guess->time)
+        || !(err < NEWTON_MAX_ERROR * fabs(dt * guess->velocity)))
+        return 0;
+    guess->time = step_time;
+    guess->position = target;
+    return 1;
+}
 
 // Generate step times for a portion of a move
 static int32_t
@@ -30,13 +51,16 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
                           , double abs_start, double abs_end)
 {
     sk_calc_callback calc_position_cb = sk->calc_position_cb;
+    sk_calc_velocity_callback calc_velocity_cb = (
+        sk->use_newton ? sk->calc_velocity_cb : NULL);
     double half_step = .5 * sk->step_dist;
     double start = abs_start - m->print_time, end = abs_end - m->print_time;
     if (start < 0.)
         start = 0.;
     if (end > m->move_t)
         end = m->move_t;
-    struct timepos old_guess = {start, sk->commanded_pos}, guess = old_guess;
+    struct timepos old_guess = {start, sk->commanded_pos, 0.};
+    struct timepos guess = old_guess;
     int sdir = stepcompress_get_step_dir(sk->sc);
     int is_dir_change = 0, have_bracket = 0, check_oscillate = 0;
     double target = sk->commanded_pos + (sdir ? half_step : -half_step);
@@ -44,11 +68,22 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
     if (high_time > end)
         high_time = end;
     for (;;) {
-        // Use the "secant method" to guess a new time from previous guesses
-        double guess_dist = guess.position - target;
-        double og_dist = old_guess.position - target;
-        double next_time = ((old_guess.time*guess_dist - guess.time*og_dist)
-                            / (guess_dist - og_dist));
+        double guess_dist = guess.position - target, next_time;
+        if (calc_velocity_cb) {
+            // Use "Newton's method" when the stepper velocity is known.
+            // When searching for a step, aim slightly past it so that
+            // its time can usually be refined without another guess.
+            double aim = 0.;
+            if (!have_bracket)
+                aim = (sdir ? NEWTON_OVERSHOOT : -NEWTON_OVERSHOOT) * half_step;
+            next_time = guess.time - (guess_dist - aim) / guess.velocity;
+        } else {
+            // Use the "secant method" to guess a new time from
+            // previous guesses
+            double og_dist = old_guess.position - target;
+            next_time = ((old_guess.time*guess_dist - guess.time*og_dist)
+                         / (guess_dist - og_dist));
+        }
         if (!(next_time > low_time && next_time < high_time)) { // or NaN
             // Next guess is outside bounds checks - validate it
             if (have_bracket) {
@@ -69,7 +104,11 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
         // Calculate position at next_time guess
         old_guess = guess;
         guess.time = next_time;
-        guess.position = calc_position_cb(sk, m, next_time);
+        if (calc_velocity_cb)
+            guess.position = calc_velocity_cb(sk, m, next_time
+                                              , &guess.velocity);
+        else
+            guess.position = calc_position_cb(sk, m, next_time);
         guess_dist = guess.position - target;
         if (fabs(guess_dist) > .000000001) {
             // Guess does not look close enough - update bounds
@@ -96,7 +135,10 @@ itersolve_gen_steps_range(struct stepper_kinematics *sk, struct move *m
             } else {
                 low_time = guess.time;
             }
-            if (!have_bracket || high_time - low_time > .000000001) {
+            if (calc_velocity_cb && rel_dist > 0.
+                && newton_refine(&guess, &old_guess, target, low_time)) {
+                // Step time calculated from stepper velocity
+            } else if (!have_bracket || high_time - low_time > .000000001) {
                 if (!is_dir_change && rel_dist >= -half_step)
                     // Avoid rollback if stepper fully reaches step position
                     stepcompress_commit(sk->sc);
@@ -137,6 +179,11 @@ static inline int
 check_active(struct stepper_kinematics *sk, struct move *m)
 {
     int af = sk->active_flags;
+    if (unlikely(m->arc_k)
+        && ((af & AF_X && (m->arc_a.x != 0. || m->arc_b.x != 0.))
+            || (af & AF_Y && (m->arc_a.y != 0. || m->arc_b.y != 0.))
+            || (af & AF_Z && (m->arc_a.z != 0. || m->arc_b.z != 0.))))
+        return 1;
     return ((af & AF_X && m->axes_r.x != 0.)
             || (af & AF_Y && m->axes_r.y != 0.)
             || (af & AF_Z && m->axes_r.z != 0.));
@@ -11,6 +11,9 @@ struct stepper_kinematics;
 struct move;
 typedef double (*sk_calc_callback)(struct stepper_kinematics *sk, struct move *m
                                    , double move_time);
+typedef double (*sk_calc_velocity_callback)(
+    struct stepper_kinematics *sk, struct move *m, double move_time
+    , double *velocity);
 typedef void (*sk_post_callback)(struct stepper_kinematics *sk);
 struct stepper_kinematics {
     double step_dist, commanded_pos;
@@ -22,6 +25,12 @@ struct stepper_kinematics {
     double gen_steps_pre_active, gen_steps_post_active;
 
     sk_calc_callback calc_position_cb;
+    // Optional - returns the position and also stores its time
+    // derivative in 'velocity'
+    sk_calc_velocity_callback calc_velocity_cb;
+    // Set to find step times with Newton's method (using the velocity
+    // callback) instead of the secant method
+    int use_newton;
     sk_post_callback post_cb;
 };
 
@@ -0,0 +1,453 @@
+// Bed mesh interpolation and Z adjustment during step generation
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <math.h> // floor
+#include <stddef.h> // offsetof
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "itersolve.h" // struct stepper_kinematics
+#include "pyhelper.h" // errorf
+#include "trapq.h" // move_get_coord
+
+
+/****************************************************************
+ * Mesh lookup
+ ****************************************************************/
+
+struct z_mesh {
+    int x_count, y_count, enabled;
+    double min_x, min_y, x_dist, y_dist, inv_x_dist, inv_y_dist;
+    double x_offset, y_offset;
+    double fade_start, fade_end, fade_dist, fade_target;
+    // Interpolated mesh (row major, one row of 'x_count' per y)
+    double *z_table;
+    // Bilinear patch coefficients for each mesh cell
+    struct mesh_patch {
+        double z, dx, dy, dxy;
+    } *patches;
+};
+
+struct z_mesh * __visible
+zmesh_alloc(void)
+{
+    struct z_mesh *zm = malloc(sizeof(*zm));
+    memset(zm, 0, sizeof(*zm));
+    zm->enabled = 1;
+    return zm;
+}
+
+static void
+zmesh_clear(struct z_mesh *zm)
+{
+    free(zm->z_table);
+    free(zm->patches);
+    zm->z_table = NULL;
+    zm->patches = NULL;
+    zm->x_count = zm->y_count = 0;
+}
+
+void __visible
+zmesh_free(struct z_mesh *zm)
+{
+    if (!zm)
+        return;
+    zmesh_clear(zm);
+    free(zm);
+}
+
+// Setup the mesh dimensions and allocate its tables
+static void
+zmesh_init_table(struct z_mesh *zm, int x_count, int y_count
+                 , double min_x, double min_y, double max_x, double max_y)
+{
+    zmesh_clear(zm);
+    zm->x_count = x_count;
+    zm->y_count = y_count;
+    zm->min_x = min_x;
+    zm->min_y = min_y;
+    zm->x_dist = (max_x - min_x) / (x_count - 1);
+    zm->y_dist = (max_y - min_y) / (y_count - 1);
+    zm->inv_x_dist = 1. / zm->x_dist;
+    zm->inv_y_dist = 1. / zm->y_dist;
+    zm->z_table = malloc(sizeof(zm->z_table[0]) * x_count * y_count);
+    memset(zm->z_table, 0, sizeof(zm->z_table[0]) * x_count * y_count);
+    zm->patches = malloc(sizeof(zm->patches[0])
+                         * (x_count - 1) * (y_count - 1));
+}
+
+// Precompute the bilinear coefficients of each mesh cell
+static void
+zmesh_calc_patches(struct z_mesh *zm)
+{
+    int x_count = zm->x_count, i, j;
+    for (j=0; j<zm->y_count-1; j++) {
+        double *row0 = &zm->z_table[j * x_count], *row1 = row0 + x_count;
+        struct mesh_patch *mp = &zm->patches[j * (x_count - 1)];
+        for (i=0; i<x_count-1; i++, mp++) {
+            mp->z = row0[i];
+            mp->dx = row0[i+1] - row0[i];
+            mp->dy = row1[i] - row0[i];
+            mp->dxy = row1[i+1] - row1[i] - mp->dx;
+        }
+    }
+}
+
+// Lagrange interpolation of 'count' points spaced 'mult' entries
+// apart in 'vals' (which are 'stride' entries apart in memory)
+static double
+calc_lagrange(double *vals, int stride, int mult, int count, double *pts
+              , double c)
+{
+    double total = 0.;
+    int i, j;
+    for (i=0; i<count; i++) {
+        double n = 1., d = 1.;
+        for (j=0; j<count; j++) {
+            if (j == i)
+                continue;
+            n *= c - pts[j];
+            d *= pts[i] - pts[j];
+        }
+        total += vals[i * mult * stride] * n / d;
+    }
+    return total;
+}
+
+// Cardinal spline interpolation of entry 'pos' from the probed entries
+// (spaced 'mult' entries apart) of 'vals'
+static double
+calc_cardinal_spline(double *vals, int stride, int mult, int count, int pos
+                     , double tension)
+{
+    int last = (count - 1) * mult, i = pos - pos % mult;
+    double p0 = vals[(i > mult ? i - mult : 0) * stride];
+    double p1 = vals[i * stride], p2 = vals[(i + mult) * stride];
+    double p3 = vals[(i + 2*mult < last ? i + 2*mult : last) * stride];
+    double t = (pos - i) / (double)mult, t2 = t*t, t3 = t2*t;
+    double m1 = tension * (p2 - p0), m2 = tension * (p3 - p1);
+    return (p1 * (2.*t3 - 3.*t2 + 1.) + p2 * (-2.*t3 + 3.*t2)
+            + m1 * (t3 - 2.*t2 + t) + m2 * (t3 - t2));
+}
+
+// Fill in the interpolated points along one line of the mesh
+static void
+interpolate_line(char algo, double *vals, int stride, int mult, int count
+                 , double min_c, double dist, double tension)
+{
+    double pts[count];
+    int i;
+    for (i=0; i<count; i++)
+        pts[i] = min_c + dist * i * mult;
+    for (i=0; i<(count-1)*mult; i++) {
+        if (!(i % mult))
+            continue;
+        if (algo == 'l')
+            vals[i * stride] = calc_lagrange(vals, stride, mult, count, pts
+                                             , min_c + dist * i);
+        else
+            vals[i * stride] = calc_cardinal_spline(vals, stride, mult, count
+                                                    , i, tension);
+    }
+}
+
+// Generate the interpolated mesh from a table of probed points.  The
+// 'algo' is one of 'd'irect, 'l'agrange, or 'b'icubic.
+int __visible
+zmesh_build(struct z_mesh *zm, char algo, int px_count, int py_count
+            , int x_mult, int y_mult, double tension
+            , double min_x, double min_y, double max_x, double max_y
+            , double *probed)
+{
+    if (px_count < 2 || py_count < 2 || x_mult < 1 || y_mult < 1
+        || max_x <= min_x || max_y <= min_y
+        || (algo == 'd' && (x_mult != 1 || y_mult != 1))
+        || (algo == 'b' && (px_count < 3 || py_count < 3))
+        || (algo != 'd' && algo != 'l' && algo != 'b')) {
+        errorf("Invalid bed mesh parameters");
+        zmesh_clear(zm);
+        return -1;
+    }
+    int x_count = (px_count - 1) * x_mult + 1;
+    int y_count = (py_count - 1) * y_mult + 1;
+    zmesh_init_table(zm, x_count, y_count, min_x, min_y, max_x, max_y);
+    double *tbl = zm->z_table;
+    int i, j;
+    for (j=0; j<py_count; j++)
+        for (i=0; i<px_count; i++)
+            tbl[j * y_mult * x_count + i * x_mult] = probed[j * px_count + i];
+    if (algo != 'd') {
+        // Interpolate along the probed rows and then along each column
+        for (j=0; j<y_count; j+=y_mult)
+            interpolate_line(algo, &tbl[j * x_count], 1, x_mult, px_count
+                             , min_x, zm->x_dist, tension);
+        for (i=0; i<x_count; i++)
+            interpolate_line(algo, &tbl[i], x_count, y_mult, py_count
+                             , min_y, zm->y_dist, tension);
+    }
+    zmesh_calc_patches(zm);
+    return 0;
+}
+
+// Copy the interpolated mesh of 'src' (or remove the mesh if 'src'
+// is NULL)
+void __visible
+zmesh_copy_table(struct z_mesh *zm, struct z_mesh *src)
+{
+    if (!src || !src->z_table) {
+        zmesh_clear(zm);
+        return;
+    }
+    int x_count = src->x_count, y_count = src->y_count;
+    zmesh_init_table(zm, x_count, y_count, src->min_x, src->min_y
+                     , src->min_x + src->x_dist * (x_count - 1)
+                     , src->min_y + src->y_dist * (y_count - 1));
+    zm->x_dist = src->x_dist;
+    zm->y_dist = src->y_dist;
+    zm->inv_x_dist = src->inv_x_dist;
+    zm->inv_y_dist = src->inv_y_dist;
+    memcpy(zm->z_table, src->z_table
+           , sizeof(zm->z_table[0]) * x_count * y_count);
+    memcpy(zm->patches, src->patches
+           , sizeof(zm->patches[0]) * (x_count - 1) * (y_count - 1));
+    zm->x_offset = src->x_offset;
+    zm->y_offset = src->y_offset;
+}
+
+// Copy the interpolated mesh to 'out'
+void __visible
+zmesh_get_table(struct z_mesh *zm, double *out)
+{
+    memcpy(out, zm->z_table
+           , sizeof(zm->z_table[0]) * zm->x_count * zm->y_count);
+}
+
+void __visible
+zmesh_set_offsets(struct z_mesh *zm, double x_offset, double y_offset)
+{
+    zm->x_offset = x_offset;
+    zm->y_offset = y_offset;
+}
+
+// Set the z range over which the mesh adjustment is phased out
+void __visible
+zmesh_set_fade(struct z_mesh *zm, double fade_start, double fade_end
+               , double fade_target)
+{
+    zm->fade_start = fade_start;
+    zm->fade_end = fade_end;
+    zm->fade_dist = fade_end - fade_start;
+    zm->fade_target = fade_target;
+}
+
+void __visible
+zmesh_set_enabled(struct z_mesh *zm, int enabled)
+{
+    zm->enabled = enabled;
+}
+
+// Find the cell index and interpolation weight along one axis
+static inline int
+linear_index(double coord, double min_c, double inv_dist, int count
+             , double *t)
+{
+    double pos = (coord - min_c) * inv_dist;
+    int idx = floor(pos);
+    if (idx < 0)
+        idx = 0;
+    else if (idx > count - 2)
+        idx = count - 2;
+    double w = pos - idx;
+    *t = w < 0. ? 0. : (w > 1. ? 1. : w);
+    return idx;
+}
+
+// Bilinear interpolation of the mesh
+static inline double
+calc_mesh_z(struct z_mesh *zm, double x, double y)
+{
+    double tx, ty;
+    int xidx = linear_index(x + zm->x_offset, zm->min_x, zm->inv_x_dist
+                            , zm->x_count, &tx);
+    int yidx = linear_index(y + zm->y_offset, zm->min_y, zm->inv_y_dist
+                            , zm->y_count, &ty);
+    struct mesh_patch *mp = &zm->patches[yidx * (zm->x_count - 1) + xidx];
+    return mp->z + tx * mp->dx + ty * (mp->dy + tx * mp->dxy);
+}
+
+// Bilinear interpolation of the mesh that also calculates the slope
+// of the mesh along x and y
+static inline double
+calc_mesh_z_slope(struct z_mesh *zm, double x, double y
+                  , double *slope_x, double *slope_y)
+{
+    double tx, ty;
+    int xidx = linear_index(x + zm->x_offset, zm->min_x, zm->inv_x_dist
+                            , zm->x_count, &tx);
+    int yidx = linear_index(y + zm->y_offset, zm->min_y, zm->inv_y_dist
+                            , zm->y_count, &ty);
+    struct mesh_patch *mp = &zm->patches[yidx * (zm->x_count - 1) + xidx];
+    double px = (x + zm->x_offset - zm->min_x) * zm->inv_x_dist - xidx;
+    double py = (y + zm->y_offset - zm->min_y) * zm->inv_y_dist - yidx;
+    // The mesh is flat beyond its edges
+    *slope_x = (px == tx ? (mp->dx + ty * mp->dxy) * zm->inv_x_dist : 0.);
+    *slope_y = (py == ty ? (mp->dy + tx * mp->dxy) * zm->inv_y_dist : 0.);
+    return mp->z + tx * mp->dx + ty * (mp->dy + tx * mp->dxy);
+}
+
+double __visible
+zmesh_calc_z(struct z_mesh *zm, double x, double y)
+{
+    if (!zm->z_table)
+        return 0.;
+    return calc_mesh_z(zm, x, y);
+}
+
+// Return the z adjustment for a requested (unadjusted) position
+double __visible
+zmesh_calc_offset(struct z_mesh *zm, double x, double y, double z)
+{
+    if (!zm->enabled)
+        return 0.;
+    double factor = 1.;
+    if (z >= zm->fade_end)
+        factor = 0.;
+    else if (z >= zm->fade_start)
+        factor = (zm->fade_end - z) / zm->fade_dist;
+    double target = zm->fade_target;
+    if (!factor || !zm->z_table)
+        return target;
+    return factor * (calc_mesh_z(zm, x, y) - target) + target;
+}
+
+
+// Return the z adjustment and store its rate of change (given the
+// velocity 'v' of the requested position) in 'rate'
+static double
+zmesh_calc_offset_rate(struct z_mesh *zm, struct coord c, struct coord v
+                       , double *rate)
+{
+    *rate = 0.;
+    if (!zm->enabled)
+        return 0.;
+    double factor = 1., factor_rate = 0.;
+    if (c.z >= zm->fade_end) {
+        factor = 0.;
+    } else if (c.z >= zm->fade_start) {
+        factor = (zm->fade_end - c.z) / zm->fade_dist;
+        factor_rate = -v.z / zm->fade_dist;
+    }
+    double target = zm->fade_target;
+    if (!factor || !zm->z_table)
+        return target;
+    double slope_x, slope_y;
+    double mesh_z = calc_mesh_z_slope(zm, c.x, c.y, &slope_x, &slope_y);
+    mesh_z -= target;
+    *rate = (factor * (slope_x * v.x + slope_y * v.y)
+             + factor_rate * mesh_z);
+    return factor * mesh_z + target;
+}
+
+
+/****************************************************************
+ * Stepper kinematics wrapper
+ ****************************************************************/
+
+struct bed_mesh_stepper {
+    struct stepper_kinematics sk;
+    struct stepper_kinematics *orig_sk;
+    struct z_mesh *zm;
+    struct move m, vm;
+};
+
+#define DUMMY_T 500.0
+
+static double
+bed_mesh_calc_position(struct stepper_kinematics *sk, struct move *m
+                       , double move_time)
+{
+    struct bed_mesh_stepper *bms = container_of(
+        sk, struct bed_mesh_stepper, sk);
+    struct coord c = move_get_coord(m, move_time);
+    c.z += zmesh_calc_offset(bms->zm, c.x, c.y, c.z);
+    bms->m.start_pos = c;
+    return bms->orig_sk->calc_position_cb(bms->orig_sk, &bms->m, DUMMY_T);
+}
+
+static double
+bed_mesh_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                       , double move_time, double *velocity)
+{
+    struct bed_mesh_stepper *bms = container_of(
+        sk, struct bed_mesh_stepper, sk);
+    struct coord c = move_get_coord(m, move_time);
+    struct coord v = move_get_coord_velocity(m, move_time);
+    double rate;
+    c.z += zmesh_calc_offset_rate(bms->zm, c, v, &rate);
+    v.z += rate;
+    bms->vm.start_pos = c;
+    bms->vm.axes_r = v;
+    return bms->orig_sk->calc_velocity_cb(bms->orig_sk, &bms->vm, 0.
+                                          , velocity);
+}
+
+static void
+bed_mesh_post_fixup(struct stepper_kinematics *sk)
+{
+    struct bed_mesh_stepper *bms = container_of(
+        sk, struct bed_mesh_stepper, sk);
+    bms->orig_sk->commanded_pos = sk->commanded_pos;
+    bms->orig_sk->post_cb(bms->orig_sk);
+    sk->commanded_pos = bms->orig_sk->commanded_pos;
+}
+
+// Wrap 'orig_sk' so that its z position is adjusted by the mesh
+int __visible
+bed_mesh_set_sk(struct stepper_kinematics *sk
+                , struct stepper_kinematics *orig_sk, struct z_mesh *zm)
+{
+    if (!(orig_sk->active_flags & AF_Z))
+        return -1;
+    struct bed_mesh_stepper *bms = container_of(
+        sk, struct bed_mesh_stepper, sk);
+    bms->sk.calc_position_cb = bed_mesh_calc_position;
+    if (orig_sk->calc_velocity_cb) {
+        bms->sk.calc_velocity_cb = bed_mesh_calc_velocity;
+        // The mesh adjustment is not linear in the move time
+        bms->sk.use_newton = 1;
+    }
+    if (orig_sk->post_cb)
+        bms->sk.post_cb = bed_mesh_post_fixup;
+    bms->sk.active_flags = orig_sk->active_flags;
+    bms->sk.gen_steps_pre_active = orig_sk->gen_steps_pre_active;
+    bms->sk.gen_steps_post_active = orig_sk->gen_steps_post_active;
+    bms->orig_sk = orig_sk;
+    bms->zm = zm;
+    bms->sk.commanded_pos = orig_sk->commanded_pos;
+    bms->sk.last_flush_time = orig_sk->last_flush_time;
+    bms->sk.last_move_time = orig_sk->last_move_time;
+    return 0;
+}
+
+// While a mesh is loaded the z adjustment depends on the x and y
+// position, so the wrapped stepper is then also active on those axes
+void __visible
+bed_mesh_set_xy_active(struct stepper_kinematics *sk, int xy_active)
+{
+    struct bed_mesh_stepper *bms = container_of(
+        sk, struct bed_mesh_stepper, sk);
+    bms->sk.active_flags = bms->orig_sk->active_flags;
+    if (xy_active)
+        bms->sk.active_flags |= AF_X | AF_Y;
+}
+
+struct stepper_kinematics * __visible
+bed_mesh_stepper_alloc(void)
+{
+    struct bed_mesh_stepper *bms = malloc(sizeof(*bms));
+    memset(bms, 0, sizeof(*bms));
+    bms->m.move_t = bms->vm.move_t = 2. * DUMMY_T;
+    bms->vm.start_v = 1.;
+    return &bms->sk;
+}
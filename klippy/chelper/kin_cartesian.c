@@ -18,6 +18,14 @@ cart_stepper_x_calc_position(struct stepper_kinematics *sk, struct move *m
     return move_get_coord(m, move_time).x;
 }
 
+static double
+cart_stepper_x_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                             , double move_time, double *velocity)
+{
+    *velocity = move_get_coord_velocity(m, move_time).x;
+    return move_get_coord(m, move_time).x;
+}
+
 static double
 cart_stepper_y_calc_position(struct stepper_kinematics *sk, struct move *m
                              , double move_time)
@@ -25,6 +33,14 @@ cart_stepper_y_calc_position(struct stepper_kinematics *sk, struct move *m
     return move_get_coord(m, move_time).y;
 }
 
+static double
+cart_stepper_y_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                             , double move_time, double *velocity)
+{
+    *velocity = move_get_coord_velocity(m, move_time).y;
+    return move_get_coord(m, move_time).y;
+}
+
 static double
 cart_stepper_z_calc_position(struct stepper_kinematics *sk, struct move *m
                              , double move_time)
@@ -32,6 +48,14 @@ cart_stepper_z_calc_position(struct stepper_kinematics *sk, struct move *m
     return move_get_coord(m, move_time).z;
 }
 
+static double
+cart_stepper_z_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                             , double move_time, double *velocity)
+{
+    *velocity = move_get_coord_velocity(m, move_time).z;
+    return move_get_coord(m, move_time).z;
+}
+
 struct stepper_kinematics * __visible
 cartesian_stepper_alloc(char axis)
 {
@@ -39,12 +63,15 @@ cartesian_stepper_alloc(char axis)
     memset(sk, 0, sizeof(*sk));
     if (axis == 'x') {
         sk->calc_position_cb = cart_stepper_x_calc_position;
+        sk->calc_velocity_cb = cart_stepper_x_calc_velocity;
         sk->active_flags = AF_X;
     } else if (axis == 'y') {
         sk->calc_position_cb = cart_stepper_y_calc_position;
+        sk->calc_velocity_cb = cart_stepper_y_calc_velocity;
         sk->active_flags = AF_Y;
     } else if (axis == 'z') {
         sk->calc_position_cb = cart_stepper_z_calc_position;
+        sk->calc_velocity_cb = cart_stepper_z_calc_velocity;
         sk->active_flags = AF_Z;
     }
     return sk;
@@ -57,6 +84,15 @@ cart_reverse_stepper_x_calc_position(struct stepper_kinematics *sk
     return -move_get_coord(m, move_time).x;
 }
 
+static double
+cart_reverse_stepper_x_calc_velocity(struct stepper_kinematics *sk
+                             , struct move *m, double move_time
+                             , double *velocity)
+{
+    *velocity = -move_get_coord_velocity(m, move_time).x;
+    return -move_get_coord(m, move_time).x;
+}
+
 static double
 cart_reverse_stepper_y_calc_position(struct stepper_kinematics *sk
                              , struct move *m, double move_time)
@@ -64,6 +100,15 @@ cart_reverse_stepper_y_calc_position(struct stepper_kinematics *sk
     return -move_get_coord(m, move_time).y;
 }
 
+static double
+cart_reverse_stepper_y_calc_velocity(struct stepper_kinematics *sk
+                             , struct move *m, double move_time
+                             , double *velocity)
+{
+    *velocity = -move_get_coord_velocity(m, move_time).y;
+    return -move_get_coord(m, move_time).y;
+}
+
 static double
 cart_reverse_stepper_z_calc_position(struct stepper_kinematics *sk
                              , struct move *m, double move_time)
@@ -71,6 +116,15 @@ cart_reverse_stepper_z_calc_position(struct stepper_kinematics *sk
     return -move_get_coord(m, move_time).z;
 }
 
+static double
+cart_reverse_stepper_z_calc_velocity(struct stepper_kinematics *sk
+                             , struct move *m, double move_time
+                             , double *velocity)
+{
+    *velocity = -move_get_coord_velocity(m, move_time).z;
+    return -move_get_coord(m, move_time).z;
+}
+
 struct stepper_kinematics * __visible
 cartesian_reverse_stepper_alloc(char axis)
 {
@@ -78,12 +132,15 @@ cartesian_reverse_stepper_alloc(char axis)
     memset(sk, 0, sizeof(*sk));
     if (axis == 'x') {
         sk->calc_position_cb = cart_reverse_stepper_x_calc_position;
+        sk->calc_velocity_cb = cart_reverse_stepper_x_calc_velocity;
         sk->active_flags = AF_X;
     } else if (axis == 'y') {
         sk->calc_position_cb = cart_reverse_stepper_y_calc_position;
+        sk->calc_velocity_cb = cart_reverse_stepper_y_calc_velocity;
         sk->active_flags = AF_Y;
     } else if (axis == 'z') {
         sk->calc_position_cb = cart_reverse_stepper_z_calc_position;
+        sk->calc_velocity_cb = cart_reverse_stepper_z_calc_velocity;
         sk->active_flags = AF_Z;
     }
     return sk;
@@ -18,6 +18,17 @@ corexy_stepper_plus_calc_position(struct stepper_kinematics *sk, struct move *m
     return c.x + c.y;
 }
 
+static double
+corexy_stepper_plus_calc_velocity(struct stepper_kinematics *sk
+                                  , struct move *m, double move_time
+                                  , double *velocity)
+{
+    struct coord v = move_get_coord_velocity(m, move_time);
+    *velocity = v.x + v.y;
+    struct coord c = move_get_coord(m, move_time);
+    return c.x + c.y;
+}
+
 static double
 corexy_stepper_minus_calc_position(struct stepper_kinematics *sk, struct move *m
                                    , double move_time)
@@ -26,15 +37,29 @@ corexy_stepper_minus_calc_position(struct stepper_kinematics *sk, struct move *m
     return c.x - c.y;
 }
 
+static double
+corexy_stepper_minus_calc_velocity(struct stepper_kinematics *sk
+                                   , struct move *m, double move_time
+                                   , double *velocity)
+{
+    struct coord v = move_get_coord_velocity(m, move_time);
+    *velocity = v.x - v.y;
+    struct coord c = move_get_coord(m, move_time);
+    return c.x - c.y;
+}
+
 struct stepper_kinematics * __visible
 corexy_stepper_alloc(char type)
 {
     struct stepper_kinematics *sk = malloc(sizeof(*sk));
     memset(sk, 0, sizeof(*sk));
-    if (type == '+')
+    if (type == '+') {
         sk->calc_position_cb = corexy_stepper_plus_calc_position;
-    else if (type == '-')
+        sk->calc_velocity_cb = corexy_stepper_plus_calc_velocity;
+    } else if (type == '-') {
         sk->calc_position_cb = corexy_stepper_minus_calc_position;
+        sk->calc_velocity_cb = corexy_stepper_minus_calc_velocity;
+    }
     sk->active_flags = AF_X | AF_Y;
     return sk;
 }
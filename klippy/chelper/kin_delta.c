@@ -27,6 +27,19 @@ delta_stepper_calc_position(struct stepper_kinematics *sk, struct move *m
     return sqrt(ds->arm2 - dx*dx - dy*dy) + c.z;
 }
 
+static double
+delta_stepper_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                            , double move_time, double *velocity)
+{
+    struct delta_stepper *ds = container_of(sk, struct delta_stepper, sk);
+    struct coord c = move_get_coord(m, move_time);
+    struct coord v = move_get_coord_velocity(m, move_time);
+    double dx = ds->tower_x - c.x, dy = ds->tower_y - c.y;
+    double h = sqrt(ds->arm2 - dx*dx - dy*dy);
+    *velocity = (dx*v.x + dy*v.y) / h + v.z;
+    return h + c.z;
+}
+
 struct stepper_kinematics * __visible
 delta_stepper_alloc(double arm2, double tower_x, double tower_y)
 {
@@ -36,6 +49,8 @@ delta_stepper_alloc(double arm2, double tower_x, double tower_y)
     ds->tower_x = tower_x;
     ds->tower_y = tower_y;
     ds->sk.calc_position_cb = delta_stepper_calc_position;
+    ds->sk.calc_velocity_cb = delta_stepper_calc_velocity;
+    ds->sk.use_newton = 1;
     ds->sk.active_flags = AF_X | AF_Y | AF_Z;
     return &ds->sk;
 }
@@ -28,6 +28,19 @@ deltesian_stepper_calc_position(struct stepper_kinematics *sk, struct move *m
     return sqrt(ds->arm2 - dx*dx) + c.z;
 }
 
+static double
+deltesian_stepper_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                                , double move_time, double *velocity)
+{
+    struct deltesian_stepper *ds = container_of(
+                sk, struct deltesian_stepper, sk);
+    struct coord c = move_get_coord(m, move_time);
+    struct coord v = move_get_coord_velocity(m, move_time);
+    double dx = c.x - ds->arm_x, h = sqrt(ds->arm2 - dx*dx);
+    *velocity = v.z - dx * v.x / h;
+    return h + c.z;
+}
+
 struct stepper_kinematics * __visible
 deltesian_stepper_alloc(double arm2, double arm_x)
 {
@@ -36,6 +49,8 @@ deltesian_stepper_alloc(double arm2, double arm_x)
     ds->arm2 = arm2;
     ds->arm_x = arm_x;
     ds->sk.calc_position_cb = deltesian_stepper_calc_position;
+    ds->sk.calc_velocity_cb = deltesian_stepper_calc_velocity;
+    ds->sk.use_newton = 1;
     ds->sk.active_flags = AF_X | AF_Z;
     return &ds->sk;
 }
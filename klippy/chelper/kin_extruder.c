@@ -26,34 +26,41 @@
 //         / ((smooth_time/2)**2))
 
 // Calculate the definitive integral of the motion formula:
-//   position(t) = base + t * (start_v + t * half_accel)
+//   position(t) = base + t * (start_v + t * (half_accel + t * (c3 + t * c4)))
 static double
 extruder_integrate(double base, double start_v, double half_accel
-                   , double start, double end)
+                   , double c3, double c4, double start, double end)
 {
     double half_v = .5 * start_v, sixth_a = (1. / 3.) * half_accel;
-    double si = start * (base + start * (half_v + start * sixth_a));
-    double ei = end * (base + end * (half_v + end * sixth_a));
+    double q3 = .25 * c3, q4 = .2 * c4;
+    double sp = sixth_a + start * (q3 + start * q4);
+    double ep = sixth_a + end * (q3 + end * q4);
+    double si = start * (base + start * (half_v + start * sp));
+    double ei = end * (base + end * (half_v + end * ep));
     return ei - si;
 }
 
 // Calculate the definitive integral of time weighted position:
-//   weighted_position(t) = t * (base + t * (start_v + t * half_accel))
+//   weighted_position(t) = t * position(t)
 static double
 extruder_integrate_time(double base, double start_v, double half_accel
-                        , double start, double end)
+                        , double c3, double c4, double start, double end)
 {
     double half_b = .5 * base, third_v = (1. / 3.) * start_v;
-    double eighth_a = .25 * half_accel;
-    double si = start * start * (half_b + start * (third_v + start * eighth_a));
-    double ei = end * end * (half_b + end * (third_v + end * eighth_a));
+    double eighth_a = .25 * half_accel, q3 = .2 * c3, q4 = (1. / 6.) * c4;
+    double sp = eighth_a + start * (q3 + start * q4);
+    double ep = eighth_a + end * (q3 + end * q4);
+    double si = start * start * (half_b + start * (third_v + start * sp));
+    double ei = end * end * (half_b + end * (third_v + end * ep));
     return ei - si;
 }
 
-// Calculate the definitive integral of extruder for a given move
+// Calculate the definitive integral of extruder for a given move (the
+// unweighted integral is stored in 'pint')
 static double
 pa_move_integrate(struct move *m, double pressure_advance
-                  , double base, double start, double end, double time_offset)
+                  , double base, double start, double end, double time_offset
+                  , double *pint)
 {
     if (start < 0.)
         start = 0.;
@@ -65,40 +72,123 @@ pa_move_integrate(struct move *m, double pressure_advance
         pressure_advance = 0.;
     base += pressure_advance * m->start_v;
     double start_v = m->start_v + pressure_advance * 2. * m->half_accel;
+    double ha = m->half_accel + pressure_advance * 3. * m->scurve_c3;
+    double c3 = m->scurve_c3 + pressure_advance * 4. * m->scurve_c4;
+    double c4 = m->scurve_c4;
     // Calculate definitive integral
-    double ha = m->half_accel;
-    double iext = extruder_integrate(base, start_v, ha, start, end);
-    double wgt_ext = extruder_integrate_time(base, start_v, ha, start, end);
+    double iext = extruder_integrate(base, start_v, ha, c3, c4, start, end);
+    double wgt_ext = extruder_integrate_time(base, start_v, ha, c3, c4
+                                             , start, end);
+    *pint = iext;
     return wgt_ext - time_offset * iext;
 }
 
-// Calculate the definitive integral of the extruder over a range of moves
+// The position (with pressure advance applied) is found from running
+// integrals of the position and of the y velocity (which is the
+// pressure advance flag times the nominal velocity) that are cached
+// in each move of the trapq.  With 'w' being the smoothing weight:
+//   integral(pa_position * w) = (integral(nominal_position * w)
+//                                + pressure_advance
+//                                  * integral(flagged_velocity * w))
+
+struct pa_sum {
+    struct move *center_m;
+    double center_time, hst, pressure_advance, side;
+    double area, diff;
+};
+
+// Add the weighted integral of a section of the smoothing range.  The
+// running integrals 'a' and 'b' (and the section times 'ta' and 'tb')
+// are relative to the integral start of move 'm'.
+static void
+pa_section_add(struct pa_sum *ps, struct move *m
+               , struct move_integrals *a, struct move_integrals *b
+               , double ta, double tb)
+{
+    double pa = ps->pressure_advance;
+    double d0 = b->x - a->x + pa * (b->vel_y - a->vel_y);
+    double d1 = b->x_t - a->x_t + pa * (b->vel_y_t - a->vel_y_t);
+    // Apply the weight (half_smooth_time - abs(t - center))
+    double side = ps->side, tc = ps->center_m->print_time - m->integ_time;
+    tc += ps->center_time;
+    ps->area += ps->hst * d0 + side * (d1 - tc * d0);
+    ps->diff -= side * d0;
+    // Account for integrals relative to a different position
+    double offset = m->integ_x - ps->center_m->integ_x;
+    if (unlikely(offset)) {
+        double dt = tb - ta;
+        ps->area += offset * dt * (ps->hst + side * (.5 * (ta + tb) - tc));
+        ps->diff -= side * offset * dt;
+    }
+}
+
+// Sum the weighted integrals from 'start' in move 'm' (with running
+// integrals 'a') to 'end' in move 'end_m' (storing its running
+// integrals in 'b').  The running integrals may restart at a move.
+static void
+pa_half_integrate(struct pa_sum *ps, struct move *m, double start
+                  , struct move_integrals *a, struct move *end_m, double end
+                  , struct move_integrals *b)
+{
+    struct move_integrals s = *a;
+    double ts = m->print_time - m->integ_time + start;
+    while (unlikely(m != end_m)) {
+        struct move *next = list_next_entry(m, node);
+        if (unlikely(next->integ_time != m->integ_time)) {
+            double te = m->print_time - m->integ_time + m->move_t;
+            move_get_integrals(m, m->move_t, b);
+            pa_section_add(ps, m, &s, b, ts, te);
+            memset(&s, 0, sizeof(s));
+            ts = 0.;
+        }
+        m = next;
+    }
+    move_get_integrals(m, end, b);
+    pa_section_add(ps, m, &s, b, ts, m->print_time - m->integ_time + end);
+}
+
+// Calculate the definitive integral of the extruder over a range of
+// moves using the running integrals cached in the trapq.  The
+// difference between the unweighted integrals after and before
+// 'move_time' (the rate of change of the result) is stored in 'pdiff'.
 static double
 pa_range_integrate(struct move *m, double move_time
-                   , double pressure_advance, double hst)
+                   , double pressure_advance, double hst, double *pdiff)
 {
-    // Calculate integral for the current move
-    double res = 0., start = move_time - hst, end = move_time + hst;
-    double start_base = m->start_pos.x;
-    res += pa_move_integrate(m, pressure_advance, 0., start, move_time, start);
-    res -= pa_move_integrate(m, pressure_advance, 0., move_time, end, end);
-    // Integrate over previous moves
-    struct move *prev = m;
+    // Find the moves at the start and end of the smoothing range
+    double start = move_time - hst, end = move_time + hst;
+    struct move *start_m = m, *end_m = m;
     while (unlikely(start < 0.)) {
-        prev = list_prev_entry(prev, node);
-        start += prev->move_t;
-        double base = prev->start_pos.x - start_base;
-        res += pa_move_integrate(prev, pressure_advance, base, start
-                                 , prev->move_t, start);
+        start_m = list_prev_entry(start_m, node);
+        start += start_m->move_t;
     }
-    // Integrate over future moves
-    while (unlikely(end > m->move_t)) {
-        end -= m->move_t;
-        m = list_next_entry(m, node);
-        double base = m->start_pos.x - start_base;
-        res -= pa_move_integrate(m, pressure_advance, base, 0., end, end);
+    while (unlikely(end > end_m->move_t)) {
+        end -= end_m->move_t;
+        end_m = list_next_entry(end_m, node);
     }
-    return res;
+    if (likely(start_m == end_m)) {
+        // Range is entirely within the current move
+        double res = 0., lint, rint;
+        res += pa_move_integrate(m, pressure_advance, 0., start, move_time
+                                 , start, &lint);
+        res -= pa_move_integrate(m, pressure_advance, 0., move_time, end
+                                 , end, &rint);
+        *pdiff = rint - lint;
+        return res;
+    }
+    // Integrate each half of the range
+    struct pa_sum ps = {
+        .center_m = m, .center_time = move_time, .hst = hst,
+        .pressure_advance = pressure_advance, .side = 1.,
+    };
+    struct move_integrals si, mi, ei;
+    move_get_integrals(start_m, start, &si);
+    pa_half_integrate(&ps, start_m, start, &si, m, move_time, &mi);
+    ps.side = -1.;
+    pa_half_integrate(&ps, m, move_time, &mi, end_m, end, &ei);
+    *pdiff = ps.diff;
+    // Make the result relative to the start of the move
+    return ps.area + (m->integ_x - m->start_pos.x) * hst * hst;
 }
 
 struct extruder_stepper {
@@ -116,7 +206,24 @@ extruder_calc_position(struct stepper_kinematics *sk, struct move *m
         // Pressure advance not enabled
         return m->start_pos.x + move_get_distance(m, move_time);
     // Apply pressure advance and average over smooth_time
-    double area = pa_range_integrate(m, move_time, es->pressure_advance, hst);
+    double diff, area = pa_range_integrate(m, move_time, es->pressure_advance
+                                           , hst, &diff);
+    return m->start_pos.x + area * es->inv_half_smooth_time2;
+}
+
+static double
+extruder_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                       , double move_time, double *velocity)
+{
+    struct extruder_stepper *es = container_of(sk, struct extruder_stepper, sk);
+    double hst = es->half_smooth_time;
+    if (!hst) {
+        *velocity = move_get_velocity(m, move_time);
+        return m->start_pos.x + move_get_distance(m, move_time);
+    }
+    double diff, area = pa_range_integrate(m, move_time, es->pressure_advance
+                                           , hst, &diff);
+    *velocity = diff * es->inv_half_smooth_time2;
     return m->start_pos.x + area * es->inv_half_smooth_time2;
 }
 
@@ -128,6 +235,9 @@ extruder_set_pressure_advance(struct stepper_kinematics *sk
     double hst = smooth_time * .5;
     es->half_smooth_time = hst;
     es->sk.gen_steps_pre_active = es->sk.gen_steps_post_active = hst;
+    // Without smoothing the extruder position is a simple function of
+    // the move time and the secant method converges just as quickly
+    es->sk.use_newton = hst != 0.;
     if (! hst)
         return;
     es->inv_half_smooth_time2 = 1. / (hst * hst);
@@ -140,6 +250,7 @@ extruder_stepper_alloc(void)
     struct extruder_stepper *es = malloc(sizeof(*es));
     memset(es, 0, sizeof(*es));
     es->sk.calc_position_cb = extruder_calc_position;
+    es->sk.calc_velocity_cb = extruder_calc_velocity;
     es->sk.active_flags = AF_X;
     return &es->sk;
 }
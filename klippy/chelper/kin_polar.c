@@ -19,6 +19,17 @@ polar_stepper_radius_calc_position(struct stepper_kinematics *sk, struct move *m
     return sqrt(c.x*c.x + c.y*c.y);
 }
 
+static double
+polar_stepper_radius_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                                   , double move_time, double *velocity)
+{
+    struct coord c = move_get_coord(m, move_time);
+    struct coord v = move_get_coord_velocity(m, move_time);
+    double radius = sqrt(c.x*c.x + c.y*c.y);
+    *velocity = (c.x*v.x + c.y*v.y) / radius;
+    return radius;
+}
+
 static double
 polar_stepper_angle_calc_position(struct stepper_kinematics *sk, struct move *m
                                   , double move_time)
@@ -33,6 +44,16 @@ polar_stepper_angle_calc_position(struct stepper_kinematics *sk, struct move *m
     return angle;
 }
 
+static double
+polar_stepper_angle_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                                  , double move_time, double *velocity)
+{
+    struct coord v = move_get_coord_velocity(m, move_time);
+    struct coord c = move_get_coord(m, move_time);
+    *velocity = (c.x*v.y - c.y*v.x) / (c.x*c.x + c.y*c.y);
+    return polar_stepper_angle_calc_position(sk, m, move_time);
+}
+
 static void
 polar_stepper_angle_post_fixup(struct stepper_kinematics *sk)
 {
@@ -50,10 +71,13 @@ polar_stepper_alloc(char type)
     memset(sk, 0, sizeof(*sk));
     if (type == 'r') {
         sk->calc_position_cb = polar_stepper_radius_calc_position;
+        sk->calc_velocity_cb = polar_stepper_radius_calc_velocity;
     } else if (type == 'a') {
         sk->calc_position_cb = polar_stepper_angle_calc_position;
+        sk->calc_velocity_cb = polar_stepper_angle_calc_velocity;
         sk->post_cb = polar_stepper_angle_post_fixup;
     }
+    sk->use_newton = 1;
     sk->active_flags = AF_X | AF_Y;
     return sk;
 }
@@ -33,10 +33,25 @@ rotary_two_arm_calc(double dx, double dy, double upper_arm2, double lower_arm2)
     return atan2(scaled_elbow_y, scaled_elbow_x);
 }
 
+// Calculate the rate of change of the upper arm angle 'angle' given
+// the effector joint position (and its velocity) relative to the
+// shoulder joint.  This differentiates the lower arm constraint:
+//   (dx - ua*cos(angle))**2 + (dy - ua*sin(angle))**2 + dz**2
+//     = lower_arm**2
+static inline double
+rotary_two_arm_calc_velocity(double angle, double dx, double dy, double dz
+                             , double vx, double vy, double vz
+                             , double upper_arm)
+{
+    double c = cos(angle), s = sin(angle);
+    double ex = dx - upper_arm * c, ey = dy - upper_arm * s;
+    return -(ex*vx + ey*vy + dz*vz) / (upper_arm * (dx*s - dy*c));
+}
+
 struct rotary_stepper {
     struct stepper_kinematics sk;
     double cos, sin, shoulder_radius, shoulder_height;
-    double upper_arm2, lower_arm2;
+    double upper_arm, upper_arm2, lower_arm2;
 };
 
 static double
@@ -55,6 +70,25 @@ rotary_stepper_calc_position(struct stepper_kinematics *sk, struct move *m
                                , rs->lower_arm2 - sjz*sjz);
 }
 
+static double
+rotary_stepper_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                             , double move_time, double *velocity)
+{
+    struct rotary_stepper *rs = container_of(sk, struct rotary_stepper, sk);
+    struct coord c = move_get_coord(m, move_time);
+    struct coord v = move_get_coord_velocity(m, move_time);
+    double sjz = c.y * rs->cos - c.x * rs->sin;
+    double sjx = c.x * rs->cos + c.y * rs->sin - rs->shoulder_radius;
+    double sjy = c.z - rs->shoulder_height;
+    double vz = v.y * rs->cos - v.x * rs->sin;
+    double vx = v.x * rs->cos + v.y * rs->sin;
+    double angle = rotary_two_arm_calc(sjx, sjy, rs->upper_arm2
+                                       , rs->lower_arm2 - sjz*sjz);
+    *velocity = rotary_two_arm_calc_velocity(angle, sjx, sjy, sjz
+                                             , vx, v.z, vz, rs->upper_arm);
+    return angle;
+}
+
 struct stepper_kinematics * __visible
 rotary_delta_stepper_alloc(double shoulder_radius, double shoulder_height
                            , double angle, double upper_arm, double lower_arm)
@@ -65,9 +99,12 @@ rotary_delta_stepper_alloc(double shoulder_radius, double shoulder_height
     rs->sin = sin(angle);
     rs->shoulder_radius = shoulder_radius;
     rs->shoulder_height = shoulder_height;
+    rs->upper_arm = upper_arm;
     rs->upper_arm2 = upper_arm * upper_arm;
     rs->lower_arm2 = lower_arm * lower_arm;
     rs->sk.calc_position_cb = rotary_stepper_calc_position;
+    rs->sk.calc_velocity_cb = rotary_stepper_calc_velocity;
+    rs->sk.use_newton = 1;
     rs->sk.active_flags = AF_X | AF_Y | AF_Z;
     return &rs->sk;
 }
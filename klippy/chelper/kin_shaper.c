@@ -18,6 +18,8 @@
  * Shaper initialization
  ****************************************************************/
 
+#define SMOOTHER_MAX_COEFFS 12
+
 struct shaper_pulses {
     int num_pulses;
     struct {
@@ -61,22 +63,103 @@ init_shaper(int n, double a[], double t[], struct shaper_pulses *sp)
 }
 
 
+// Smooth shapers are defined by a polynomial kernel w(s) over the
+// normalized time s = -1..1 (covering 'smooth_time').  The integrals
+// of s^k * w(s) (k=0..4) are stored as polynomials so that the
+// convolution with the (piecewise quartic) motion can be integrated
+// analytically.  Arc moves are integrated numerically with the kernel
+// polynomial 'w'.
+struct shaper_smoother {
+    int num_coeffs;
+    double hst, inv_hst, t_offs;
+    double m1, m2, m3, m4;
+    double w[SMOOTHER_MAX_COEFFS];
+    double i0[SMOOTHER_MAX_COEFFS + 1], i1[SMOOTHER_MAX_COEFFS + 2];
+    double i2[SMOOTHER_MAX_COEFFS + 3], i3[SMOOTHER_MAX_COEFFS + 4];
+    double i4[SMOOTHER_MAX_COEFFS + 5];
+};
+
+static int
+init_smoother(int n, double c[], double smooth_time
+              , struct shaper_smoother *sm)
+{
+    memset(sm, 0, sizeof(*sm));
+    if (!n)
+        return 0;
+    if (n < 0 || n > SMOOTHER_MAX_COEFFS || smooth_time <= 0.)
+        return -1;
+    // Reverse the kernel vs its traditional definition and normalize it
+    double *w = sm->w, norm = 0.;
+    int i;
+    for (i = 0; i < n; i += 2)
+        norm += c[i] * 2. / (i + 1);
+    if (norm <= 0.)
+        return -1;
+    for (i = 0; i < n; ++i)
+        w[i] = (i & 1 ? -c[i] : c[i]) / norm;
+    // Calculate the integrals of s^k * w(s) and the moments of w(s)
+    for (i = 0; i < n; ++i) {
+        sm->i0[i+1] = w[i] / (i + 1);
+        sm->i1[i+2] = w[i] / (i + 2);
+        sm->i2[i+3] = w[i] / (i + 3);
+        sm->i3[i+4] = w[i] / (i + 4);
+        sm->i4[i+5] = w[i] / (i + 5);
+        if (i & 1) {
+            sm->m1 += w[i] * 2. / (i + 2);
+            sm->m3 += w[i] * 2. / (i + 4);
+        } else {
+            sm->m2 += w[i] * 2. / (i + 3);
+            sm->m4 += w[i] * 2. / (i + 5);
+        }
+    }
+    sm->num_coeffs = n;
+    sm->hst = .5 * smooth_time;
+    sm->inv_hst = 1. / sm->hst;
+    // Shift the kernel so that it is an identity for constant-speed motion
+    sm->t_offs = -sm->m1 * sm->hst;
+    return 0;
+}
+
+
 /****************************************************************
  * Generic position calculation via shaper convolution
  ****************************************************************/
 
-static inline double
-get_axis_position(struct move *m, int axis, double move_time)
+// Calculate the Taylor coefficients of the distance traveled by move
+// 'm' around move time 't' (for a time unit of 'scale' seconds)
+static inline void
+expand_distance(struct move *m, double t, double scale, double *p)
 {
-    double axis_r = m->axes_r.axis[axis - 'x'];
-    double start_pos = m->start_pos.axis[axis - 'x'];
-    double move_dist = move_get_distance(m, move_time);
-    return start_pos + axis_r * move_dist;
+    double c3 = m->scurve_c3, c4 = m->scurve_c4, ha = m->half_accel;
+    double s2 = scale * scale;
+    p[0] = move_get_distance(m, t);
+    p[1] = (m->start_v + (2. * ha + (3. * c3 + 4. * c4 * t) * t) * t) * scale;
+    p[2] = (ha + (3. * c3 + 6. * c4 * t) * t) * s2;
+    p[3] = (c3 + 4. * c4 * t) * s2 * scale;
+    p[4] = c4 * s2 * s2;
 }
 
-static inline double
-get_axis_position_across_moves(struct move *m, int axis, double time)
+// The shaped position is a quartic polynomial of time for as long
+// as no shaper pulse crosses a move boundary (and no pulse is on an
+// arc move).  Cache that polynomial (and the range of the move where
+// it is valid) so that most position queries from the iterative
+// solver avoid evaluating every pulse.
+// Neighboring moves may change between calls to
+// itersolve_generate_steps(), so the cache is only valid for the
+// flush time it was created with.
+struct shaper_segment {
+    struct move *m;
+    double flush_time, print_time, move_t, start_pos;
+    double start, end, origin;
+    double c0, c1, c2, c3, c4;
+    int has_arc;
+};
+
+// Find the move containing 'time' (relative to the start of move 'm')
+static inline struct move *
+find_move(struct move *m, double *ptime)
 {
+    double time = *ptime;
     while (likely(time < 0.)) {
         m = list_prev_entry(m, node);
         time += m->move_t;
@@ -85,23 +168,207 @@ get_axis_position_across_moves(struct move *m, int axis, double time)
         time -= m->move_t;
         m = list_next_entry(m, node);
     }
-    return get_axis_position(m, axis, time);
+    *ptime = time;
+    return m;
 }
 
-// Calculate the position from the convolution of the shaper with input signal
-static inline double
-calc_position(struct move *m, int axis, double move_time
-              , struct shaper_pulses *sp)
+// Determine the polynomial of the shaped position around 'move_time'
+static void
+fill_segment(struct shaper_segment *seg, struct move *m, int axis
+             , double move_time, double flush_time, struct shaper_pulses *sp)
 {
-    double res = 0.;
+    double start = 0., end = m->move_t, c[5] = { 0., 0., 0., 0., 0. };
+    int num_pulses = sp->num_pulses, has_arc = 0, i;
+    for (i = 0; i < num_pulses; ++i) {
+        double a = sp->pulses[i].a, time = move_time + sp->pulses[i].t;
+        struct move *pm = find_move(m, &time);
+        if (pm->arc_k)
+            has_arc = 1;
+        // Limit the segment to where this pulse remains within 'pm'
+        double pm_start = move_time - time;
+        if (pm_start > start)
+            start = pm_start;
+        if (pm_start + pm->move_t < end)
+            end = pm_start + pm->move_t;
+        // Expand the pulse position around 'move_time'
+        double axis_r = pm->axes_r.axis[axis - 'x'] * a, p[5];
+        expand_distance(pm, time, 1., p);
+        c[0] += a * pm->start_pos.axis[axis - 'x'] + axis_r * p[0];
+        int j;
+        for (j = 1; j < 5; ++j)
+            c[j] += axis_r * p[j];
+    }
+    seg->m = m;
+    seg->flush_time = flush_time;
+    seg->print_time = m->print_time;
+    seg->move_t = m->move_t;
+    seg->start_pos = m->start_pos.axis[axis - 'x'];
+    seg->start = start;
+    seg->end = end;
+    seg->origin = move_time;
+    seg->c0 = c[0];
+    seg->c1 = c[1];
+    seg->c2 = c[2];
+    seg->c3 = c[3];
+    seg->c4 = c[4];
+    seg->has_arc = has_arc;
+}
+
+// Sum the shaper pulses directly (used when a pulse is on an arc)
+static double
+calc_pulses_position(struct move *m, int axis, double move_time
+                     , struct shaper_pulses *sp, double *velocity)
+{
+    double res = 0., vel = 0.;
     int num_pulses = sp->num_pulses, i;
     for (i = 0; i < num_pulses; ++i) {
-        double t = sp->pulses[i].t, a = sp->pulses[i].a;
-        res += a * get_axis_position_across_moves(m, axis, move_time + t);
+        double time = move_time + sp->pulses[i].t, a = sp->pulses[i].a;
+        struct move *pm = find_move(m, &time);
+        res += a * move_get_coord(pm, time).axis[axis - 'x'];
+        if (velocity)
+            vel += a * move_get_coord_velocity(pm, time).axis[axis - 'x'];
     }
+    if (velocity)
+        *velocity = vel;
     return res;
 }
 
+// Calculate the shaped position (and optionally its velocity) using
+// the cached segment when possible
+static inline double
+calc_cached_position(struct shaper_segment *seg, struct move *m, int axis
+                     , double move_time, double flush_time
+                     , struct shaper_pulses *sp, double *velocity)
+{
+    if (unlikely(move_time < seg->start || move_time > seg->end
+                 || seg->m != m || seg->flush_time != flush_time
+                 || seg->print_time != m->print_time
+                 || seg->move_t != m->move_t
+                 || seg->start_pos != m->start_pos.axis[axis - 'x']))
+        fill_segment(seg, m, axis, move_time, flush_time, sp);
+    if (unlikely(seg->has_arc))
+        return calc_pulses_position(m, axis, move_time, sp, velocity);
+    double t = move_time - seg->origin;
+    if (velocity)
+        *velocity = seg->c1 + (2. * seg->c2 + (3. * seg->c3 + 4. * seg->c4 * t)
+                               * t) * t;
+    return seg->c0 + (seg->c1 + (seg->c2 + (seg->c3 + seg->c4 * t) * t)
+                      * t) * t;
+}
+
+
+static inline double
+poly_eval(double *p, int n, double s)
+{
+    double res = 0.;
+    while (n--)
+        res = res * s + p[n];
+    return res;
+}
+
+// Gauss-Legendre quadrature nodes and weights (8 points on -1..1)
+static const double gl_nodes[4] = {
+    0.1834346424956498, 0.5255324099163290,
+    0.7966664774136267, 0.9602898564975363 };
+static const double gl_weights[4] = {
+    0.3626837833783620, 0.3137066458778873,
+    0.2223810344533745, 0.1012285362903763 };
+
+// Numerically integrate the kernel weighted position of an arc move
+static double
+smoother_integrate_arc(struct shaper_smoother *sm, struct move *m, int axis
+                       , double t0, double s_start, double s_end
+                       , double *velocity)
+{
+    int n = sm->num_coeffs, i, j;
+    double mid = .5 * (s_start + s_end), half = .5 * (s_end - s_start);
+    double res = 0., vel = 0.;
+    for (i = 0; i < 4; ++i) {
+        for (j = -1; j <= 1; j += 2) {
+            double s = mid + j * half * gl_nodes[i], t = t0 + s * sm->hst;
+            double w = gl_weights[i] * poly_eval(sm->w, n, s);
+            res += w * move_get_coord(m, t).axis[axis - 'x'];
+            if (velocity)
+                vel += w * move_get_coord_velocity(m, t).axis[axis - 'x'];
+        }
+    }
+    if (velocity)
+        *velocity += vel * half;
+    return res * half;
+}
+
+// Integrate the kernel weighted position of move 'm' over the given
+// normalized time range ('t0' is the move time at s=0).  The kernel
+// weighted velocity is optionally added to 'velocity'.
+static double
+smoother_integrate(struct shaper_smoother *sm, struct move *m, int axis
+                   , double t0, double s_start, double s_end
+                   , double *velocity)
+{
+    if (unlikely(m->arc_k))
+        return smoother_integrate_arc(sm, m, axis, t0, s_start, s_end
+                                      , velocity);
+    int n = sm->num_coeffs;
+    double m0 = poly_eval(sm->i0, n+1, s_end) - poly_eval(sm->i0, n+1, s_start);
+    double m1 = poly_eval(sm->i1, n+2, s_end) - poly_eval(sm->i1, n+2, s_start);
+    double m2 = poly_eval(sm->i2, n+3, s_end) - poly_eval(sm->i2, n+3, s_start);
+    double axis_r = m->axes_r.axis[axis - 'x'], p[5];
+    expand_distance(m, t0, sm->hst, p);
+    double res = (m->start_pos.axis[axis - 'x'] * m0
+                  + axis_r * (p[0] * m0 + p[1] * m1 + p[2] * m2));
+    double vel = p[1] * m0 + 2. * p[2] * m1;
+    if (unlikely(m->scurve_c3)) {
+        double m3 = (poly_eval(sm->i3, n+4, s_end)
+                     - poly_eval(sm->i3, n+4, s_start));
+        double m4 = (poly_eval(sm->i4, n+5, s_end)
+                     - poly_eval(sm->i4, n+5, s_start));
+        res += axis_r * (p[3] * m3 + p[4] * m4);
+        vel += 3. * p[3] * m2 + 4. * p[4] * m3;
+    }
+    if (velocity)
+        *velocity += axis_r * vel * sm->inv_hst;
+    return res;
+}
+
+// Calculate the position (and optionally its velocity) from the
+// convolution of the smoother kernel with the input signal
+static double
+calc_smoothed_position(struct move *m, int axis, double move_time
+                       , struct shaper_smoother *sm, double *velocity)
+{
+    double hst = sm->hst, t0 = move_time + sm->t_offs;
+    if (likely(t0 >= hst && t0 + hst <= m->move_t && !m->arc_k)) {
+        // Kernel is entirely within the current move
+        double axis_r = m->axes_r.axis[axis - 'x'], p[5];
+        expand_distance(m, t0, hst, p);
+        if (velocity)
+            *velocity = axis_r * sm->inv_hst * (
+                p[1] + 2. * p[2] * sm->m1 + 3. * p[3] * sm->m2
+                + 4. * p[4] * sm->m3);
+        return (m->start_pos.axis[axis - 'x']
+                + axis_r * (p[0] + p[1] * sm->m1 + p[2] * sm->m2
+                            + p[3] * sm->m3 + p[4] * sm->m4));
+    }
+    while (unlikely(t0 < hst)) {
+        m = list_prev_entry(m, node);
+        t0 += m->move_t;
+    }
+    // Integrate over each move within the kernel time range
+    double res = 0., s_start = -1.;
+    if (velocity)
+        *velocity = 0.;
+    for (;;) {
+        double s_end = (m->move_t - t0) * sm->inv_hst;
+        if (s_end >= 1.)
+            return res + smoother_integrate(sm, m, axis, t0, s_start, 1.
+                                            , velocity);
+        res += smoother_integrate(sm, m, axis, t0, s_start, s_end, velocity);
+        s_start = s_end;
+        t0 -= m->move_t;
+        m = list_next_entry(m, node);
+    }
+}
+
 
 /****************************************************************
  * Kinematics-related shaper code
@@ -109,22 +376,46 @@ calc_position(struct move *m, int axis, double move_time
 
 #define DUMMY_T 500.0
 
+struct shaper_axis {
+    struct shaper_pulses sp;
+    struct shaper_segment seg;
+    struct shaper_smoother sm;
+};
+
 struct input_shaper {
     struct stepper_kinematics sk;
     struct stepper_kinematics *orig_sk;
-    struct move m;
-    struct shaper_pulses sx, sy;
+    struct move m, vm;
+    struct shaper_axis sx, sy;
 };
 
+static inline int
+shaper_axis_is_active(struct shaper_axis *sa)
+{
+    return sa->sp.num_pulses || sa->sm.num_coeffs;
+}
+
+static inline double
+shaper_axis_calc_position(struct shaper_axis *sa, struct move *m, int axis
+                          , double move_time, double flush_time
+                          , double *velocity)
+{
+    if (sa->sp.num_pulses)
+        return calc_cached_position(&sa->seg, m, axis, move_time, flush_time
+                                    , &sa->sp, velocity);
+    return calc_smoothed_position(m, axis, move_time, &sa->sm, velocity);
+}
+
 // Optimized calc_position when only x axis is needed
 static double
 shaper_x_calc_position(struct stepper_kinematics *sk, struct move *m
                        , double move_time)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (!is->sx.num_pulses)
+    if (!shaper_axis_is_active(&is->sx))
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
-    is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx);
+    is->m.start_pos.x = shaper_axis_calc_position(
+        &is->sx, m, 'x', move_time, sk->last_flush_time, NULL);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
@@ -134,9 +425,10 @@ shaper_y_calc_position(struct stepper_kinematics *sk, struct move *m
                        , double move_time)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (!is->sy.num_pulses)
+    if (!shaper_axis_is_active(&is->sy))
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
-    is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy);
+    is->m.start_pos.y = shaper_axis_calc_position(
+        &is->sy, m, 'y', move_time, sk->last_flush_time, NULL);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
@@ -146,21 +438,52 @@ shaper_xy_calc_position(struct stepper_kinematics *sk, struct move *m
                         , double move_time)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    if (!is->sx.num_pulses && !is->sy.num_pulses)
+    int x_active = shaper_axis_is_active(&is->sx);
+    int y_active = shaper_axis_is_active(&is->sy);
+    if (!x_active && !y_active)
         return is->orig_sk->calc_position_cb(is->orig_sk, m, move_time);
     is->m.start_pos = move_get_coord(m, move_time);
-    if (is->sx.num_pulses)
-        is->m.start_pos.x = calc_position(m, 'x', move_time, &is->sx);
-    if (is->sy.num_pulses)
-        is->m.start_pos.y = calc_position(m, 'y', move_time, &is->sy);
+    if (x_active)
+        is->m.start_pos.x = shaper_axis_calc_position(
+            &is->sx, m, 'x', move_time, sk->last_flush_time, NULL);
+    if (y_active)
+        is->m.start_pos.y = shaper_axis_calc_position(
+            &is->sy, m, 'y', move_time, sk->last_flush_time, NULL);
     return is->orig_sk->calc_position_cb(is->orig_sk, &is->m, DUMMY_T);
 }
 
-int __visible
-input_shaper_set_sk(struct stepper_kinematics *sk
-                    , struct stepper_kinematics *orig_sk)
+// Velocity (and position) of the shaped stepper.  The original
+// kinematics are evaluated with a move at the shaped position moving
+// with the shaped velocity.
+static double
+shaper_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                     , double move_time, double *velocity)
 {
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    struct stepper_kinematics *orig_sk = is->orig_sk;
+    int x_active = shaper_axis_is_active(&is->sx);
+    int y_active = shaper_axis_is_active(&is->sy);
+    if (!x_active && !y_active)
+        return orig_sk->calc_velocity_cb(orig_sk, m, move_time, velocity);
+    struct coord c = move_get_coord(m, move_time);
+    struct coord v = move_get_coord_velocity(m, move_time);
+    if (x_active)
+        c.x = shaper_axis_calc_position(&is->sx, m, 'x', move_time
+                                        , sk->last_flush_time, &v.x);
+    if (y_active)
+        c.y = shaper_axis_calc_position(&is->sy, m, 'y', move_time
+                                        , sk->last_flush_time, &v.y);
+    is->vm.start_pos = c;
+    is->vm.axes_r = v;
+    return orig_sk->calc_velocity_cb(orig_sk, &is->vm, 0., velocity);
+}
+
+// Select the shaping callbacks for the axes the wrapped stepper
+// kinematics are active on (these may change, eg with bed_mesh)
+static int
+shaper_set_active_flags(struct input_shaper *is
+                        , struct stepper_kinematics *orig_sk)
+{
     if (orig_sk->active_flags == AF_X)
         is->sk.calc_position_cb = shaper_x_calc_position;
     else if (orig_sk->active_flags == AF_Y)
@@ -169,7 +492,20 @@ input_shaper_set_sk(struct stepper_kinematics *sk
         is->sk.calc_position_cb = shaper_xy_calc_position;
     else
         return -1;
+    is->sk.use_newton = orig_sk->use_newton;
     is->sk.active_flags = orig_sk->active_flags;
+    return 0;
+}
+
+int __visible
+input_shaper_set_sk(struct stepper_kinematics *sk
+                    , struct stepper_kinematics *orig_sk)
+{
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    if (shaper_set_active_flags(is, orig_sk))
+        return -1;
+    if (orig_sk->calc_velocity_cb)
+        is->sk.calc_velocity_cb = shaper_calc_velocity;
     is->orig_sk = orig_sk;
     is->sk.commanded_pos = orig_sk->commanded_pos;
     is->sk.last_flush_time = orig_sk->last_flush_time;
@@ -177,20 +513,33 @@ input_shaper_set_sk(struct stepper_kinematics *sk
     return 0;
 }
 
+// Note the time range before and after a move that affects the axis
+static void
+shaper_axis_window(struct shaper_axis *sa, double *pre_active
+                   , double *post_active)
+{
+    double pre = 0., post = 0.;
+    if (sa->sp.num_pulses) {
+        pre = sa->sp.pulses[sa->sp.num_pulses-1].t;
+        post = -sa->sp.pulses[0].t;
+    } else if (sa->sm.num_coeffs) {
+        pre = sa->sm.hst + sa->sm.t_offs;
+        post = sa->sm.hst - sa->sm.t_offs;
+    }
+    if (pre > *pre_active)
+        *pre_active = pre;
+    if (post > *post_active)
+        *post_active = post;
+}
+
 static void
 shaper_note_generation_time(struct input_shaper *is)
 {
     double pre_active = 0., post_active = 0.;
-    if ((is->sk.active_flags & AF_X) && is->sx.num_pulses) {
-        pre_active = is->sx.pulses[is->sx.num_pulses-1].t;
-        post_active = -is->sx.pulses[0].t;
-    }
-    if ((is->sk.active_flags & AF_Y) && is->sy.num_pulses) {
-        pre_active = is->sy.pulses[is->sy.num_pulses-1].t > pre_active
-            ? is->sy.pulses[is->sy.num_pulses-1].t : pre_active;
-        post_active = -is->sy.pulses[0].t > post_active
-            ? -is->sy.pulses[0].t : post_active;
-    }
+    if (is->sk.active_flags & AF_X)
+        shaper_axis_window(&is->sx, &pre_active, &post_active);
+    if (is->sk.active_flags & AF_Y)
+        shaper_axis_window(&is->sy, &pre_active, &post_active);
     is->sk.gen_steps_pre_active = pre_active;
     is->sk.gen_steps_post_active = post_active;
 }
@@ -202,12 +551,29 @@ input_shaper_set_shaper_params(struct stepper_kinematics *sk, char axis
     if (axis != 'x' && axis != 'y')
         return -1;
     struct input_shaper *is = container_of(sk, struct input_shaper, sk);
-    struct shaper_pulses *sp = axis == 'x' ? &is->sx : &is->sy;
+    struct shaper_axis *sa = axis == 'x' ? &is->sx : &is->sy;
     int status = 0;
-    if (is->orig_sk->active_flags & (axis == 'x' ? AF_X : AF_Y))
-        status = init_shaper(n, a, t, sp);
-    else
-        sp->num_pulses = 0;
+    memset(sa, 0, sizeof(*sa));
+    shaper_set_active_flags(is, is->orig_sk);
+    if (is->sk.active_flags & (axis == 'x' ? AF_X : AF_Y))
+        status = init_shaper(n, a, t, &sa->sp);
+    shaper_note_generation_time(is);
+    return status;
+}
+
+int __visible
+input_shaper_set_smoother_params(struct stepper_kinematics *sk, char axis
+                                 , int n, double c[], double smooth_time)
+{
+    if (axis != 'x' && axis != 'y')
+        return -1;
+    struct input_shaper *is = container_of(sk, struct input_shaper, sk);
+    struct shaper_axis *sa = axis == 'x' ? &is->sx : &is->sy;
+    int status = 0;
+    memset(sa, 0, sizeof(*sa));
+    shaper_set_active_flags(is, is->orig_sk);
+    if (is->sk.active_flags & (axis == 'x' ? AF_X : AF_Y))
+        status = init_smoother(n, c, smooth_time, &sa->sm);
     shaper_note_generation_time(is);
     return status;
 }
@@ -225,6 +591,7 @@ input_shaper_alloc(void)
 {
     struct input_shaper *is = malloc(sizeof(*is));
     memset(is, 0, sizeof(*is));
-    is->m.move_t = 2. * DUMMY_T;
+    is->m.move_t = is->vm.move_t = 2. * DUMMY_T;
+    is->vm.start_v = 1.;
     return &is->sk;
 }
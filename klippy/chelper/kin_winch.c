@@ -28,6 +28,20 @@ winch_stepper_calc_position(struct stepper_kinematics *sk, struct move *m
     return sqrt(dx*dx + dy*dy + dz*dz);
 }
 
+static double
+winch_stepper_calc_velocity(struct stepper_kinematics *sk, struct move *m
+                            , double move_time, double *velocity)
+{
+    struct winch_stepper *hs = container_of(sk, struct winch_stepper, sk);
+    struct coord c = move_get_coord(m, move_time);
+    struct coord v = move_get_coord_velocity(m, move_time);
+    double dx = hs->anchor.x - c.x, dy = hs->anchor.y - c.y;
+    double dz = hs->anchor.z - c.z;
+    double dist = sqrt(dx*dx + dy*dy + dz*dz);
+    *velocity = -(dx*v.x + dy*v.y + dz*v.z) / dist;
+    return dist;
+}
+
 struct stepper_kinematics * __visible
 winch_stepper_alloc(double anchor_x, double anchor_y, double anchor_z)
 {
@@ -37,6 +51,8 @@ winch_stepper_alloc(double anchor_x, double anchor_y, double anchor_z)
     hs->anchor.y = anchor_y;
     hs->anchor.z = anchor_z;
     hs->sk.calc_position_cb = winch_stepper_calc_position;
+    hs->sk.calc_velocity_cb = winch_stepper_calc_velocity;
+    hs->sk.use_newton = 1;
     hs->sk.active_flags = AF_X | AF_Y | AF_Z;
     return &hs->sk;
 }
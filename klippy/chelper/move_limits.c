@@ -0,0 +1,167 @@
+// Kinematic range and speed checks of a series of toolhead moves
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <math.h> // sqrt, fabs
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+
+// Limits of a kinematic robot (equivalent to the check_move() code
+// of the cartesian, corexy, corexz, and delta kinematics)
+struct move_limits {
+    double axis_min[3], axis_max[3];
+    double max_z_velocity, max_z_accel;
+    // Delta build radius limits
+    int is_delta;
+    double radius, min_arm_length, limit_z;
+    double max_xy2, slow_xy2, very_slow_xy2;
+    double max_velocity, max_accel;
+};
+
+struct move_limits * __visible
+move_limits_alloc(void)
+{
+    struct move_limits *ml = malloc(sizeof(*ml));
+    memset(ml, 0, sizeof(*ml));
+    int i;
+    for (i=0; i<3; i++) {
+        ml->axis_min[i] = 1.;
+        ml->axis_max[i] = -1.;
+    }
+    return ml;
+}
+
+// Set the valid range of an axis (min > max if the axis is not homed)
+void __visible
+move_limits_set_range(struct move_limits *ml, int axis
+                      , double min_pos, double max_pos)
+{
+    if (axis < 0 || axis > 2)
+        return;
+    ml->axis_min[axis] = min_pos;
+    ml->axis_max[axis] = max_pos;
+}
+
+void __visible
+move_limits_set_z_limits(struct move_limits *ml, double max_z_velocity
+                         , double max_z_accel)
+{
+    ml->max_z_velocity = max_z_velocity;
+    ml->max_z_accel = max_z_accel;
+}
+
+// Use the build radius of a delta robot instead of an xy range
+void __visible
+move_limits_set_delta(struct move_limits *ml, double radius
+                      , double min_arm_length, double limit_z
+                      , double max_xy2, double slow_xy2, double very_slow_xy2
+                      , double max_velocity, double max_accel)
+{
+    ml->is_delta = 1;
+    ml->radius = radius;
+    ml->min_arm_length = min_arm_length;
+    ml->limit_z = limit_z;
+    ml->max_xy2 = max_xy2;
+    ml->slow_xy2 = slow_xy2;
+    ml->very_slow_xy2 = very_slow_xy2;
+    ml->max_velocity = max_velocity;
+    ml->max_accel = max_accel;
+}
+
+static inline void
+limit_speed(double *limits, double speed, double accel)
+{
+    if (speed < limits[0])
+        limits[0] = speed;
+    if (accel < limits[1])
+        limits[1] = accel;
+}
+
+static int
+check_cartesian(struct move_limits *ml, double *end, double *d)
+{
+    if (end[0] < ml->axis_min[0] || end[0] > ml->axis_max[0]
+        || end[1] < ml->axis_min[1] || end[1] > ml->axis_max[1] || d[2]) {
+        int i;
+        for (i=0; i<3; i++)
+            if (d[i] && (end[i] < ml->axis_min[i] || end[i] > ml->axis_max[i]))
+                return -1;
+    }
+    return 0;
+}
+
+static int
+check_delta(struct move_limits *ml, double *start, double *end, double *limits)
+{
+    double end_xy2 = end[0]*end[0] + end[1]*end[1], end_z = end[2];
+    double limit_xy2 = ml->max_xy2;
+    if (end_z > ml->limit_z) {
+        double above_z_limit = end_z - ml->limit_z;
+        double arm_z = ml->min_arm_length - above_z_limit;
+        double allowed_radius = ml->radius - sqrt(
+            ml->min_arm_length * ml->min_arm_length - arm_z * arm_z);
+        if (allowed_radius * allowed_radius < limit_xy2)
+            limit_xy2 = allowed_radius * allowed_radius;
+    }
+    if (end_xy2 > limit_xy2 || end_z > ml->axis_max[2]
+        || end_z < ml->axis_min[2])
+        return -1;
+    // Limit the speed/accel of this move if is is at the extreme
+    // end of the build envelope
+    double extreme_xy2 = start[0]*start[0] + start[1]*start[1];
+    if (end_xy2 > extreme_xy2)
+        extreme_xy2 = end_xy2;
+    if (extreme_xy2 > ml->slow_xy2) {
+        double r = extreme_xy2 > ml->very_slow_xy2 ? 0.25 : 0.5;
+        limit_speed(limits, ml->max_velocity * r, ml->max_accel * r);
+    }
+    return 0;
+}
+
+// Check the moves from 'start_pos' through each of the 'count' xyze
+// 'coords'.  The velocity and acceleration in 'limits' are reduced to
+// the maximums permitted along all the moves.  The start and end
+// index of the move with the largest extrusion to distance ratio,
+// followed by those of the last move, are stored in 'moves' (an index
+// of -1 refers to 'start_pos').  Returns -1 if a move is out of range
+// (the caller should then check each move so that a detailed error
+// can be reported).
+int __visible
+move_limits_check(struct move_limits *ml, double *start_pos, double *coords
+                  , int count, double *limits, int *moves)
+{
+    double *start = start_pos, max_extrude_r = -1.;
+    int i, j, start_index = -1;
+    moves[0] = moves[1] = moves[2] = moves[3] = -1;
+    for (i=0; i<count; i++) {
+        double *end = &coords[i*4], d[4];
+        for (j=0; j<4; j++)
+            d[j] = end[j] - start[j];
+        double move_d = sqrt(d[0]*d[0] + d[1]*d[1] + d[2]*d[2]);
+        if (move_d < .000000001)
+            // Not a kinematic move
+            continue;
+        int ret = (ml->is_delta ? check_delta(ml, start, end, limits)
+                   : check_cartesian(ml, end, d));
+        if (ret)
+            return -1;
+        if (d[2]) {
+            // Move with Z - update velocity and accel for slower Z axis
+            double z_ratio = move_d / fabs(d[2]);
+            limit_speed(limits, ml->max_z_velocity * z_ratio
+                        , ml->max_z_accel * z_ratio);
+        }
+        double extrude_r = fabs(d[3]) / move_d;
+        if (extrude_r > max_extrude_r) {
+            max_extrude_r = extrude_r;
+            moves[0] = start_index;
+            moves[1] = i;
+        }
+        moves[2] = start_index;
+        moves[3] = i;
+        start = end;
+        start_index = i;
+    }
+    return 0;
+}
@@ -12,6 +12,7 @@
 // clock times, prioritizes commands, and handles retransmissions.  A
 // background thread is launched to do this work and minimize latency.
 
+#include <errno.h> // errno
 #include <linux/can.h> // // struct can_frame
 #include <math.h> // fabs
 #include <pthread.h> // pthread_mutex_lock
@@ -20,6 +21,8 @@
 #include <stdio.h> // snprintf
 #include <stdlib.h> // malloc
 #include <string.h> // memset
+#include <sys/mman.h> // mmap
+#include <sys/socket.h> // recvmsg
 #include <termios.h> // tcflush
 #include <unistd.h> // pipe
 #include "compiler.h" // __visible
@@ -28,6 +31,7 @@
 #include "pollreactor.h" // pollreactor_alloc
 #include "pyhelper.h" // get_monotonic
 #include "serialqueue.h" // struct queue_message
+#include "shm_ring.h" // shm_ring_write
 
 struct command_queue {
     struct list_head upcoming_queue, ready_queue;
@@ -39,6 +43,8 @@ struct serialqueue {
     struct pollreactor *pr;
     int serial_fd, serial_fd_type, client_id;
     int pipe_fds[2];
+    struct shm_region *shm;
+    int shm_kick_fd;
     uint8_t input_buf[4096];
     uint8_t need_sync;
     int input_pos;
@@ -84,6 +90,7 @@ struct serialqueue {
 #define SQT_UART 'u'
 #define SQT_CAN 'c'
 #define SQT_DEBUGFILE 'f'
+#define SQT_SHM 's'
 
 #define MIN_RTO 0.025
 #define MAX_RTO 5.000
@@ -136,6 +143,49 @@ kick_bg_thread(struct serialqueue *sq)
         report_errno("pipe write", ret);
 }
 
+
+/****************************************************************
+ * Shared memory transport
+ ****************************************************************/
+
+// Obtain the shared memory region and eventfds from the mcu process
+static int
+shm_setup(struct serialqueue *sq, int sock_fd)
+{
+    int fds[3];
+    char dummy;
+    struct iovec iov = { .iov_base = &dummy, .iov_len = sizeof(dummy) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cbuf;
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf.buf, .msg_controllen = sizeof(cbuf.buf),
+    };
+    int ret = recvmsg(sock_fd, &msg, 0);
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    if (ret <= 0 || !cmsg || cmsg->cmsg_type != SCM_RIGHTS
+        || cmsg->cmsg_len != CMSG_LEN(sizeof(fds))) {
+        report_errno("shm recvmsg", ret);
+        return -1;
+    }
+    memcpy(fds, CMSG_DATA(cmsg), sizeof(fds));
+    sq->shm = mmap(NULL, sizeof(*sq->shm), PROT_READ | PROT_WRITE
+                   , MAP_SHARED, fds[0], 0);
+    close(fds[0]);
+    if (sq->shm == MAP_FAILED) {
+        report_errno("shm mmap", -1);
+        sq->shm = NULL;
+        close(fds[1]);
+        close(fds[2]);
+        return -1;
+    }
+    sq->shm_kick_fd = fds[1];
+    sq->serial_fd = fds[2];
+    return 0;
+}
+
 // Minimum number of bits in a canbus message
 #define CANBUS_PACKET_BITS ((1 + 11 + 3 + 4) + (16 + 2 + 7 + 3))
 #define CANBUS_IFS_BITS 4
@@ -295,11 +345,60 @@ handle_message(struct serialqueue *sq, double eventtime, int len)
     pthread_mutex_unlock(&sq->lock);
 }
 
+// Process all complete message blocks in the input buffer
+static void
+input_process(struct serialqueue *sq, double eventtime)
+{
+    for (;;) {
+        int len = msgblock_check(&sq->need_sync, sq->input_buf, sq->input_pos);
+        if (!len)
+            // Need more data
+            return;
+        if (len > 0) {
+            // Received a valid message
+            handle_message(sq, eventtime, len);
+        } else {
+            // Skip bad data at beginning of input
+            len = -len;
+            pthread_mutex_lock(&sq->lock);
+            sq->bytes_invalid += len;
+            pthread_mutex_unlock(&sq->lock);
+        }
+        sq->input_pos -= len;
+        if (sq->input_pos)
+            memmove(sq->input_buf, &sq->input_buf[len], sq->input_pos);
+    }
+}
+
+// Callback for input activity on the shared memory eventfd
+static void
+shm_input_event(struct serialqueue *sq, double eventtime)
+{
+    uint64_t count;
+    int ret = read(sq->serial_fd, &count, sizeof(count));
+    if (ret < 0 && errno != EAGAIN) {
+        report_errno("eventfd read", ret);
+        pollreactor_do_exit(sq->pr);
+        return;
+    }
+    for (;;) {
+        ret = shm_ring_read(&sq->shm->to_host, &sq->input_buf[sq->input_pos]
+                            , sizeof(sq->input_buf) - sq->input_pos);
+        if (!ret)
+            return;
+        sq->input_pos += ret;
+        input_process(sq, eventtime);
+    }
+}
+
 // Callback for input activity on the serial fd
 static void
 input_event(struct serialqueue *sq, double eventtime)
 {
-    if (sq->serial_fd_type == SQT_CAN) {
+    if (sq->serial_fd_type == SQT_SHM) {
+        shm_input_event(sq, eventtime);
+        return;
+    } else if (sq->serial_fd_type == SQT_CAN) {
         struct can_frame cf;
         int ret = read(sq->serial_fd, &cf, sizeof(cf));
         if (ret <= 0) {
@@ -324,25 +423,7 @@ input_event(struct serialqueue *sq, double eventtime)
         }
         sq->input_pos += ret;
     }
-    for (;;) {
-        int len = msgblock_check(&sq->need_sync, sq->input_buf, sq->input_pos);
-        if (!len)
-            // Need more data
-            return;
-        if (len > 0) {
-            // Received a valid message
-            handle_message(sq, eventtime, len);
-        } else {
-            // Skip bad data at beginning of input
-            len = -len;
-            pthread_mutex_lock(&sq->lock);
-            sq->bytes_invalid += len;
-            pthread_mutex_unlock(&sq->lock);
-        }
-        sq->input_pos -= len;
-        if (sq->input_pos)
-            memmove(sq->input_buf, &sq->input_buf[len], sq->input_pos);
-    }
+    input_process(sq, eventtime);
 }
 
 // Callback for input activity on the pipe fd (wakes command_event)
@@ -360,6 +441,16 @@ kick_event(struct serialqueue *sq, double eventtime)
 static void
 do_write(struct serialqueue *sq, void *buf, int buflen)
 {
+    if (sq->serial_fd_type == SQT_SHM) {
+        // If the ring is full the whole write is skipped - the message
+        // blocks remain on sent_queue and are retransmitted later
+        shm_ring_write(&sq->shm->to_mcu, buf, buflen);
+        uint64_t kick = 1;
+        int ret = write(sq->shm_kick_fd, &kick, sizeof(kick));
+        if (ret < 0)
+            report_errno("eventfd write", ret);
+        return;
+    }
     if (sq->serial_fd_type != SQT_CAN) {
         int ret = write(sq->serial_fd, buf, buflen);
         if (ret < 0)
@@ -623,18 +714,25 @@ serialqueue_alloc(int serial_fd, char serial_fd_type, int client_id)
     sq->serial_fd_type = serial_fd_type;
     sq->client_id = client_id;
 
-    int ret = pipe(sq->pipe_fds);
+    int ret;
+    if (serial_fd_type == SQT_SHM) {
+        ret = shm_setup(sq, serial_fd);
+        if (ret)
+            goto fail;
+    }
+
+    ret = pipe(sq->pipe_fds);
     if (ret)
         goto fail;
 
     // Reactor setup
     sq->pr = pollreactor_alloc(SQPF_NUM, SQPT_NUM, sq);
-    pollreactor_add_fd(sq->pr, SQPF_SERIAL, serial_fd, input_event
+    pollreactor_add_fd(sq->pr, SQPF_SERIAL, sq->serial_fd, input_event
                        , serial_fd_type==SQT_DEBUGFILE);
     pollreactor_add_fd(sq->pr, SQPF_PIPE, sq->pipe_fds[0], kick_event, 0);
     pollreactor_add_timer(sq->pr, SQPT_RETRANSMIT, retransmit_event);
     pollreactor_add_timer(sq->pr, SQPT_COMMAND, command_event);
-    fd_set_non_blocking(serial_fd);
+    fd_set_non_blocking(sq->serial_fd);
     fd_set_non_blocking(sq->pipe_fds[0]);
     fd_set_non_blocking(sq->pipe_fds[1]);
 
@@ -718,6 +816,11 @@ serialqueue_free(struct serialqueue *sq)
     }
     pthread_mutex_unlock(&sq->lock);
     pollreactor_free(sq->pr);
+    if (sq->shm) {
+        munmap(sq->shm, sizeof(*sq->shm));
+        close(sq->shm_kick_fd);
+        close(sq->serial_fd);
+    }
     free(sq);
 }
 
@@ -32,7 +32,7 @@ struct stepcompress {
     // Buffer management
     uint32_t *queue, *queue_end, *queue_pos, *queue_next;
     // Internal tracking
-    uint32_t max_error;
+    uint32_t max_error, error_ratio;
     double mcu_time_offset, mcu_freq, last_step_print_time;
     // Message generation
     uint64_t last_step_clock;
@@ -46,6 +46,8 @@ struct stepcompress {
     // History tracking
     int64_t last_position;
     struct list_head history_list;
+    // Statistics
+    uint64_t msg_bytes;
 };
 
 struct step_move {
@@ -85,13 +87,16 @@ struct points {
 };
 
 // Given a requested step time, return the minimum and maximum
-// acceptable times
+// acceptable times.  The error is limited to a fraction (error_ratio
+// in 1/65536 units) of the time since the previous step, so that
+// faster step rates get a proportionally tighter error budget.
 static inline struct points
 minmax_point(struct stepcompress *sc, uint32_t *pos)
 {
     uint32_t lsc = sc->last_step_clock, point = *pos - lsc;
     uint32_t prevpoint = pos > sc->queue_pos ? *(pos-1) - lsc : 0;
-    uint32_t max_error = (point - prevpoint) / 2;
+    uint32_t max_error = ((uint64_t)(point - prevpoint) * sc->error_ratio
+                          >> 16);
     if (max_error > sc->max_error)
         max_error = sc->max_error;
     return (struct points){ point - max_error, point };
@@ -243,6 +248,8 @@ check_line(struct stepcompress *sc, struct step_move move)
  * Step compress interface
  ****************************************************************/
 
+#define ERROR_RATIO_MAX 0x8000
+
 // Allocate a new 'stepcompress' object
 struct stepcompress * __visible
 stepcompress_alloc(uint32_t oid)
@@ -253,6 +260,7 @@ stepcompress_alloc(uint32_t oid)
     list_init(&sc->history_list);
     sc->oid = oid;
     sc->sdir = -1;
+    sc->error_ratio = ERROR_RATIO_MAX;
     return sc;
 }
 
@@ -266,6 +274,17 @@ stepcompress_fill(struct stepcompress *sc, uint32_t max_error
     sc->set_next_step_dir_msgtag = set_next_step_dir_msgtag;
 }
 
+// Set the maximum step time error as a fraction of the step interval
+void __visible
+stepcompress_set_error_ratio(struct stepcompress *sc, double error_ratio)
+{
+    if (error_ratio < 0. || error_ratio > .5)
+        error_ratio = .5;
+    sc->error_ratio = error_ratio * 65536. + .5;
+    if (sc->error_ratio > ERROR_RATIO_MAX)
+        sc->error_ratio = ERROR_RATIO_MAX;
+}
+
 // Set the inverted stepper direction flag
 void __visible
 stepcompress_set_invert_sdir(struct stepcompress *sc, uint32_t invert_sdir)
@@ -316,6 +335,13 @@ stepcompress_get_step_dir(struct stepcompress *sc)
     return sc->next_step_dir;
 }
 
+// Return the total number of bytes of step commands generated
+uint64_t __visible
+stepcompress_get_msg_bytes(struct stepcompress *sc)
+{
+    return sc->msg_bytes;
+}
+
 // Determine the "print time" of the last_step_clock
 static void
 calc_last_step_print_time(struct stepcompress *sc)
@@ -353,6 +379,7 @@ add_move(struct stepcompress *sc, uint64_t first_clock, struct step_move *move)
         sc->queue_step_msgtag, sc->oid, move->interval, move->count, move->add
     };
     struct queue_message *qm = message_alloc_and_encode(msg, 5);
+    sc->msg_bytes += qm->len;
     qm->min_clock = qm->req_clock = sc->last_step_clock;
     if (move->count == 1 && first_clock >= sc->last_step_clock + CLOCK_DIFF_MAX)
         qm->req_clock = first_clock;
@@ -419,6 +446,7 @@ set_next_step_dir(struct stepcompress *sc, int sdir)
         sc->set_next_step_dir_msgtag, sc->oid, sdir ^ sc->invert_sdir
     };
     struct queue_message *qm = message_alloc_and_encode(msg, 3);
+    sc->msg_bytes += qm->len;
     qm->req_clock = sc->last_step_clock;
     list_add_tail(&qm->node, &sc->msg_queue);
     return 0;
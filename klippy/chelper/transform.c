@@ -0,0 +1,156 @@
+// Affine coordinate transforms applied to g-code moves
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include <math.h> // fabs, isfinite
+#include <stdlib.h> // malloc
+#include <string.h> // memset
+#include "compiler.h" // __visible
+#include "pyhelper.h" // errorf
+
+#define MAX_STAGES 8
+
+// An affine transform of an xyz coordinate (a 3x3 matrix followed by
+// an offset for each row)
+struct affine {
+    double m[3][4];
+};
+
+struct transform_pipeline {
+    int num_stages;
+    struct affine stages[MAX_STAGES];
+    // Composition of all stages (and its inverse)
+    struct affine fwd, inv;
+};
+
+static void
+affine_identity(struct affine *a)
+{
+    memset(a, 0, sizeof(*a));
+    a->m[0][0] = a->m[1][1] = a->m[2][2] = 1.;
+}
+
+// Store the composition 'a(b(coord))' in 'res'
+static void
+affine_compose(struct affine *res, struct affine *a, struct affine *b)
+{
+    struct affine r;
+    int i, j;
+    for (i=0; i<3; i++) {
+        for (j=0; j<4; j++)
+            r.m[i][j] = (a->m[i][0] * b->m[0][j] + a->m[i][1] * b->m[1][j]
+                         + a->m[i][2] * b->m[2][j]);
+        r.m[i][3] += a->m[i][3];
+    }
+    *res = r;
+}
+
+// Calculate the inverse of an affine transform
+static int
+affine_invert(struct affine *res, struct affine *a)
+{
+    double (*m)[4] = a->m;
+    double c00 = m[1][1] * m[2][2] - m[1][2] * m[2][1];
+    double c01 = m[1][2] * m[2][0] - m[1][0] * m[2][2];
+    double c02 = m[1][0] * m[2][1] - m[1][1] * m[2][0];
+    double det = m[0][0] * c00 + m[0][1] * c01 + m[0][2] * c02;
+    if (fabs(det) < 1e-12)
+        return -1;
+    double inv_det = 1. / det;
+    struct affine r;
+    r.m[0][0] = c00 * inv_det;
+    r.m[0][1] = (m[0][2] * m[2][1] - m[0][1] * m[2][2]) * inv_det;
+    r.m[0][2] = (m[0][1] * m[1][2] - m[0][2] * m[1][1]) * inv_det;
+    r.m[1][0] = c01 * inv_det;
+    r.m[1][1] = (m[0][0] * m[2][2] - m[0][2] * m[2][0]) * inv_det;
+    r.m[1][2] = (m[0][2] * m[1][0] - m[0][0] * m[1][2]) * inv_det;
+    r.m[2][0] = c02 * inv_det;
+    r.m[2][1] = (m[0][1] * m[2][0] - m[0][0] * m[2][1]) * inv_det;
+    r.m[2][2] = (m[0][0] * m[1][1] - m[0][1] * m[1][0]) * inv_det;
+    int i;
+    for (i=0; i<3; i++)
+        r.m[i][3] = -(r.m[i][0] * m[0][3] + r.m[i][1] * m[1][3]
+                      + r.m[i][2] * m[2][3]);
+    *res = r;
+    return 0;
+}
+
+static void
+affine_apply(struct affine *a, double *coords, int count)
+{
+    double (*m)[4] = a->m;
+    int i;
+    for (i=0; i<count; i++, coords+=3) {
+        double x = coords[0], y = coords[1], z = coords[2];
+        coords[0] = m[0][0] * x + m[0][1] * y + m[0][2] * z + m[0][3];
+        coords[1] = m[1][0] * x + m[1][1] * y + m[1][2] * z + m[1][3];
+        coords[2] = m[2][0] * x + m[2][1] * y + m[2][2] * z + m[2][3];
+    }
+}
+
+struct transform_pipeline * __visible
+transform_pipeline_alloc(void)
+{
+    struct transform_pipeline *tp = malloc(sizeof(*tp));
+    memset(tp, 0, sizeof(*tp));
+    affine_identity(&tp->fwd);
+    affine_identity(&tp->inv);
+    return tp;
+}
+
+// Add a stage (initially the identity transform).  Stages added later
+// are applied to a coordinate first.  Returns the stage index.
+int __visible
+transform_pipeline_add_stage(struct transform_pipeline *tp)
+{
+    if (tp->num_stages >= MAX_STAGES) {
+        errorf("Too many transform stages");
+        return -1;
+    }
+    affine_identity(&tp->stages[tp->num_stages]);
+    return tp->num_stages++;
+}
+
+// Update a stage with a 3x4 (row major) affine matrix.  The pipeline
+// is left unchanged if the matrix is invalid or the combined transform
+// can not be inverted.
+int __visible
+transform_pipeline_set_stage(struct transform_pipeline *tp, int stage
+                             , double *matrix)
+{
+    if (stage < 0 || stage >= tp->num_stages)
+        return -1;
+    int i;
+    for (i=0; i<12; i++)
+        if (!isfinite(matrix[i]))
+            return -1;
+    struct affine a;
+    memcpy(a.m, matrix, sizeof(a.m));
+    struct affine fwd = a, inv;
+    for (i=stage-1; i>=0; i--)
+        affine_compose(&fwd, &tp->stages[i], &fwd);
+    for (i=stage+1; i<tp->num_stages; i++)
+        affine_compose(&fwd, &fwd, &tp->stages[i]);
+    if (affine_invert(&inv, &fwd))
+        return -1;
+    tp->stages[stage] = a;
+    tp->fwd = fwd;
+    tp->inv = inv;
+    return 0;
+}
+
+// Transform 'count' xyz coordinates (in place)
+void __visible
+transform_pipeline_apply(struct transform_pipeline *tp, double *coords
+                         , int count)
+{
+    affine_apply(&tp->fwd, coords, count);
+}
+
+// Undo the transform of 'count' xyz coordinates (in place)
+void __visible
+transform_pipeline_unapply(struct transform_pipeline *tp, double *coords
+                           , int count)
+{
+    affine_apply(&tp->inv, coords, count);
+}
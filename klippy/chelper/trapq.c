@@ -4,7 +4,7 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
-#include <math.h> // sqrt
+#include <math.h> // sqrt, sin, cos
 #include <stddef.h> // offsetof
 #include <stdlib.h> // malloc
 #include <string.h> // memset
@@ -24,7 +24,9 @@ move_alloc(void)
 inline double
 move_get_distance(struct move *m, double move_time)
 {
-    return (m->start_v + m->half_accel * move_time) * move_time;
+    return (m->start_v + (m->half_accel + (m->scurve_c3 + m->scurve_c4
+                                           * move_time) * move_time)
+            * move_time) * move_time;
 }
 
 // Return the XYZ coordinates given a time in a move
@@ -32,13 +34,93 @@ inline struct coord
 move_get_coord(struct move *m, double move_time)
 {
     double move_dist = move_get_distance(m, move_time);
-    return (struct coord) {
+    struct coord c = {
         .x = m->start_pos.x + m->axes_r.x * move_dist,
         .y = m->start_pos.y + m->axes_r.y * move_dist,
         .z = m->start_pos.z + m->axes_r.z * move_dist };
+    if (unlikely(m->arc_k)) {
+        // Arc moves rotate the 'arc_a' radius vector towards 'arc_b'
+        // by 'arc_k' radians per mm (cos(phi)-1 is calculated as
+        // -2*sin(phi/2)^2 to avoid cancellation on small angles)
+        double phi = m->arc_k * move_dist, hs = sin(.5 * phi);
+        double ca = -2. * hs * hs, sb = sin(phi);
+        c.x += m->arc_a.x * ca + m->arc_b.x * sb;
+        c.y += m->arc_a.y * ca + m->arc_b.y * sb;
+        c.z += m->arc_a.z * ca + m->arc_b.z * sb;
+    }
+    return c;
+}
+
+// Return the velocity (along the move) given a time in a move
+inline double
+move_get_velocity(struct move *m, double move_time)
+{
+    return (m->start_v + (2. * m->half_accel + (3. * m->scurve_c3
+                                                + 4. * m->scurve_c4
+                                                * move_time) * move_time)
+            * move_time);
+}
+
+// Return the XYZ velocity given a time in a move
+inline struct coord
+move_get_coord_velocity(struct move *m, double move_time)
+{
+    double v = move_get_velocity(m, move_time);
+    struct coord c = {
+        .x = m->axes_r.x * v, .y = m->axes_r.y * v, .z = m->axes_r.z * v };
+    if (unlikely(m->arc_k)) {
+        double phi = m->arc_k * move_get_distance(m, move_time);
+        double kv = m->arc_k * v, sa = -kv * sin(phi), cb = kv * cos(phi);
+        c.x += m->arc_a.x * sa + m->arc_b.x * cb;
+        c.y += m->arc_a.y * sa + m->arc_b.y * cb;
+        c.z += m->arc_a.z * sa + m->arc_b.z * cb;
+    }
+    return c;
+}
+
+// Calculate the running integrals up to a given time in a move (arc
+// moves are not supported)
+void
+move_get_integrals(struct move *m, double move_time
+                   , struct move_integrals *res)
+{
+    double t = move_time, pt = m->print_time - m->integ_time;
+    double x = m->start_pos.x - m->integ_x, d = move_get_distance(m, t);
+    // Integrals of the distance and of the time weighted distance
+    double half_v = .5 * m->start_v, third_v = (1. / 3.) * m->start_v;
+    double di = t * t * (half_v + t * ((1. / 3.) * m->half_accel
+                                       + t * (.25 * m->scurve_c3
+                                              + t * .2 * m->scurve_c4)));
+    double dti = t * t * t * (third_v + t * (.25 * m->half_accel
+                                            + t * (.2 * m->scurve_c3
+                                                   + t * (1. / 6.)
+                                                   * m->scurve_c4)));
+    // Convert to integrals of position (with time relative to integ_time)
+    double rx = m->axes_r.x, ry = m->axes_r.y;
+    res->x = m->integ.x + x * t + rx * di;
+    res->x_t = m->integ.x_t + x * t * (.5 * t + pt) + rx * (dti + pt * di);
+    res->vel_y = m->integ.vel_y + ry * d;
+    res->vel_y_t = m->integ.vel_y_t + ry * ((t + pt) * d - di);
 }
 
 #define NEVER_TIME 9999999999999999.9
+#define MAX_INTEGRAL_TIME 0.1
+
+// Continue the running integrals from 'prev' (if possible)
+static void
+move_init_integrals(struct move *prev, struct move *m, int is_first)
+{
+    if (is_first || m->print_time - prev->integ_time > MAX_INTEGRAL_TIME) {
+        // Start new integrals (to limit numerical error)
+        m->integ_time = m->print_time;
+        m->integ_x = m->start_pos.x;
+        memset(&m->integ, 0, sizeof(m->integ));
+        return;
+    }
+    m->integ_time = prev->integ_time;
+    m->integ_x = prev->integ_x;
+    move_get_integrals(prev, prev->move_t, &m->integ);
+}
 
 // Allocate a new 'trapq' object
 struct trapq * __visible
@@ -72,6 +154,13 @@ trapq_free(struct trapq *tq)
     free(tq);
 }
 
+// Select S-curve (instead of constant) acceleration for new moves
+void __visible
+trapq_set_scurve(struct trapq *tq, int scurve)
+{
+    tq->scurve = scurve;
+}
+
 // Update the list sentinels
 void
 trapq_check_sentinels(struct trapq *tq)
@@ -89,6 +178,7 @@ trapq_check_sentinels(struct trapq *tq)
     }
     tail_sentinel->print_time = m->print_time + m->move_t;
     tail_sentinel->start_pos = move_get_coord(m, m->move_t);
+    move_init_integrals(m, tail_sentinel, 0);
 }
 
 #define MAX_NULL_MOVE 1.0
@@ -99,6 +189,7 @@ trapq_add_move(struct trapq *tq, struct move *m)
 {
     struct move *tail_sentinel = list_last_entry(&tq->moves, struct move, node);
     struct move *prev = list_prev_entry(tail_sentinel, node);
+    int is_first = list_is_first(&prev->node, &tq->moves);
     if (prev->print_time + prev->move_t < m->print_time) {
         // Add a null move to fill time gap
         struct move *null_move = move_alloc();
@@ -109,12 +200,79 @@ trapq_add_move(struct trapq *tq, struct move *m)
         else
             null_move->print_time = prev->print_time + prev->move_t;
         null_move->move_t = m->print_time - null_move->print_time;
+        move_init_integrals(prev, null_move, is_first);
         list_add_before(&null_move->node, &tail_sentinel->node);
+        prev = null_move;
+        is_first = 0;
     }
+    move_init_integrals(prev, m, is_first);
     list_add_before(&m->node, &tail_sentinel->node);
     tail_sentinel->print_time = 0.;
 }
 
+// Add a move to the queue and advance 'tmpl' to the end of that move
+static void
+add_phase(struct trapq *tq, struct move *tmpl, double move_t
+          , double start_v, double half_accel, double c3, double c4)
+{
+    struct move *m = move_alloc();
+    *m = *tmpl;
+    m->move_t = move_t;
+    m->start_v = start_v;
+    m->half_accel = half_accel;
+    m->scurve_c3 = c3;
+    m->scurve_c4 = c4;
+    trapq_add_move(tq, m);
+
+    tmpl->print_time += move_t;
+    tmpl->start_pos = move_get_coord(m, move_t);
+    if (m->arc_k) {
+        // Rotate the arc vectors to the new start position
+        double phi = m->arc_k * move_get_distance(m, move_t);
+        double c = cos(phi), s = sin(phi);
+        int i;
+        for (i=0; i<3; i++) {
+            tmpl->arc_a.axis[i] = m->arc_a.axis[i] * c + m->arc_b.axis[i] * s;
+            tmpl->arc_b.axis[i] = m->arc_b.axis[i] * c - m->arc_a.axis[i] * s;
+        }
+    }
+}
+
+// Add a velocity change of 'accel' over 'move_t'.  On S-curve queues
+// the velocity follows
+//   v(t) = start_v + accel*T * (3*(t/T)^2 - 2*(t/T)^3)
+// (where 'accel' is the average acceleration) so that the velocity
+// change starts and ends with zero acceleration.
+static void
+add_accel_phase(struct trapq *tq, struct move *tmpl, double move_t
+                , double start_v, double accel)
+{
+    if (!tq->scurve) {
+        add_phase(tq, tmpl, move_t, start_v, .5 * accel, 0., 0.);
+        return;
+    }
+    double inv_t = 1. / move_t, c3 = accel * inv_t;
+    add_phase(tq, tmpl, move_t, start_v, 0., c3, -.5 * c3 * inv_t);
+}
+
+// Split a move into its acceleration, cruise, and deceleration phases.
+// On S-curve queues 'accel' is the peak acceleration, which is 1.5
+// times the average acceleration.
+static void
+add_phases(struct trapq *tq, struct move *tmpl
+           , double accel_t, double cruise_t, double decel_t
+           , double start_v, double cruise_v, double accel)
+{
+    if (tq->scurve)
+        accel *= 2. / 3.;
+    if (accel_t)
+        add_accel_phase(tq, tmpl, accel_t, start_v, accel);
+    if (cruise_t)
+        add_phase(tq, tmpl, cruise_t, cruise_v, 0., 0., 0.);
+    if (decel_t)
+        add_accel_phase(tq, tmpl, decel_t, cruise_v, -accel);
+}
+
 // Fill and add a move to the trapezoid velocity queue
 void __visible
 trapq_append(struct trapq *tq, double print_time
@@ -123,44 +281,37 @@ trapq_append(struct trapq *tq, double print_time
              , double axes_r_x, double axes_r_y, double axes_r_z
              , double start_v, double cruise_v, double accel)
 {
-    struct coord start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z };
-    struct coord axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z };
-    if (accel_t) {
-        struct move *m = move_alloc();
-        m->print_time = print_time;
-        m->move_t = accel_t;
-        m->start_v = start_v;
-        m->half_accel = .5 * accel;
-        m->start_pos = start_pos;
-        m->axes_r = axes_r;
-        trapq_add_move(tq, m);
-
-        print_time += accel_t;
-        start_pos = move_get_coord(m, accel_t);
-    }
-    if (cruise_t) {
-        struct move *m = move_alloc();
-        m->print_time = print_time;
-        m->move_t = cruise_t;
-        m->start_v = cruise_v;
-        m->half_accel = 0.;
-        m->start_pos = start_pos;
-        m->axes_r = axes_r;
-        trapq_add_move(tq, m);
+    struct move tmpl = {
+        .print_time = print_time,
+        .start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z },
+        .axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z } };
+    add_phases(tq, &tmpl, accel_t, cruise_t, decel_t, start_v, cruise_v, accel);
+}
 
-        print_time += cruise_t;
-        start_pos = move_get_coord(m, cruise_t);
-    }
-    if (decel_t) {
-        struct move *m = move_alloc();
-        m->print_time = print_time;
-        m->move_t = decel_t;
-        m->start_v = cruise_v;
-        m->half_accel = -.5 * accel;
-        m->start_pos = start_pos;
-        m->axes_r = axes_r;
-        trapq_add_move(tq, m);
-    }
+// Fill and add a circular arc move to the trapezoid velocity queue.
+// The position at distance 'd' along the move is:
+//   start_pos + axes_r*d + arc_a*(cos(arc_k*d)-1) + arc_b*sin(arc_k*d)
+// where 'arc_a' is the vector from the arc center to the start
+// position and 'arc_b' is 'arc_a' rotated 90 degrees in the direction
+// of motion.  The 'axes_r' component holds any helical travel.
+void __visible
+trapq_append_arc(struct trapq *tq, double print_time
+                 , double accel_t, double cruise_t, double decel_t
+                 , double start_pos_x, double start_pos_y, double start_pos_z
+                 , double axes_r_x, double axes_r_y, double axes_r_z
+                 , double arc_a_x, double arc_a_y, double arc_a_z
+                 , double arc_b_x, double arc_b_y, double arc_b_z
+                 , double arc_k
+                 , double start_v, double cruise_v, double accel)
+{
+    struct move tmpl = {
+        .print_time = print_time,
+        .start_pos = { .x=start_pos_x, .y=start_pos_y, .z=start_pos_z },
+        .axes_r = { .x=axes_r_x, .y=axes_r_y, .z=axes_r_z },
+        .arc_a = { .x=arc_a_x, .y=arc_a_y, .z=arc_a_z },
+        .arc_b = { .x=arc_b_x, .y=arc_b_y, .z=arc_b_z },
+        .arc_k = arc_k };
+    add_phases(tq, &tmpl, accel_t, cruise_t, decel_t, start_v, cruise_v, accel);
 }
 
 #define HISTORY_EXPIRE (30.0)
@@ -181,7 +332,7 @@ trapq_finalize_moves(struct trapq *tq, double print_time)
         if (m->print_time + m->move_t > print_time)
             break;
         list_del(&m->node);
-        if (m->start_v || m->half_accel)
+        if (m->start_v || m->half_accel || m->scurve_c3)
             list_add_head(&m->node, &tq->history);
         else
             free(m);
@@ -245,12 +396,21 @@ trapq_extract_old(struct trapq *tq, struct pull_move *p, int max
         p->move_t = m->move_t;
         p->start_v = m->start_v;
         p->accel = 2. * m->half_accel;
+        p->scurve_c3 = m->scurve_c3;
+        p->scurve_c4 = m->scurve_c4;
         p->start_x = m->start_pos.x;
         p->start_y = m->start_pos.y;
         p->start_z = m->start_pos.z;
         p->x_r = m->axes_r.x;
         p->y_r = m->axes_r.y;
         p->z_r = m->axes_r.z;
+        p->arc_ax = m->arc_a.x;
+        p->arc_ay = m->arc_a.y;
+        p->arc_az = m->arc_a.z;
+        p->arc_bx = m->arc_b.x;
+        p->arc_by = m->arc_b.y;
+        p->arc_bz = m->arc_b.z;
+        p->arc_k = m->arc_k;
         p++;
         res++;
     }
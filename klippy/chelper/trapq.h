@@ -12,30 +12,54 @@ struct coord {
     };
 };
 
+// Running integrals of the x position (the first two) and of the y
+// velocity (the last two), each also weighted by time
+struct move_integrals {
+    double x, x_t, vel_y, vel_y_t;
+};
+
 struct move {
     double print_time, move_t;
     double start_v, half_accel;
+    // Cubic and quartic distance terms (non-zero only for the
+    // acceleration phases of S-curve moves)
+    double scurve_c3, scurve_c4;
     struct coord start_pos, axes_r;
+    // Circular arc component (arc_k is zero for linear moves)
+    struct coord arc_a, arc_b;
+    double arc_k;
+    // Integrals from 'integ_time' up to the start of this move (times
+    // are relative to 'integ_time' and positions relative to 'integ_x')
+    double integ_time, integ_x;
+    struct move_integrals integ;
 
     struct list_node node;
 };
 
 struct trapq {
     struct list_head moves, history;
+    int scurve;
 };
 
 struct pull_move {
     double print_time, move_t;
     double start_v, accel;
+    double scurve_c3, scurve_c4;
     double start_x, start_y, start_z;
     double x_r, y_r, z_r;
+    double arc_ax, arc_ay, arc_az, arc_bx, arc_by, arc_bz, arc_k;
 };
 
 struct move *move_alloc(void);
 double move_get_distance(struct move *m, double move_time);
 struct coord move_get_coord(struct move *m, double move_time);
+double move_get_velocity(struct move *m, double move_time);
+struct coord move_get_coord_velocity(struct move *m, double move_time);
+void move_get_integrals(struct move *m, double move_time
+                        , struct move_integrals *res);
 struct trapq *trapq_alloc(void);
 void trapq_free(struct trapq *tq);
+void trapq_set_scurve(struct trapq *tq, int scurve);
 void trapq_check_sentinels(struct trapq *tq);
 void trapq_add_move(struct trapq *tq, struct move *m);
 void trapq_append(struct trapq *tq, double print_time
@@ -43,6 +67,15 @@ void trapq_append(struct trapq *tq, double print_time
                   , double start_pos_x, double start_pos_y, double start_pos_z
                   , double axes_r_x, double axes_r_y, double axes_r_z
                   , double start_v, double cruise_v, double accel);
+void trapq_append_arc(struct trapq *tq, double print_time
+                      , double accel_t, double cruise_t, double decel_t
+                      , double start_pos_x, double start_pos_y
+                      , double start_pos_z
+                      , double axes_r_x, double axes_r_y, double axes_r_z
+                      , double arc_a_x, double arc_a_y, double arc_a_z
+                      , double arc_b_x, double arc_b_y, double arc_b_z
+                      , double arc_k
+                      , double start_v, double cruise_v, double accel);
 void trapq_finalize_moves(struct trapq *tq, double print_time);
 void trapq_set_position(struct trapq *tq, double print_time
                         , double pos_x, double pos_y, double pos_z);
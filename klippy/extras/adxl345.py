@@ -3,7 +3,8 @@
 # Copyright (C) 2020-2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, time, collections, threading, multiprocessing, os
+import logging, time, threading, multiprocessing, os, bisect, array
+import chelper
 from . import bus, motion_report
 
 # ADXL345 registers
@@ -27,8 +28,24 @@ FREEFALL_ACCEL = 9.80665 * 1000.
 SCALE_XY = 0.003774 * FREEFALL_ACCEL # 1 / 265 (at 3.3V) mg/LSB
 SCALE_Z  = 0.003906 * FREEFALL_ACCEL # 1 / 256 (at 3.3V) mg/LSB
 
-Accel_Measurement = collections.namedtuple(
-    'Accel_Measurement', ('time', 'accel_x', 'accel_y', 'accel_z'))
+# Accelerometer samples stored as separate time, x, y, and z arrays
+class AccelSamples:
+    def __init__(self, columns=None):
+        if columns is None:
+            columns = [array.array('d') for i in range(4)]
+        self.columns = columns
+        self.times = columns[0]
+    def __len__(self):
+        return len(self.times)
+    def get_range(self, start_time, end_time):
+        lo = bisect.bisect_left(self.times, start_time)
+        hi = bisect.bisect_right(self.times, end_time)
+        return AccelSamples([c[lo:hi] for c in self.columns])
+    def extend(self, samples):
+        for col, new_col in zip(self.columns, samples.columns):
+            col.extend(new_col)
+    def get_last(self):
+        return [c[-1] for c in self.columns]
 
 # Helper class to obtain measurements
 class AccelQueryHelper:
@@ -37,10 +54,27 @@ class AccelQueryHelper:
         self.cconn = cconn
         print_time = printer.lookup_object('toolhead').get_last_move_time()
         self.request_start_time = self.request_end_time = print_time
-        self.samples = self.raw_samples = []
+        self.samples = AccelSamples()
+        self.raw_samples = []
+        self.sample_cb = None
+        self.stream_end_time = float('inf')
+    def stream_samples(self, sample_cb):
+        # Pass samples to sample_cb as they arrive instead of storing them
+        self.sample_cb = sample_cb
+        self.cconn.set_message_callback(self._handle_stream_msg)
+    def _handle_stream_msg(self, msg):
+        samples = AccelSamples(msg['params']['columns']).get_range(
+            self.request_start_time, self.stream_end_time)
+        if samples:
+            self.sample_cb(samples)
+    def stop_streaming(self):
+        # Stop a stream_samples() client without waiting for moves
+        self.stream_end_time = self.request_start_time
+        self.cconn.finalize()
     def finish_measurements(self):
         toolhead = self.printer.lookup_object('toolhead')
         self.request_end_time = toolhead.get_last_move_time()
+        self.stream_end_time = self.request_end_time
         toolhead.wait_moves()
         self.cconn.finalize()
     def _get_raw_samples(self):
@@ -51,9 +85,9 @@ class AccelQueryHelper:
     def has_valid_samples(self):
         raw_samples = self._get_raw_samples()
         for msg in raw_samples:
-            data = msg['params']['data']
-            first_sample_time = data[0][0]
-            last_sample_time = data[-1][0]
+            times = msg['params']['columns'][0]
+            first_sample_time = times[0]
+            last_sample_time = times[-1]
             if (first_sample_time > self.request_end_time
                     or last_sample_time < self.request_start_time):
                 continue
@@ -70,18 +104,16 @@ class AccelQueryHelper:
         raw_samples = self._get_raw_samples()
         if not raw_samples:
             return self.samples
-        total = sum([len(m['params']['data']) for m in raw_samples])
-        count = 0
-        self.samples = samples = [None] * total
+        self.samples = samples = AccelSamples()
         for msg in raw_samples:
-            for samp_time, x, y, z in msg['params']['data']:
-                if samp_time < self.request_start_time:
-                    continue
-                if samp_time > self.request_end_time:
-                    break
-                samples[count] = Accel_Measurement(samp_time, x, y, z)
-                count += 1
-        del samples[count:]
+            msg_samples = AccelSamples(msg['params']['columns'])
+            times = msg_samples.times
+            if not times or times[-1] < self.request_start_time:
+                continue
+            if times[0] > self.request_end_time:
+                break
+            samples.extend(msg_samples.get_range(self.request_start_time,
+                                                 self.request_end_time))
         return self.samples
     def write_to_file(self, filename):
         def write_impl():
@@ -93,7 +125,7 @@ class AccelQueryHelper:
             f = open(filename, "w")
             f.write("#time,accel_x,accel_y,accel_z\n")
             samples = self.samples or self.get_samples()
-            for t, accel_x, accel_y, accel_z in samples:
+            for t, accel_x, accel_y, accel_z in zip(*samples.columns):
                 f.write("%.6f,%.6f,%.6f,%.6f\n" % (
                     t, accel_x, accel_y, accel_z))
             f.close()
@@ -159,7 +191,7 @@ class AccelCommandHelper:
         values = aclient.get_samples()
         if not values:
             raise gcmd.error("No accelerometer measurements found")
-        _, accel_x, accel_y, accel_z = values[-1]
+        _, accel_x, accel_y, accel_z = values.get_last()
         gcmd.respond_info("accelerometer values (x, y, z): %.6f, %.6f, %.6f"
                           % (accel_x, accel_y, accel_z))
     cmd_ACCELEROMETER_DEBUG_READ_help = "Query register (for debugging)"
@@ -221,6 +253,74 @@ class ClockSyncRegression:
         inv_freq = clock_to_print_time(base_mcu + inv_cfreq) - base_time
         return base_time, base_chip, inv_freq
 
+# Helper class to decode bulk accelerometer messages using C helper code
+class BulkSampleDecoder:
+    def __init__(self, sensor_type, axes_map, samples_per_block):
+        self.samples_per_block = samples_per_block
+        self.ffi_main, self.ffi_lib = ffi_main, ffi_lib = chelper.get_ffi()
+        self.decoder = ffi_main.gc(
+            ffi_lib.bulk_decoder_alloc(sensor_type, samples_per_block),
+            ffi_lib.free)
+        for axis, (pos, scale) in enumerate(axes_map):
+            ffi_lib.bulk_decoder_set_axis(self.decoder, axis, pos, scale)
+        self.info = ffi_main.new('struct bulk_decode_info *')
+    def extract(self, raw_samples, last_sequence, time_translation):
+        # Returns (time/x/y/z arrays, error_count, last_chip_clock)
+        ffi_main = self.ffi_main
+        block_data = [params['data'] for params in raw_samples]
+        data = b''.join(block_data)
+        block_lens = ffi_main.new('int[]', [len(d) for d in block_data])
+        seqs = ffi_main.new('int[]', [p['sequence'] for p in raw_samples])
+        max_samples = len(raw_samples) * self.samples_per_block
+        columns = [array.array('d', [0.]) * max_samples for i in range(4)]
+        out = [ffi_main.from_buffer('double[]', c) for c in columns]
+        info = self.info
+        info.last_sequence = last_sequence
+        info.last_chip_clock = -1
+        info.error_count = 0
+        time_base, chip_base, inv_freq = time_translation
+        count = self.ffi_lib.bulk_decoder_extract(
+            self.decoder, ffi_main.from_buffer('uint8_t[]', data), block_lens,
+            seqs, len(raw_samples), time_base, chip_base, inv_freq,
+            out[0], out[1], out[2], out[3], max_samples, info)
+        if count < max_samples:
+            columns = [c[:count] for c in columns]
+        last_chip_clock = info.last_chip_clock
+        if last_chip_clock < 0:
+            last_chip_clock = None
+        return columns, info.error_count, last_chip_clock
+
+SYNC_MAX_GAP_SAMPLES = 4
+
+# Align samples from several accelerometers (possibly on different
+# mcus) onto a common print_time grid.  Returns a list of columns
+# with the grid times followed by the x, y, z values of each input.
+def synchronize_samples(sample_lists):
+    ffi_main, ffi_lib = chelper.get_ffi()
+    if not sample_lists or any([len(s) < 2 for s in sample_lists]):
+        return None
+    intervals = [(s.times[-1] - s.times[0]) / (len(s) - 1)
+                 for s in sample_lists]
+    step = min(intervals)
+    max_gap = SYNC_MAX_GAP_SAMPLES * max(intervals)
+    start_time = max([s.times[0] for s in sample_lists])
+    end_time = min([s.times[-1] for s in sample_lists])
+    if end_time <= start_time or step <= 0.:
+        return None
+    grid_count = int((end_time - start_time) / step) + 1
+    out = ffi_main.new('double[]', 3 * grid_count)
+    columns = [[start_time + i * step for i in range(grid_count)]]
+    count = grid_count
+    for samples in sample_lists:
+        times, x, y, z = [ffi_main.from_buffer('double[]', c)
+                          for c in samples.columns]
+        res = ffi_lib.bulk_resample(times, x, y, z, len(samples), start_time,
+                                    step, max_gap, out, grid_count)
+        count = min(count, res)
+        columns.extend([ffi_main.unpack(out + i * grid_count, res)
+                        for i in range(3)])
+    return [c[:count] for c in columns]
+
 MIN_MSG_TIME = 0.100
 
 BYTES_PER_SAMPLE = 5
@@ -238,6 +338,7 @@ class ADXL345:
         if any([a not in am for a in axes_map]):
             raise config.error("Invalid adxl345 axes_map parameter")
         self.axes_map = [am[a.strip()] for a in axes_map]
+        self.decoder = BulkSampleDecoder(b'a', self.axes_map, SAMPLES_PER_BLOCK)
         self.data_rate = config.getint('rate', 3200)
         if self.data_rate not in QUERY_RATES:
             raise config.error("Invalid rate parameter: %d" % (self.data_rate,))
@@ -299,39 +400,13 @@ class ADXL345:
         with self.lock:
             self.raw_samples.append(params)
     def _extract_samples(self, raw_samples):
-        # Load variables to optimize inner loop below
-        (x_pos, x_scale), (y_pos, y_scale), (z_pos, z_scale) = self.axes_map
-        last_sequence = self.last_sequence
-        time_base, chip_base, inv_freq = self.clock_sync.get_time_translation()
-        # Process every message in raw_samples
-        count = seq = 0
-        samples = [None] * (len(raw_samples) * SAMPLES_PER_BLOCK)
-        for params in raw_samples:
-            seq_diff = (last_sequence - params['sequence']) & 0xffff
-            seq_diff -= (seq_diff & 0x8000) << 1
-            seq = last_sequence - seq_diff
-            d = bytearray(params['data'])
-            msg_cdiff = seq * SAMPLES_PER_BLOCK - chip_base
-            for i in range(len(d) // BYTES_PER_SAMPLE):
-                d_xyz = d[i*BYTES_PER_SAMPLE:(i+1)*BYTES_PER_SAMPLE]
-                xlow, ylow, zlow, xzhigh, yzhigh = d_xyz
-                if yzhigh & 0x80:
-                    self.last_error_count += 1
-                    continue
-                rx = (xlow | ((xzhigh & 0x1f) << 8)) - ((xzhigh & 0x10) << 9)
-                ry = (ylow | ((yzhigh & 0x1f) << 8)) - ((yzhigh & 0x10) << 9)
-                rz = ((zlow | ((xzhigh & 0xe0) << 3) | ((yzhigh & 0xe0) << 6))
-                      - ((yzhigh & 0x40) << 7))
-                raw_xyz = (rx, ry, rz)
-                x = round(raw_xyz[x_pos] * x_scale, 6)
-                y = round(raw_xyz[y_pos] * y_scale, 6)
-                z = round(raw_xyz[z_pos] * z_scale, 6)
-                ptime = round(time_base + (msg_cdiff + i) * inv_freq, 6)
-                samples[count] = (ptime, x, y, z)
-                count += 1
-        self.clock_sync.set_last_chip_clock(seq * SAMPLES_PER_BLOCK + i)
-        del samples[count:]
-        return samples
+        time_translation = self.clock_sync.get_time_translation()
+        columns, error_count, last_chip_clock = self.decoder.extract(
+            raw_samples, self.last_sequence, time_translation)
+        self.last_error_count += error_count
+        if last_chip_clock is not None:
+            self.clock_sync.set_last_chip_clock(last_chip_clock)
+        return columns
     def _update_clock(self, minclock=0):
         # Query current state
         for retry in range(5):
@@ -420,10 +495,10 @@ class ADXL345:
             self.raw_samples = []
         if not raw_samples:
             return {}
-        samples = self._extract_samples(raw_samples)
-        if not samples:
+        columns = self._extract_samples(raw_samples)
+        if not columns[0]:
             return {}
-        return {'data': samples, 'errors': self.last_error_count,
+        return {'columns': columns, 'errors': self.last_error_count,
                 'overflows': self.last_limit_count}
     def _api_startstop(self, is_start):
         if is_start:
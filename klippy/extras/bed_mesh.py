@@ -5,6 +5,7 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math, json, collections
+import chelper
 from . import probe
 
 PROFILE_VERSION = 1
@@ -31,10 +32,6 @@ def within(coord, min_c, max_c, tol=0.0):
 def constrain(val, min_val, max_val):
     return min(max_val, max(min_val, val))
 
-# Linear interpolation between two values
-def lerp(t, v0, v1):
-    return (1. - t) * v0 + t * v1
-
 # retreive commma separated pair from config
 def parse_config_pair(config, option, default, minval=None, maxval=None):
     pair = config.getintlist(option, (default, default))
@@ -88,9 +85,20 @@ class BedMesh:
     FADE_DISABLE = 0x7FFFFFFF
     def __init__(self, config):
         self.printer = config.get_printer()
+        self.printer.register_event_handler("klippy:mcu_identify",
+                                            self.handle_mcu_identify)
         self.printer.register_event_handler("klippy:connect",
                                             self.handle_connect)
-        self.last_position = [0., 0., 0., 0.]
+        self.printer.register_event_handler("homing:home_rails_begin",
+                                            self._handle_homing_begin)
+        self.printer.register_event_handler("homing:home_rails_end",
+                                            self._handle_homing_end)
+        self.printer.register_event_handler("homing:homing_move_begin",
+                                            self._handle_homing_begin)
+        self.printer.register_event_handler("homing:homing_move_end",
+                                            self._handle_homing_end)
+        self.printer.register_event_handler("gcode:command_error",
+                                            self._handle_command_error)
         self.bmc = BedMeshCalibrate(config, self)
         self.z_mesh = None
         self.toolhead = None
@@ -100,11 +108,19 @@ class BedMesh:
         self.fade_dist = self.fade_end - self.fade_start
         if self.fade_dist <= 0.:
             self.fade_start = self.fade_end = self.FADE_DISABLE
-        self.log_fade_complete = False
         self.base_fade_target = config.getfloat('fade_target', None)
         self.fade_target = 0.
+        # The mesh is now applied during step generation
+        config.getfloat('split_delta_z', .025, minval=0.01)
+        config.getfloat('move_check_distance', 5., minval=3.)
+        config.deprecate('split_delta_z')
+        config.deprecate('move_check_distance')
         self.gcode = self.printer.lookup_object('gcode')
-        self.splitter = MoveSplitter(config, self.gcode)
+        # Setup z adjustment tracking in C code
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.c_mesh = ffi_main.gc(ffi_lib.zmesh_alloc(), ffi_lib.zmesh_free)
+        self.homing_depth = 0
+        self.mesh_stepper_kinematics = []
         # setup persistent storage
         self.pmgr = ProfileManager(config, self)
         self.save_profile = self.pmgr.save_profile
@@ -121,105 +137,137 @@ class BedMesh:
         self.gcode.register_command(
             'BED_MESH_OFFSET', self.cmd_BED_MESH_OFFSET,
             desc=self.cmd_BED_MESH_OFFSET_help)
-        # Register transform
-        gcode_move = self.printer.load_object(config, 'gcode_move')
-        gcode_move.set_move_transform(self)
         # initialize status dict
+        self.status_version = 0
         self.update_status()
+    def handle_mcu_identify(self):
+        # Wrap the z steppers so the mesh adjustment is added during
+        # step generation.  This is done before other stepper
+        # kinematics wrappers (eg, input_shaper) are installed.
+        ffi_main, ffi_lib = chelper.get_ffi()
+        kin = self.printer.lookup_object('toolhead').get_kinematics()
+        for s in kin.get_steppers():
+            if not s.is_active_axis('z'):
+                continue
+            sk = s.get_stepper_kinematics()
+            bm_sk = ffi_main.gc(ffi_lib.bed_mesh_stepper_alloc(),
+                                ffi_lib.free)
+            s.set_stepper_kinematics(bm_sk)
+            if ffi_lib.bed_mesh_set_sk(bm_sk, sk, self.c_mesh) < 0:
+                s.set_stepper_kinematics(sk)
+                continue
+            self.mesh_stepper_kinematics.append((s, bm_sk, sk))
     def handle_connect(self):
         self.toolhead = self.printer.lookup_object('toolhead')
         self.bmc.print_generated_points(logging.info)
+    def _calc_unadjusted_z(self, x, y, z):
+        # Find the requested z position that results in the given
+        # (adjusted) z position
+        if self.z_mesh is None:
+            return z - self.fade_target
+        max_adj = self.z_mesh.calc_z(x, y)
+        factor = 1.
+        z_adj = max_adj - self.fade_target
+        if min(z, (z - max_adj)) >= self.fade_end:
+            # Fade out is complete, no factor
+            factor = 0.
+        elif max(z, (z - max_adj)) >= self.fade_start:
+            # Likely in the process of fading out adjustment.
+            # Because we don't yet know the requested z position, use
+            # algebra to calculate the factor from the adjusted pos
+            factor = ((self.fade_end + self.fade_target - z) /
+                      (self.fade_dist - z_adj))
+            factor = constrain(factor, 0., 1.)
+        return z - (factor * z_adj + self.fade_target)
+    def _update_mesh_state(self, update_func):
+        # Change the z adjustment while keeping the physical position
+        # of the toolhead unchanged
+        if self.toolhead is None:
+            update_func()
+            return
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.toolhead.flush_step_generation()
+        x, y, z, e = self.toolhead.get_position()
+        z += ffi_lib.zmesh_calc_offset(self.c_mesh, x, y, z)
+        update_func()
+        if self.homing_depth:
+            newz = z
+        else:
+            newz = self._calc_unadjusted_z(x, y, z)
+        self.toolhead.set_position([x, y, newz, e])
+    def _handle_homing_begin(self, *args):
+        # Homing and probing moves are made without mesh adjustment
+        self.homing_depth += 1
+        if self.homing_depth == 1:
+            self._update_mesh_state(lambda: self._set_enabled(False))
+    def _handle_homing_end(self, *args):
+        if self.homing_depth == 1:
+            self._resume_mesh()
+        else:
+            self.homing_depth = max(0, self.homing_depth - 1)
+    def _handle_command_error(self):
+        if self.homing_depth:
+            self._resume_mesh()
+    def _resume_mesh(self):
+        self.homing_depth = 0
+        self._update_mesh_state(lambda: self._set_enabled(True))
+    def _set_enabled(self, enabled):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.zmesh_set_enabled(self.c_mesh, enabled)
+    def _load_mesh(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        if self.z_mesh is None:
+            ffi_lib.zmesh_copy_table(self.c_mesh, ffi_main.NULL)
+        else:
+            ffi_lib.zmesh_copy_table(self.c_mesh, self.z_mesh.c_mesh)
+        ffi_lib.zmesh_set_fade(self.c_mesh, self.fade_start, self.fade_end,
+                               self.fade_target)
+        # The z steppers only follow the x and y axes while a mesh is
+        # loaded.  Notify other stepper kinematics wrappers (eg,
+        # input_shaper) of the change.
+        for stepper, bm_sk, sk in self.mesh_stepper_kinematics:
+            ffi_lib.bed_mesh_set_xy_active(bm_sk, self.z_mesh is not None)
+            self.printer.send_event("stepper:set_active_axes", stepper)
     def set_mesh(self, mesh):
+        error = None
+        fade_target = 0.
         if mesh is not None and self.fade_end != self.FADE_DISABLE:
-            self.log_fade_complete = True
+            min_z, max_z = mesh.get_z_range()
             if self.base_fade_target is None:
-                self.fade_target = mesh.get_z_average()
+                fade_target = mesh.get_z_average()
             else:
-                self.fade_target = self.base_fade_target
-                min_z, max_z = mesh.get_z_range()
-                if (not min_z <= self.fade_target <= max_z and
-                        self.fade_target != 0.):
+                fade_target = self.base_fade_target
+                if (not min_z <= fade_target <= max_z and
+                        fade_target != 0.):
                     # fade target is non-zero, out of mesh range
-                    err_target = self.fade_target
-                    self.z_mesh = None
-                    self.fade_target = 0.
-                    raise self.gcode.error(
+                    error = (
                         "bed_mesh: ERROR, fade_target lies outside of mesh z "
                         "range\nmin: %.4f, max: %.4f, fade_target: %.4f"
-                        % (min_z, max_z, err_target))
-            min_z, max_z = mesh.get_z_range()
-            if self.fade_dist <= max(abs(min_z), abs(max_z)):
-                self.z_mesh = None
-                self.fade_target = 0.
-                raise self.gcode.error(
+                        % (min_z, max_z, fade_target))
+            if error is None and self.fade_dist <= max(abs(min_z),
+                                                       abs(max_z)):
+                error = (
                     "bed_mesh:  Mesh extends outside of the fade range, "
                     "please see the fade_start and fade_end options in"
                     "example-extras.cfg. fade distance: %.2f mesh min: %.4f"
                     "mesh max: %.4f" % (self.fade_dist, min_z, max_z))
-        else:
-            self.fade_target = 0.
-        self.z_mesh = mesh
-        self.splitter.initialize(mesh, self.fade_target)
-        # cache the current position before a transform takes place
-        gcode_move = self.printer.lookup_object('gcode_move')
-        gcode_move.reset_last_position()
+        if error is not None:
+            mesh = None
+            fade_target = 0.
+        def update():
+            self.z_mesh = mesh
+            self.fade_target = fade_target
+            self._load_mesh()
+        self._update_mesh_state(update)
         self.update_status()
-    def get_z_factor(self, z_pos):
-        if z_pos >= self.fade_end:
-            return 0.
-        elif z_pos >= self.fade_start:
-            return (self.fade_end - z_pos) / self.fade_dist
-        else:
-            return 1.
-    def get_position(self):
-        # Return last, non-transformed position
-        if self.z_mesh is None:
-            # No mesh calibrated, so send toolhead position
-            self.last_position[:] = self.toolhead.get_position()
-            self.last_position[2] -= self.fade_target
-        else:
-            # return current position minus the current z-adjustment
-            x, y, z, e = self.toolhead.get_position()
-            max_adj = self.z_mesh.calc_z(x, y)
-            factor = 1.
-            z_adj = max_adj - self.fade_target
-            if min(z, (z - max_adj)) >= self.fade_end:
-                # Fade out is complete, no factor
-                factor = 0.
-            elif max(z, (z - max_adj)) >= self.fade_start:
-                # Likely in the process of fading out adjustment.
-                # Because we don't yet know the gcode z position, use
-                # algebra to calculate the factor from the toolhead pos
-                factor = ((self.fade_end + self.fade_target - z) /
-                          (self.fade_dist - z_adj))
-                factor = constrain(factor, 0., 1.)
-            final_z_adj = factor * z_adj + self.fade_target
-            self.last_position[:] = [x, y, z - final_z_adj, e]
-        return list(self.last_position)
-    def move(self, newpos, speed):
-        factor = self.get_z_factor(newpos[2])
-        if self.z_mesh is None or not factor:
-            # No mesh calibrated, or mesh leveling phased out.
-            x, y, z, e = newpos
-            if self.log_fade_complete:
-                self.log_fade_complete = False
-                logging.info(
-                    "bed_mesh fade complete: Current Z: %.4f fade_target: %.4f "
-                    % (z, self.fade_target))
-            self.toolhead.move([x, y, z + self.fade_target, e], speed)
-        else:
-            self.splitter.build_move(self.last_position, newpos, factor)
-            while not self.splitter.traverse_complete:
-                split_move = self.splitter.split()
-                if split_move:
-                    self.toolhead.move(split_move, speed)
-                else:
-                    raise self.gcode.error(
-                        "Mesh Leveling: Error splitting move ")
-        self.last_position[:] = newpos
+        if error is not None:
+            raise self.gcode.error(error)
     def get_status(self, eventtime=None):
         return self.status
+    def get_status_version(self):
+        return self.status_version
     def update_status(self):
+        self.status_version += 1
         self.status = {
             "profile_name": "",
             "mesh_min": (0., 0.),
@@ -271,9 +319,10 @@ class BedMesh:
             offsets = [None, None]
             for i, axis in enumerate(['X', 'Y']):
                 offsets[i] = gcmd.get_float(axis, None)
-            self.z_mesh.set_mesh_offsets(offsets)
-            gcode_move = self.printer.lookup_object('gcode_move')
-            gcode_move.reset_last_position()
+            def update():
+                self.z_mesh.set_mesh_offsets(offsets)
+                self._load_mesh()
+            self._update_mesh_state(update)
         else:
             gcmd.respond_info("No mesh loaded to offset")
 
@@ -802,70 +851,6 @@ class BedMeshCalibrate:
                 "  %-4d| %-17s| %-25s| %s" % (i, gen_pt, probed_pt, corr_pt))
 
 
-class MoveSplitter:
-    def __init__(self, config, gcode):
-        self.split_delta_z = config.getfloat(
-            'split_delta_z', .025, minval=0.01)
-        self.move_check_distance = config.getfloat(
-            'move_check_distance', 5., minval=3.)
-        self.z_mesh = None
-        self.fade_offset = 0.
-        self.gcode = gcode
-    def initialize(self, mesh, fade_offset):
-        self.z_mesh = mesh
-        self.fade_offset = fade_offset
-    def build_move(self, prev_pos, next_pos, factor):
-        self.prev_pos = tuple(prev_pos)
-        self.next_pos = tuple(next_pos)
-        self.current_pos = list(prev_pos)
-        self.z_factor = factor
-        self.z_offset = self._calc_z_offset(prev_pos)
-        self.traverse_complete = False
-        self.distance_checked = 0.
-        axes_d = [self.next_pos[i] - self.prev_pos[i] for i in range(4)]
-        self.total_move_length = math.sqrt(sum([d*d for d in axes_d[:3]]))
-        self.axis_move = [not isclose(d, 0., abs_tol=1e-10) for d in axes_d]
-    def _calc_z_offset(self, pos):
-        z = self.z_mesh.calc_z(pos[0], pos[1])
-        offset = self.fade_offset
-        return self.z_factor * (z - offset) + offset
-    def _set_next_move(self, distance_from_prev):
-        t = distance_from_prev / self.total_move_length
-        if t > 1. or t < 0.:
-            raise self.gcode.error(
-                "bed_mesh: Slice distance is negative "
-                "or greater than entire move length")
-        for i in range(4):
-            if self.axis_move[i]:
-                self.current_pos[i] = lerp(
-                    t, self.prev_pos[i], self.next_pos[i])
-    def split(self):
-        if not self.traverse_complete:
-            if self.axis_move[0] or self.axis_move[1]:
-                # X and/or Y axis move, traverse if necessary
-                while self.distance_checked + self.move_check_distance \
-                        < self.total_move_length:
-                    self.distance_checked += self.move_check_distance
-                    self._set_next_move(self.distance_checked)
-                    next_z = self._calc_z_offset(self.current_pos)
-                    if abs(next_z - self.z_offset) >= self.split_delta_z:
-                        self.z_offset = next_z
-                        return self.current_pos[0], self.current_pos[1], \
-                            self.current_pos[2] + self.z_offset, \
-                            self.current_pos[3]
-            # end of move reached
-            self.current_pos[:] = self.next_pos
-            self.z_offset = self._calc_z_offset(self.current_pos)
-            # Its okay to add Z-Offset to the final move, since it will not be
-            # used again.
-            self.current_pos[2] += self.z_offset
-            self.traverse_complete = True
-            return self.current_pos
-        else:
-            # Traverse complete
-            return None
-
-
 class ZMesh:
     def __init__(self, params):
         self.probed_matrix = self.mesh_matrix = None
@@ -882,13 +867,9 @@ class ZMesh:
             "bed_mesh: Mesh Min: (%.2f,%.2f) Mesh Max: (%.2f,%.2f)"
             % (self.mesh_x_min, self.mesh_y_min,
                self.mesh_x_max, self.mesh_y_max))
-        # Set the interpolation algorithm
-        interpolation_algos = {
-            'lagrange': self._sample_lagrange,
-            'bicubic': self._sample_bicubic,
-            'direct': self._sample_direct
-        }
-        self._sample = interpolation_algos.get(params['algo'])
+        # The mesh is interpolated and evaluated in C code
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.c_mesh = ffi_main.gc(ffi_lib.zmesh_alloc(), ffi_lib.zmesh_free)
         # Number of points to interpolate per segment
         mesh_x_pps = params['mesh_x_pps']
         mesh_y_pps = params['mesh_y_pps']
@@ -900,10 +881,6 @@ class ZMesh:
         self.y_mult = mesh_y_pps + 1
         logging.debug("bed_mesh: Mesh grid size - X:%d, Y:%d"
                       % (self.mesh_x_count, self.mesh_y_count))
-        self.mesh_x_dist = (self.mesh_x_max - self.mesh_x_min) / \
-                           (self.mesh_x_count - 1)
-        self.mesh_y_dist = (self.mesh_y_max - self.mesh_y_min) / \
-                           (self.mesh_y_count - 1)
     def get_mesh_matrix(self):
         if self.mesh_matrix is not None:
             return [[round(z, 6) for z in line]
@@ -949,37 +926,47 @@ class ZMesh:
             print_func("bed_mesh: Z Mesh not generated")
     def build_mesh(self, z_matrix):
         self.probed_matrix = z_matrix
-        self._sample(z_matrix)
+        self._build()
         self.print_mesh(logging.debug)
+    def _build(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        params = self.mesh_params
+        probed = [z for line in self.probed_matrix for z in line]
+        ret = ffi_lib.zmesh_build(
+            self.c_mesh, params['algo'][0].encode(),
+            params['x_count'], params['y_count'], self.x_mult, self.y_mult,
+            params['tension'], self.mesh_x_min, self.mesh_y_min,
+            self.mesh_x_max, self.mesh_y_max,
+            ffi_main.new('double[]', probed))
+        if ret:
+            self.mesh_matrix = None
+            raise BedMeshError("bed_mesh: Unable to generate mesh")
+        x_cnt, y_cnt = self.mesh_x_count, self.mesh_y_count
+        out = ffi_main.new('double[]', x_cnt * y_cnt)
+        ffi_lib.zmesh_get_table(self.c_mesh, out)
+        self.mesh_matrix = [list(ffi_main.unpack(out + i * x_cnt, x_cnt))
+                            for i in range(y_cnt)]
     def set_zero_reference(self, xpos, ypos):
         offset = self.calc_z(xpos, ypos)
         logging.info(
             "bed_mesh: setting zero reference at (%.2f, %.2f, %.6f)"
             % (xpos, ypos, offset)
         )
-        for matrix in [self.probed_matrix, self.mesh_matrix]:
-            for yidx in range(len(matrix)):
-                for xidx in range(len(matrix[yidx])):
-                    matrix[yidx][xidx] -= offset
+        self.probed_matrix = [[z - offset for z in line]
+                              for line in self.probed_matrix]
+        self._build()
     def set_mesh_offsets(self, offsets):
         for i, o in enumerate(offsets):
             if o is not None:
                 self.mesh_offsets[i] = o
-    def get_x_coordinate(self, index):
-        return self.mesh_x_min + self.mesh_x_dist * index
-    def get_y_coordinate(self, index):
-        return self.mesh_y_min + self.mesh_y_dist * index
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.zmesh_set_offsets(self.c_mesh, *self.mesh_offsets)
     def calc_z(self, x, y):
-        if self.mesh_matrix is not None:
-            tbl = self.mesh_matrix
-            tx, xidx = self._get_linear_index(x + self.mesh_offsets[0], 0)
-            ty, yidx = self._get_linear_index(y + self.mesh_offsets[1], 1)
-            z0 = lerp(tx, tbl[yidx][xidx], tbl[yidx][xidx+1])
-            z1 = lerp(tx, tbl[yidx+1][xidx], tbl[yidx+1][xidx+1])
-            return lerp(ty, z0, z1)
-        else:
+        if self.mesh_matrix is None:
             # No mesh table generated, no z-adjustment
             return 0.
+        ffi_main, ffi_lib = chelper.get_ffi()
+        return ffi_lib.zmesh_calc_z(self.c_mesh, x, y)
     def get_z_range(self):
         if self.mesh_matrix is not None:
             mesh_min = min([min(x) for x in self.mesh_matrix])
@@ -997,176 +984,6 @@ class ZMesh:
             return round(avg_z, 2)
         else:
             return 0.
-    def _get_linear_index(self, coord, axis):
-        if axis == 0:
-            # X-axis
-            mesh_min = self.mesh_x_min
-            mesh_cnt = self.mesh_x_count
-            mesh_dist = self.mesh_x_dist
-            cfunc = self.get_x_coordinate
-        else:
-            # Y-axis
-            mesh_min = self.mesh_y_min
-            mesh_cnt = self.mesh_y_count
-            mesh_dist = self.mesh_y_dist
-            cfunc = self.get_y_coordinate
-        t = 0.
-        idx = int(math.floor((coord - mesh_min) / mesh_dist))
-        idx = constrain(idx, 0, mesh_cnt - 2)
-        t = (coord - cfunc(idx)) / mesh_dist
-        return constrain(t, 0., 1.), idx
-    def _sample_direct(self, z_matrix):
-        self.mesh_matrix = z_matrix
-    def _sample_lagrange(self, z_matrix):
-        x_mult = self.x_mult
-        y_mult = self.y_mult
-        self.mesh_matrix = \
-            [[0. if ((i % x_mult) or (j % y_mult))
-             else z_matrix[j//y_mult][i//x_mult]
-             for i in range(self.mesh_x_count)]
-             for j in range(self.mesh_y_count)]
-        xpts, ypts = self._get_lagrange_coords()
-        # Interpolate X coordinates
-        for i in range(self.mesh_y_count):
-            # only interpolate X-rows that have probed coordinates
-            if i % y_mult != 0:
-                continue
-            for j in range(self.mesh_x_count):
-                if j % x_mult == 0:
-                    continue
-                x = self.get_x_coordinate(j)
-                self.mesh_matrix[i][j] = self._calc_lagrange(xpts, x, i, 0)
-        # Interpolate Y coordinates
-        for i in range(self.mesh_x_count):
-            for j in range(self.mesh_y_count):
-                if j % y_mult == 0:
-                    continue
-                y = self.get_y_coordinate(j)
-                self.mesh_matrix[j][i] = self._calc_lagrange(ypts, y, i, 1)
-    def _get_lagrange_coords(self):
-        xpts = []
-        ypts = []
-        for i in range(self.mesh_params['x_count']):
-            xpts.append(self.get_x_coordinate(i * self.x_mult))
-        for j in range(self.mesh_params['y_count']):
-            ypts.append(self.get_y_coordinate(j * self.y_mult))
-        return xpts, ypts
-    def _calc_lagrange(self, lpts, c, vec, axis=0):
-        pt_cnt = len(lpts)
-        total = 0.
-        for i in range(pt_cnt):
-            n = 1.
-            d = 1.
-            for j in range(pt_cnt):
-                if j == i:
-                    continue
-                n *= (c - lpts[j])
-                d *= (lpts[i] - lpts[j])
-            if axis == 0:
-                # Calc X-Axis
-                z = self.mesh_matrix[vec][i*self.x_mult]
-            else:
-                # Calc Y-Axis
-                z = self.mesh_matrix[i*self.y_mult][vec]
-            total += z * n / d
-        return total
-    def _sample_bicubic(self, z_matrix):
-        # should work for any number of probe points above 3x3
-        x_mult = self.x_mult
-        y_mult = self.y_mult
-        c = self.mesh_params['tension']
-        self.mesh_matrix = \
-            [[0. if ((i % x_mult) or (j % y_mult))
-             else z_matrix[j//y_mult][i//x_mult]
-             for i in range(self.mesh_x_count)]
-             for j in range(self.mesh_y_count)]
-        # Interpolate X values
-        for y in range(self.mesh_y_count):
-            if y % y_mult != 0:
-                continue
-            for x in range(self.mesh_x_count):
-                if x % x_mult == 0:
-                    continue
-                pts = self._get_x_ctl_pts(x, y)
-                self.mesh_matrix[y][x] = self._cardinal_spline(pts, c)
-        # Interpolate Y values
-        for x in range(self.mesh_x_count):
-            for y in range(self.mesh_y_count):
-                if y % y_mult == 0:
-                    continue
-                pts = self._get_y_ctl_pts(x, y)
-                self.mesh_matrix[y][x] = self._cardinal_spline(pts, c)
-    def _get_x_ctl_pts(self, x, y):
-        # Fetch control points and t for a X value in the mesh
-        x_mult = self.x_mult
-        x_row = self.mesh_matrix[y]
-        last_pt = self.mesh_x_count - 1 - x_mult
-        if x < x_mult:
-            p0 = p1 = x_row[0]
-            p2 = x_row[x_mult]
-            p3 = x_row[2*x_mult]
-            t = x / float(x_mult)
-        elif x > last_pt:
-            p0 = x_row[last_pt - x_mult]
-            p1 = x_row[last_pt]
-            p2 = p3 = x_row[last_pt + x_mult]
-            t = (x - last_pt) / float(x_mult)
-        else:
-            found = False
-            for i in range(x_mult, last_pt, x_mult):
-                if x > i and x < (i + x_mult):
-                    p0 = x_row[i - x_mult]
-                    p1 = x_row[i]
-                    p2 = x_row[i + x_mult]
-                    p3 = x_row[i + 2*x_mult]
-                    t = (x - i) / float(x_mult)
-                    found = True
-                    break
-            if not found:
-                raise BedMeshError(
-                    "bed_mesh: Error finding x control points")
-        return p0, p1, p2, p3, t
-    def _get_y_ctl_pts(self, x, y):
-        # Fetch control points and t for a Y value in the mesh
-        y_mult = self.y_mult
-        last_pt = self.mesh_y_count - 1 - y_mult
-        y_col = self.mesh_matrix
-        if y < y_mult:
-            p0 = p1 = y_col[0][x]
-            p2 = y_col[y_mult][x]
-            p3 = y_col[2*y_mult][x]
-            t = y / float(y_mult)
-        elif y > last_pt:
-            p0 = y_col[last_pt - y_mult][x]
-            p1 = y_col[last_pt][x]
-            p2 = p3 = y_col[last_pt + y_mult][x]
-            t = (y - last_pt) / float(y_mult)
-        else:
-            found = False
-            for i in range(y_mult, last_pt, y_mult):
-                if y > i and y < (i + y_mult):
-                    p0 = y_col[i - y_mult][x]
-                    p1 = y_col[i][x]
-                    p2 = y_col[i + y_mult][x]
-                    p3 = y_col[i + 2*y_mult][x]
-                    t = (y - i) / float(y_mult)
-                    found = True
-                    break
-            if not found:
-                raise BedMeshError(
-                    "bed_mesh: Error finding y control points")
-        return p0, p1, p2, p3, t
-    def _cardinal_spline(self, p, tension):
-        t = p[4]
-        t2 = t*t
-        t3 = t2*t
-        m1 = tension * (p[2] - p[0])
-        m2 = tension * (p[3] - p[1])
-        a = p[1] * (2*t3 - 3*t2 + 1)
-        b = p[2] * (-2*t3 + 3*t2)
-        c = m1 * (t3 - 2*t2 + t)
-        d = m2 * (t3 - t2)
-        return a + b + c + d
 
 
 class ProfileManager:
@@ -10,27 +10,22 @@ from . import probe
 class BedTilt:
     def __init__(self, config):
         self.printer = config.get_printer()
-        self.printer.register_event_handler("klippy:connect",
-                                            self.handle_connect)
         self.x_adjust = config.getfloat('x_adjust', 0.)
         self.y_adjust = config.getfloat('y_adjust', 0.)
         self.z_adjust = config.getfloat('z_adjust', 0.)
         if config.get('points', None) is not None:
             BedTiltCalibrate(config, self)
-        self.toolhead = None
         # Register move transform with g-code class
         gcode_move = self.printer.load_object(config, 'gcode_move')
-        gcode_move.set_move_transform(self)
-    def handle_connect(self):
-        self.toolhead = self.printer.lookup_object('toolhead')
-    def get_position(self):
-        x, y, z, e = self.toolhead.get_position()
-        return [x, y, z - x*self.x_adjust - y*self.y_adjust - self.z_adjust, e]
-    def move(self, newpos, speed):
-        x, y, z, e = newpos
-        self.toolhead.move([x, y, z + x*self.x_adjust + y*self.y_adjust
-                            + self.z_adjust, e], speed)
+        self.transform = gcode_move.add_transform_stage()
+        self._update_transform(self.x_adjust, self.y_adjust, self.z_adjust)
+    def _update_transform(self, x_adjust, y_adjust, z_adjust):
+        self.transform.set_affine([
+            [1., 0., 0., 0.], [0., 1., 0., 0.],
+            [x_adjust, y_adjust, 1., z_adjust]])
     def update_adjust(self, x_adjust, y_adjust, z_adjust):
+        # The transform is left unchanged if the adjustment is rejected
+        self._update_transform(x_adjust, y_adjust, z_adjust)
         self.x_adjust = x_adjust
         self.y_adjust = y_adjust
         self.z_adjust = z_adjust
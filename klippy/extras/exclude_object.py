@@ -98,7 +98,7 @@ class ExcludeObject:
             self.last_position[i] = pos[i] + offset[i]
         return list(self.last_position)
 
-    def _normal_move(self, newpos, speed):
+    def _normal_move(self, newpos, speed, arc=None):
         offset = self._get_extrusion_offsets()
 
         if self.initial_extrusion_moves > 0 and \
@@ -139,7 +139,11 @@ class ExcludeObject:
         tx_pos = newpos[:]
         for i in range(4):
             tx_pos[i] = newpos[i] - offset[i]
-        self.next_transform.move(tx_pos, speed)
+        if arc is None:
+            self.next_transform.move(tx_pos, speed)
+        else:
+            arc_a, arc_b, angle = arc
+            self.next_transform.arc_move(tx_pos, arc_a, arc_b, angle, speed)
 
     def _ignore_move(self, newpos, speed):
         offset = self._get_extrusion_offsets()
@@ -192,6 +196,18 @@ class ExcludeObject:
             else:
                 self._normal_move(newpos, speed)
 
+    def can_arc_move(self, arc_a, arc_b):
+        if self.in_excluded_region or self._test_in_excluded_region():
+            # Arcs into, inside, or out of excluded objects are made as
+            # linear moves
+            return False
+        return self.gcode_move.can_arc_move(arc_a, arc_b,
+                                            self.next_transform)
+
+    def arc_move(self, newpos, arc_a, arc_b, angle, speed):
+        self.last_speed = speed
+        self._normal_move(newpos, speed, (arc_a, arc_b, angle))
+
     cmd_EXCLUDE_OBJECT_START_help = "Marks the beginning the current object" \
                                     " as labeled"
     def cmd_EXCLUDE_OBJECT_START(self, gcmd):
@@ -8,7 +8,9 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math
 
-# Coordinates created by this are converted into G1 commands.
+# Arcs are queued as native arc moves when the g-code move transforms
+# support them.  Otherwise, coordinates created by this are converted
+# into G1 commands.
 #
 # supports XY, XZ & YZ planes with remaining axis as helical
 
@@ -90,6 +92,13 @@ class ArcSupport:
         asE = gcmd.get_float("E", None)
         asF = gcmd.get_float("F", None)
 
+        angular_travel = self.calcAngularTravel(
+            currentPos, asTarget, asPlanar, clockwise, *axes)
+        arc_a, arc_b = self.calcArcVectors(asPlanar, angular_travel, *axes)
+        if angular_travel and self.gcode_move.can_arc_move(arc_a, arc_b):
+            self._arc_move(asTarget, arc_a, arc_b, angular_travel, asE, asF)
+            return
+
         # Build list of linear coordinates to move
         coords = self.planArc(currentPos, asTarget, asPlanar,
                               clockwise, *axes)
@@ -111,18 +120,30 @@ class ArcSupport:
             g1_gcmd = self.gcode.create_gcode_command("G1", "G1", g1_params)
             self.gcode_move.cmd_G1(g1_gcmd)
 
-    # function planArc() originates from marlin plan_arc()
-    # https://github.com/MarlinFirmware/Marlin
-    #
-    # The arc is approximated by generating many small linear segments.
-    # The length of each segment is configured in MM_PER_ARC_SEGMENT
-    # Arcs smaller then this value, will be a Line only
-    #
-    # alpha and beta axes are the current plane, helical axis is linear travel
-    def planArc(self, currentPos, targetPos, offset, clockwise,
-                alpha_axis, beta_axis, helical_axis):
-        # todo: sometimes produces full circles
-
+    def calcArcVectors(self, offset, angular_travel,
+                       alpha_axis, beta_axis, helical_axis):
+        # Radius vector from center to current location and that
+        # vector rotated 90 degrees in the direction of travel
+        arc_a = [0., 0., 0.]
+        arc_b = [0., 0., 0.]
+        arc_a[alpha_axis] = -offset[0]
+        arc_a[beta_axis] = -offset[1]
+        direction = 1. if angular_travel > 0. else -1.
+        arc_b[alpha_axis] = offset[1] * direction
+        arc_b[beta_axis] = -offset[0] * direction
+        return arc_a, arc_b
+
+    def _arc_move(self, targetPos, arc_a, arc_b, angular_travel, asE, asF):
+        g1_params = {'X': targetPos[0], 'Y': targetPos[1], 'Z': targetPos[2]}
+        if asE is not None:
+            g1_params['E'] = asE
+        if asF is not None:
+            g1_params['F'] = asF
+        g1_gcmd = self.gcode.create_gcode_command("G1", "G1", g1_params)
+        self.gcode_move.arc_move(g1_gcmd, arc_a, arc_b, abs(angular_travel))
+
+    def calcAngularTravel(self, currentPos, targetPos, offset, clockwise,
+                          alpha_axis, beta_axis, helical_axis):
         # Radius vector from center to current location
         r_P = -offset[0]
         r_Q = -offset[1]
@@ -145,6 +166,29 @@ class ArcSupport:
             # Make a circle if the angular rotation is 0 and the
             # target is current position
             angular_travel = 2. * math.pi
+        return angular_travel
+
+    # function planArc() originates from marlin plan_arc()
+    # https://github.com/MarlinFirmware/Marlin
+    #
+    # The arc is approximated by generating many small linear segments.
+    # The length of each segment is configured in MM_PER_ARC_SEGMENT
+    # Arcs smaller then this value, will be a Line only
+    #
+    # alpha and beta axes are the current plane, helical axis is linear travel
+    def planArc(self, currentPos, targetPos, offset, clockwise,
+                alpha_axis, beta_axis, helical_axis):
+        # todo: sometimes produces full circles
+
+        # Radius vector from center to current location
+        r_P = -offset[0]
+        r_Q = -offset[1]
+        center_P = currentPos[alpha_axis] - r_P
+        center_Q = currentPos[beta_axis] - r_Q
+
+        angular_travel = self.calcAngularTravel(
+            currentPos, targetPos, offset, clockwise,
+            alpha_axis, beta_axis, helical_axis)
 
         # Determine number of segments
         linear_travel = targetPos[helical_axis] - currentPos[helical_axis]
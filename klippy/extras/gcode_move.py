@@ -4,6 +4,97 @@
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging
+import chelper
+
+# Maximum relative change in the shape of an arc for it to still be
+# made as a circular arc move after a transform
+ARC_DISTORTION = .0001
+
+# Affine coordinate transforms that are combined and evaluated in C code
+class TransformPipeline:
+    def __init__(self, printer):
+        self.printer = printer
+        self.next_transform = None
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.pipeline = ffi_main.gc(ffi_lib.transform_pipeline_alloc(),
+                                    ffi_lib.free)
+        self.coord = ffi_main.new('double[3]')
+        self.arc_coords = ffi_main.new('double[9]')
+        self.transform_apply = ffi_lib.transform_pipeline_apply
+        self.transform_unapply = ffi_lib.transform_pipeline_unapply
+    def set_next_transform(self, next_transform):
+        self.next_transform = next_transform
+        if next_transform is None:
+            # The toolhead is not available until after config parsing
+            self.printer.register_event_handler("klippy:connect",
+                                                self._handle_connect)
+    def _handle_connect(self):
+        self.next_transform = self.printer.lookup_object('toolhead')
+    def add_stage(self):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        stage = ffi_lib.transform_pipeline_add_stage(self.pipeline)
+        if stage < 0:
+            raise self.printer.config_error("Too many move transforms")
+        return TransformStage(self, stage)
+    def set_stage(self, stage, matrix):
+        # The C code validates the matrix (and the combined transform)
+        # before changing any state, so an error leaves the pipeline
+        # unchanged
+        flat = [float(v) for row in matrix for v in row]
+        if len(matrix) != 3 or len(flat) != 12:
+            raise self.printer.command_error("Invalid move transform")
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ret = ffi_lib.transform_pipeline_set_stage(
+            self.pipeline, stage, ffi_main.new('double[12]', flat))
+        if ret:
+            raise self.printer.command_error("Invalid move transform")
+    def get_position(self):
+        pos = self.next_transform.get_position()
+        c = self.coord
+        c[0], c[1], c[2] = pos[:3]
+        self.transform_unapply(self.pipeline, c, 1)
+        return [c[0], c[1], c[2], pos[3]]
+    def move(self, newpos, speed):
+        c = self.coord
+        c[0], c[1], c[2] = newpos[:3]
+        self.transform_apply(self.pipeline, c, 1)
+        self.next_transform.move([c[0], c[1], c[2], newpos[3]], speed)
+    def _transform_arc(self, arc_a, arc_b):
+        # The arc vectors are only changed by the linear part of the
+        # transform (an offset has no effect on them)
+        v = self.arc_coords
+        v[0:9] = [0., 0., 0.] + list(arc_a[:3]) + list(arc_b[:3])
+        self.transform_apply(self.pipeline, v, 3)
+        return ([v[i+3] - v[i] for i in range(3)],
+                [v[i+6] - v[i] for i in range(3)])
+    def can_arc_move(self, arc_a, arc_b):
+        arc_a, arc_b = self._transform_arc(arc_a, arc_b)
+        # The transformed arc must still be a circle (skewed or tilted
+        # arcs are made as linear segments)
+        aa = sum([a*a for a in arc_a])
+        bb = sum([b*b for b in arc_b])
+        ab = sum([a*b for a, b in zip(arc_a, arc_b)])
+        max_err = ARC_DISTORTION * aa
+        if abs(aa - bb) > max_err or abs(ab) > max_err:
+            return False
+        gcode_move = self.printer.lookup_object('gcode_move')
+        return gcode_move.can_arc_move(arc_a, arc_b, self.next_transform)
+    def arc_move(self, newpos, arc_a, arc_b, angle, speed):
+        arc_a, arc_b = self._transform_arc(arc_a, arc_b)
+        c = self.coord
+        c[0], c[1], c[2] = newpos[:3]
+        self.transform_apply(self.pipeline, c, 1)
+        self.next_transform.arc_move([c[0], c[1], c[2], newpos[3]],
+                                     arc_a, arc_b, angle, speed)
+
+class TransformStage:
+    def __init__(self, pipeline, stage):
+        self.pipeline = pipeline
+        self.stage = stage
+    def set_affine(self, matrix):
+        # The matrix is three rows of four values (x, y, and z factors
+        # followed by an offset)
+        self.pipeline.set_stage(self.stage, matrix)
 
 class GCodeMove:
     def __init__(self, config):
@@ -48,12 +139,14 @@ class GCodeMove:
         # G-Code state
         self.saved_states = {}
         self.move_transform = self.move_with_transform = None
+        self.arc_with_transform = None
         self.position_with_transform = (lambda: [0., 0., 0., 0.])
     def _handle_ready(self):
         self.is_printer_ready = True
         if self.move_transform is None:
             toolhead = self.printer.lookup_object('toolhead')
             self.move_with_transform = toolhead.move
+            self.arc_with_transform = toolhead.arc_move
             self.position_with_transform = toolhead.get_position
         self.reset_last_position()
     def _handle_shutdown(self):
@@ -84,8 +177,26 @@ class GCodeMove:
             old_transform = self.printer.lookup_object('toolhead', None)
         self.move_transform = transform
         self.move_with_transform = transform.move
+        # Transforms that do not implement arc_move() get linear segments
+        self.arc_with_transform = getattr(transform, 'arc_move', None)
+        if self.arc_with_transform is None:
+            logging.info("G-Code move transform %s does not support arc"
+                         " moves - arcs will be split into linear moves",
+                         type(transform).__name__)
         self.position_with_transform = transform.get_position
         return old_transform
+    def add_transform_stage(self, force=False):
+        # Adjacent affine transforms share a single TransformPipeline
+        transform = self.move_transform
+        if isinstance(transform, TransformPipeline):
+            return transform.add_stage()
+        if transform is not None and not force:
+            raise self.printer.config_error(
+                "G-Code move transform already specified")
+        pipeline = TransformPipeline(self.printer)
+        pipeline.set_next_transform(
+            self.set_move_transform(pipeline, force=True))
+        return pipeline.add_stage()
     def _get_gcode_position(self):
         p = [lp - bp for lp, bp in zip(self.last_position, self.base_position)]
         p[3] /= self.extrude_factor
@@ -110,8 +221,7 @@ class GCodeMove:
         if self.is_printer_ready:
             self.last_position = self.position_with_transform()
     # G-Code movement commands
-    def cmd_G1(self, gcmd):
-        # Move
+    def _update_move_position(self, gcmd):
         params = gcmd.get_command_parameters()
         try:
             for pos, axis in enumerate('XYZ'):
@@ -140,7 +250,29 @@ class GCodeMove:
         except ValueError as e:
             raise gcmd.error("Unable to parse move '%s'"
                              % (gcmd.get_commandline(),))
+    def cmd_G1(self, gcmd):
+        # Move
+        self._update_move_position(gcmd)
         self.move_with_transform(self.last_position, self.speed)
+    def can_arc_move(self, arc_a, arc_b, transform=None):
+        # Report if 'transform' (by default, the first transform) can
+        # make a circular arc move with the given arc vectors.
+        # Transforms may implement can_arc_move() to decline some arcs.
+        if transform is None:
+            if self.arc_with_transform is None:
+                return False
+            transform = self.move_transform
+            if transform is None:
+                return True
+        if getattr(transform, 'arc_move', None) is None:
+            return False
+        can_arc_move = getattr(transform, 'can_arc_move', None)
+        return can_arc_move is None or can_arc_move(arc_a, arc_b)
+    def arc_move(self, gcmd, arc_a, arc_b, angle):
+        # Circular move to the G1 style target in gcmd (see ArcMove)
+        self._update_move_position(gcmd)
+        self.arc_with_transform(self.last_position, arc_a, arc_b, angle,
+                                self.speed)
     # G-Code coordinate manipulation
     def cmd_G20(self, gcmd):
         # Set units to inches
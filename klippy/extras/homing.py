@@ -214,12 +214,16 @@ class Homing:
             # Apply any homing offsets
             kin = self.toolhead.get_kinematics()
             homepos = self.toolhead.get_position()
-            kin_spos = {s.get_name(): (s.get_commanded_position()
-                                       + self.adjust_pos.get(s.get_name(), 0.))
+            cur_spos = {s.get_name(): s.get_commanded_position()
                         for s in kin.get_steppers()}
+            kin_spos = {name: pos + self.adjust_pos.get(name, 0.)
+                        for name, pos in cur_spos.items()}
+            curpos = kin.calc_position(cur_spos)
             newpos = kin.calc_position(kin_spos)
+            # Apply as a relative change (the toolhead position may
+            # include an adjustment made during step generation)
             for axis in homing_axes:
-                homepos[axis] = newpos[axis]
+                homepos[axis] += newpos[axis] - curpos[axis]
             self.toolhead.set_position(homepos)
 
 class PrinterHoming:
@@ -12,9 +12,12 @@ class InputShaperParams:
     def __init__(self, axis, config):
         self.axis = axis
         self.shapers = {s.name : s.init_func for s in shaper_defs.INPUT_SHAPERS}
+        self.smoothers = {s.name : s.init_func
+                          for s in shaper_defs.INPUT_SMOOTHERS}
         shaper_type = config.get('shaper_type', 'mzv')
         self.shaper_type = config.get('shaper_type_' + axis, shaper_type)
-        if self.shaper_type not in self.shapers:
+        if (self.shaper_type not in self.shapers
+                and self.shaper_type not in self.smoothers):
             raise config.error(
                     'Unsupported shaper type: %s' % (self.shaper_type,))
         self.damping_ratio = config.getfloat('damping_ratio_' + axis,
@@ -31,16 +34,23 @@ class InputShaperParams:
         shaper_type = gcmd.get('SHAPER_TYPE', None)
         if shaper_type is None:
             shaper_type = gcmd.get('SHAPER_TYPE_' + axis, self.shaper_type)
-        if shaper_type.lower() not in self.shapers:
+        if (shaper_type.lower() not in self.shapers
+                and shaper_type.lower() not in self.smoothers):
             raise gcmd.error('Unsupported shaper type: %s' % (shaper_type,))
         self.shaper_type = shaper_type.lower()
     def get_shaper(self):
-        if not self.shaper_freq:
+        if not self.shaper_freq or self.shaper_type in self.smoothers:
             A, T = shaper_defs.get_none_shaper()
         else:
             A, T = self.shapers[self.shaper_type](
                     self.shaper_freq, self.damping_ratio)
         return len(A), A, T
+    def get_smoother(self):
+        if not self.shaper_freq or self.shaper_type not in self.smoothers:
+            return None
+        C, t_sm = self.smoothers[self.shaper_type](
+                self.shaper_freq, self.damping_ratio)
+        return len(C), C, t_sm
     def get_status(self):
         return collections.OrderedDict([
             ('shaper_type', self.shaper_type),
@@ -52,6 +62,7 @@ class AxisInputShaper:
         self.axis = axis
         self.params = InputShaperParams(axis, config)
         self.n, self.A, self.T = self.params.get_shaper()
+        self.smoother = self.params.get_smoother()
         self.saved = None
     def get_name(self):
         return 'shaper_' + self.axis
@@ -61,25 +72,32 @@ class AxisInputShaper:
         self.params.update(gcmd)
         old_n, old_A, old_T = self.n, self.A, self.T
         self.n, self.A, self.T = self.params.get_shaper()
-    def set_shaper_kinematics(self, sk):
+        self.smoother = self.params.get_smoother()
+    def _set_params(self, sk):
         ffi_main, ffi_lib = chelper.get_ffi()
-        success = ffi_lib.input_shaper_set_shaper_params(
-                sk, self.axis.encode(), self.n, self.A, self.T) == 0
+        if self.smoother is not None:
+            n, C, t_sm = self.smoother
+            return ffi_lib.input_shaper_set_smoother_params(
+                    sk, self.axis.encode(), n, C, t_sm)
+        return ffi_lib.input_shaper_set_shaper_params(
+                sk, self.axis.encode(), self.n, self.A, self.T)
+    def set_shaper_kinematics(self, sk):
+        success = self._set_params(sk) == 0
         if not success:
             self.disable_shaping()
-            ffi_lib.input_shaper_set_shaper_params(
-                    sk, self.axis.encode(), self.n, self.A, self.T)
+            self._set_params(sk)
         return success
     def disable_shaping(self):
-        if self.saved is None and self.n:
-            self.saved = (self.n, self.A, self.T)
+        if self.saved is None and (self.n or self.smoother is not None):
+            self.saved = (self.n, self.A, self.T, self.smoother)
         A, T = shaper_defs.get_none_shaper()
         self.n, self.A, self.T = len(A), A, T
+        self.smoother = None
     def enable_shaping(self):
         if self.saved is None:
             # Input shaper was not disabled
             return
-        self.n, self.A, self.T = self.saved
+        self.n, self.A, self.T, self.smoother = self.saved
         self.saved = None
     def report(self, gcmd):
         info = ' '.join(["%s_%s:%s" % (key, self.axis, value)
@@ -90,6 +108,8 @@ class InputShaper:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.printer.register_event_handler("klippy:connect", self.connect)
+        self.printer.register_event_handler("stepper:set_active_axes",
+                                            self._handle_set_active_axes)
         self.toolhead = None
         self.shapers = [AxisInputShaper('x', config),
                         AxisInputShaper('y', config)]
@@ -106,6 +126,14 @@ class InputShaper:
         self.toolhead = self.printer.lookup_object("toolhead")
         # Configure initial values
         self._update_input_shaping(error=self.printer.config_error)
+    def _handle_set_active_axes(self, stepper):
+        if self.toolhead is None:
+            # Shaping is configured at connect
+            return
+        sk = stepper.get_stepper_kinematics()
+        if sk in self.input_shaper_stepper_kinematics:
+            # Reapply the shapers to the axes the stepper is now active on
+            self._update_input_shaping()
     def _get_input_shaper_stepper_kinematics(self, stepper):
         # Lookup stepper kinematics
         sk = stepper.get_stepper_kinematics()
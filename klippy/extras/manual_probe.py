@@ -164,12 +164,16 @@ class ManualProbeHelper:
         self.last_kinematics_pos = kin_pos
         return kin_pos
     def move_z(self, z_pos):
+        # Move relative to the toolhead position, as the kinematic
+        # position may include an adjustment (eg, from bed_mesh)
         curpos = self.toolhead.get_position()
+        z_adj = curpos[2] - self.get_kinematics_pos()[2]
         try:
             z_bob_pos = z_pos + Z_BOB_MINIMUM
-            if curpos[2] < z_bob_pos:
-                self.toolhead.manual_move([None, None, z_bob_pos], self.speed)
-            self.toolhead.manual_move([None, None, z_pos], self.speed)
+            if curpos[2] - z_adj < z_bob_pos:
+                self.toolhead.manual_move([None, None, z_bob_pos + z_adj],
+                                          self.speed)
+            self.toolhead.manual_move([None, None, z_pos + z_adj], self.speed)
         except self.printer.command_error as e:
             self.finalize(False)
             raise
@@ -3,8 +3,8 @@
 # Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging
-import chelper
+import logging, math
+import chelper, webhooks
 
 API_UPDATE_INTERVAL = 0.500
 
@@ -21,8 +21,10 @@ class APIDumpHelper:
         self.update_interval = update_interval
         self.update_timer = None
         self.clients = {}
+        self.binary_clients = set()
     def _stop(self):
         self.clients.clear()
+        self.binary_clients.clear()
         reactor = self.printer.get_reactor()
         reactor.unregister_timer(self.update_timer)
         self.update_timer = None
@@ -56,6 +58,8 @@ class APIDumpHelper:
     def add_client(self, web_request):
         cconn = web_request.get_client_connection()
         template = web_request.get_dict('response_template', {})
+        if web_request.get('binary_frames', False, types=(bool,)):
+            self.binary_clients.add(cconn)
         self.clients[cconn] = template
         self._start()
     def add_internal_client(self):
@@ -63,6 +67,25 @@ class APIDumpHelper:
         self.clients[cconn] = {}
         self._start()
         return cconn
+    def _get_json_msg(self, msg):
+        # A data_cb may report "columns" (a list of value arrays) instead
+        # of "data" rows - external clients are always sent "data" rows
+        if 'columns' not in msg:
+            return msg
+        jmsg = dict(msg)
+        jmsg['data'] = list(zip(*jmsg.pop('columns')))
+        return jmsg
+    def _encode_binary(self, msg):
+        bmsg = dict(msg)
+        columns = bmsg.pop('columns', None)
+        if columns is None:
+            columns = list(zip(*bmsg.pop('data')))
+        try:
+            bmsg['data_format'], body = webhooks.encode_columns(columns)
+        except (TypeError, ValueError) as e:
+            logging.exception("API Dump Helper binary encoding error")
+            return ()
+        return bmsg, body
     def _update(self, eventtime):
         try:
             msg = self.data_cb(eventtime)
@@ -71,14 +94,30 @@ class APIDumpHelper:
             return self._stop()
         if not msg:
             return eventtime + self.update_interval
+        jmsg = bmsg = None
         for cconn, template in list(self.clients.items()):
             if cconn.is_closed():
                 del self.clients[cconn]
+                self.binary_clients.discard(cconn)
                 if not self.clients:
                     return self._stop()
                 continue
             tmp = dict(template)
-            tmp['params'] = msg
+            if isinstance(cconn, InternalDumpClient):
+                tmp['params'] = msg
+                cconn.send(tmp)
+                continue
+            if cconn in self.binary_clients and (msg.get('data')
+                                                 or msg.get('columns')):
+                if bmsg is None:
+                    bmsg = self._encode_binary(msg)
+                if bmsg:
+                    tmp['params'], body = bmsg
+                    cconn.send_binary(tmp, body)
+                    continue
+            if jmsg is None:
+                jmsg = self._get_json_msg(msg)
+            tmp['params'] = jmsg
             cconn.send(tmp)
         return eventtime + self.update_interval
 
@@ -86,14 +125,25 @@ class APIDumpHelper:
 class InternalDumpClient:
     def __init__(self):
         self.msgs = []
+        self.msg_cb = None
         self.is_done = False
     def get_messages(self):
         return self.msgs
+    def set_message_callback(self, msg_cb):
+        # Pass messages to msg_cb instead of storing them
+        msgs = self.msgs
+        self.msgs = []
+        self.msg_cb = msg_cb
+        for msg in msgs:
+            msg_cb(msg)
     def finalize(self):
         self.is_done = True
     def is_closed(self):
         return self.is_done
     def send(self, msg):
+        if self.msg_cb is not None:
+            self.msg_cb(msg)
+            return
         self.msgs.append(msg)
         if len(self.msgs) >= 10000:
             # Avoid filling up memory with too many samples
@@ -196,6 +246,13 @@ class DumpTrapQ:
                        " sp=(%.6f,%.6f,%.6f) ar=(%.6f,%.6f,%.6f)"
                        % (i, m.print_time, m.move_t, m.start_v, m.accel,
                           m.start_x, m.start_y, m.start_z, m.x_r, m.y_r, m.z_r))
+            if m.arc_k:
+                out[-1] += (" arc=(%.6f,%.6f,%.6f,%.6f,%.6f,%.6f,%.9f)"
+                            % (m.arc_ax, m.arc_ay, m.arc_az, m.arc_bx,
+                               m.arc_by, m.arc_bz, m.arc_k))
+            if m.scurve_c3:
+                out[-1] += (" scurve=(%.6f,%.6f)"
+                            % (m.scurve_c3, m.scurve_c4))
         logging.info('\n'.join(out))
     def get_trapq_position(self, print_time):
         ffi_main, ffi_lib = chelper.get_ffi()
@@ -205,16 +262,27 @@ class DumpTrapQ:
             return None, None
         move = data[0]
         move_time = max(0., min(move.move_t, print_time - move.print_time))
-        dist = (move.start_v + .5 * move.accel * move_time) * move_time;
+        c3, c4 = move.scurve_c3, move.scurve_c4
+        dist = (move.start_v + (.5 * move.accel + (c3 + c4 * move_time)
+                                * move_time) * move_time) * move_time
         pos = (move.start_x + move.x_r * dist, move.start_y + move.y_r * dist,
                move.start_z + move.z_r * dist)
-        velocity = move.start_v + move.accel * move_time
+        if move.arc_k:
+            phi = move.arc_k * dist
+            ca, sa = math.cos(phi) - 1., math.sin(phi)
+            pos = (pos[0] + move.arc_ax * ca + move.arc_bx * sa,
+                   pos[1] + move.arc_ay * ca + move.arc_by * sa,
+                   pos[2] + move.arc_az * ca + move.arc_bz * sa)
+        velocity = move.start_v + (move.accel + (3. * c3 + 4. * c4 * move_time)
+                                   * move_time) * move_time
         return pos, velocity
     def _api_update(self, eventtime):
         qtime = self.last_api_msg[0] + min(self.last_api_msg[1], 0.100)
         data, cdata = self.extract_trapq(qtime, NEVER_TIME)
         d = [(m.print_time, m.move_t, m.start_v, m.accel,
-              (m.start_x, m.start_y, m.start_z), (m.x_r, m.y_r, m.z_r))
+              (m.start_x, m.start_y, m.start_z), (m.x_r, m.y_r, m.z_r),
+              (m.arc_ax, m.arc_ay, m.arc_az, m.arc_bx, m.arc_by, m.arc_bz,
+               m.arc_k), (m.scurve_c3, m.scurve_c4))
              for m in data]
         if d and d[0] == self.last_api_msg:
             d.pop(0)
@@ -225,7 +293,7 @@ class DumpTrapQ:
     def _add_api_client(self, web_request):
         self.api_dump.add_client(web_request)
         hdr = ('time', 'duration', 'start_velocity', 'acceleration',
-               'start_position', 'direction')
+               'start_position', 'direction', 'arc', 'scurve')
         web_request.send({'header': hdr})
 
 STATUS_REFRESH_TIME = 0.250
@@ -67,6 +67,8 @@ class MPU9250:
         if any([a not in am for a in axes_map]):
             raise config.error("Invalid mpu9250 axes_map parameter")
         self.axes_map = [am[a.strip()] for a in axes_map]
+        self.decoder = adxl345.BulkSampleDecoder(b'm', self.axes_map,
+                                                 SAMPLES_PER_BLOCK)
         self.data_rate = config.getint('rate', 4000)
         if self.data_rate not in SAMPLE_RATE_DIVS:
             raise config.error("Invalid rate parameter: %d" % (self.data_rate,))
@@ -124,38 +126,12 @@ class MPU9250:
         with self.lock:
             self.raw_samples.append(params)
     def _extract_samples(self, raw_samples):
-        # Load variables to optimize inner loop below
-        (x_pos, x_scale), (y_pos, y_scale), (z_pos, z_scale) = self.axes_map
-        last_sequence = self.last_sequence
-        time_base, chip_base, inv_freq = self.clock_sync.get_time_translation()
-        # Process every message in raw_samples
-        count = seq = 0
-        samples = [None] * (len(raw_samples) * SAMPLES_PER_BLOCK)
-        for params in raw_samples:
-            seq_diff = (last_sequence - params['sequence']) & 0xffff
-            seq_diff -= (seq_diff & 0x8000) << 1
-            seq = last_sequence - seq_diff
-            d = bytearray(params['data'])
-            msg_cdiff = seq * SAMPLES_PER_BLOCK - chip_base
-
-            for i in range(len(d) // BYTES_PER_SAMPLE):
-                d_xyz = d[i*BYTES_PER_SAMPLE:(i+1)*BYTES_PER_SAMPLE]
-                xhigh, xlow, yhigh, ylow, zhigh, zlow = d_xyz
-                # Merge and perform twos-complement
-                rx = ((xhigh << 8) | xlow) - ((xhigh & 0x80) << 9)
-                ry = ((yhigh << 8) | ylow) - ((yhigh & 0x80) << 9)
-                rz = ((zhigh << 8) | zlow) - ((zhigh & 0x80) << 9)
-
-                raw_xyz = (rx, ry, rz)
-                x = round(raw_xyz[x_pos] * x_scale, 6)
-                y = round(raw_xyz[y_pos] * y_scale, 6)
-                z = round(raw_xyz[z_pos] * z_scale, 6)
-                ptime = round(time_base + (msg_cdiff + i) * inv_freq, 6)
-                samples[count] = (ptime, x, y, z)
-                count += 1
-        self.clock_sync.set_last_chip_clock(seq * SAMPLES_PER_BLOCK + i)
-        del samples[count:]
-        return samples
+        time_translation = self.clock_sync.get_time_translation()
+        columns, error_count, last_chip_clock = self.decoder.extract(
+            raw_samples, self.last_sequence, time_translation)
+        if last_chip_clock is not None:
+            self.clock_sync.set_last_chip_clock(last_chip_clock)
+        return columns
 
     def _update_clock(self, minclock=0):
         # Query current state
@@ -253,10 +229,10 @@ class MPU9250:
             self.raw_samples = []
         if not raw_samples:
             return {}
-        samples = self._extract_samples(raw_samples)
-        if not samples:
+        columns = self._extract_samples(raw_samples)
+        if not columns[0]:
             return {}
-        return {'data': samples, 'errors': self.last_error_count,
+        return {'columns': columns, 'errors': self.last_error_count,
                 'overflows': self.last_limit_count}
     def _api_startstop(self, is_start):
         if is_start:
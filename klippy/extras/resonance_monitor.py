@@ -0,0 +1,165 @@
+# Continuous monitoring of printer resonances with an accelerometer
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging, math
+import chelper
+
+STATUS_INTERVAL = 1.
+AXES = 'xyz'
+
+class ResonanceMonitor:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.chip_name = config.get('accel_chip').strip()
+        self.min_freq = config.getfloat('min_freq', 10., minval=1.)
+        self.max_freq = config.getfloat('max_freq', 150.,
+                                        above=self.min_freq, maxval=1000.)
+        self.freq_step = config.getfloat('freq_step', 1., minval=.1)
+        self.window = config.getfloat('window', 10., above=0.)
+        self.auto_start = config.getboolean('auto_start', False)
+        self.num_bands = int(math.floor((self.max_freq - self.min_freq)
+                                        / self.freq_step + .5)) + 1
+        self.freqs = [self.min_freq + i * self.freq_step
+                      for i in range(self.num_bands)]
+        # Rolling band energies are tracked in C code
+        self.ffi_main, self.ffi_lib = ffi_main, ffi_lib = chelper.get_ffi()
+        self.monitor = ffi_main.gc(
+            ffi_lib.accel_monitor_alloc(self.num_bands, self.min_freq,
+                                        self.freq_step, self.window),
+            ffi_lib.accel_monitor_free)
+        self.band_power = ffi_main.new('double[]', 3 * self.num_bands)
+        self.level = ffi_main.new('double[3]')
+        self.sample_rate = ffi_main.new('double *')
+        self.chip = self.aclient = None
+        self.status_timer = None
+        self.last_sample_count = 0
+        self.status_version = 0
+        self.status = self._build_status(0, 0.)
+        # Register commands and webhooks
+        self.printer.register_event_handler("klippy:connect", self._connect)
+        self.printer.register_event_handler("klippy:ready", self._ready)
+        self.printer.register_event_handler("klippy:shutdown", self._stop)
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_command("RESONANCE_MONITOR", self.cmd_RESONANCE_MONITOR,
+                               desc=self.cmd_RESONANCE_MONITOR_help)
+        wh = self.printer.lookup_object('webhooks')
+        wh.register_endpoint("resonance_monitor/spectrum",
+                             self._handle_spectrum)
+    def _connect(self):
+        self.chip = self.printer.lookup_object(self.chip_name)
+        rate = getattr(self.chip, 'data_rate', None)
+        if rate is not None and self.max_freq >= .5 * rate:
+            raise self.printer.config_error(
+                "resonance_monitor max_freq must be less than half of the"
+                " '%s' sample rate" % (self.chip_name,))
+    def _ready(self):
+        if self.auto_start:
+            try:
+                self._start()
+            except self.printer.command_error as e:
+                logging.exception("Unable to start resonance monitor")
+    # Sample collection
+    def _handle_samples(self, samples):
+        times, x, y, z = [self.ffi_main.from_buffer('double[]', c)
+                          for c in samples.columns]
+        self.ffi_lib.accel_monitor_update(self.monitor, times, x, y, z,
+                                          len(samples))
+    def _start(self):
+        if self.aclient is not None:
+            return
+        self.aclient = self.chip.start_internal_client()
+        self.aclient.stream_samples(self._handle_samples)
+        reactor = self.printer.get_reactor()
+        self.status_timer = reactor.register_timer(
+            self._update_status, reactor.monotonic() + STATUS_INTERVAL)
+        self._set_status(self._build_status(self.last_sample_count, 0.))
+    def _stop(self):
+        if self.aclient is None:
+            return
+        self.aclient.stop_streaming()
+        self.aclient = None
+        self.printer.get_reactor().unregister_timer(self.status_timer)
+        self.status_timer = None
+        status = dict(self.status)
+        status['active'] = False
+        self._set_status(status)
+    def _reset(self):
+        self.ffi_lib.accel_monitor_reset(self.monitor)
+        self.last_sample_count = 0
+        self._set_status(self._build_status(0, 0.))
+    # Status reporting
+    def _extract(self):
+        # Returns (sample_count, per axis band powers)
+        sample_count = self.ffi_lib.accel_monitor_extract(
+            self.monitor, self.band_power, self.level, self.sample_rate)
+        num_bands = self.num_bands
+        return sample_count, [
+            self.ffi_main.unpack(self.band_power + i * num_bands, num_bands)
+            for i in range(3)]
+    def _find_peak(self, power):
+        # Refine the strongest band with a parabolic fit in log space
+        i = max(range(len(power)), key=power.__getitem__)
+        if power[i] <= 0.:
+            return 0., 0.
+        freq = self.freqs[i]
+        if 0 < i < len(power) - 1 and min(power[i-1:i+2]) > 0.:
+            l, c, r = [math.log(p) for p in power[i-1:i+2]]
+            denom = l - 2. * c + r
+            if denom < 0.:
+                freq += .5 * (l - r) / denom * self.freq_step
+        return freq, math.sqrt(2. * power[i])
+    def _build_status(self, sample_count, sample_rate, spectrum=None):
+        status = {'active': self.aclient is not None,
+                  'sample_rate': round(sample_rate, 1),
+                  'sample_count': sample_count}
+        for i, axis in enumerate(AXES):
+            if spectrum is None or not sample_count:
+                status[axis] = {'peak_freq': 0., 'peak_amplitude': 0.,
+                                'vibrations': 0.}
+                continue
+            peak_freq, peak_amp = self._find_peak(spectrum[i])
+            status[axis] = {'peak_freq': round(peak_freq, 2),
+                            'peak_amplitude': round(peak_amp, 1),
+                            'vibrations': round(math.sqrt(self.level[i]), 1)}
+        return status
+    def _set_status(self, status):
+        self.status = status
+        self.status_version += 1
+    def _update_status(self, eventtime):
+        sample_count, spectrum = self._extract()
+        if sample_count != self.last_sample_count:
+            self.last_sample_count = sample_count
+            self._set_status(self._build_status(
+                sample_count, self.sample_rate[0], spectrum))
+        return eventtime + STATUS_INTERVAL
+    def get_status_version(self):
+        return self.status_version
+    def get_status(self, eventtime):
+        return self.status
+    def _handle_spectrum(self, web_request):
+        sample_count, spectrum = self._extract()
+        res = {'freqs': self.freqs, 'active': self.aclient is not None}
+        for axis, power in zip(AXES, spectrum):
+            res[axis] = [round(math.sqrt(2. * p), 3) for p in power]
+        web_request.send(res)
+    cmd_RESONANCE_MONITOR_help = "Start, stop, or reset resonance monitoring"
+    def cmd_RESONANCE_MONITOR(self, gcmd):
+        enable = gcmd.get_int('ENABLE', None, minval=0, maxval=1)
+        if gcmd.get_int('RESET', 0, minval=0, maxval=1):
+            self._reset()
+        if enable:
+            self._start()
+        elif enable is not None:
+            self._stop()
+        status = self.status
+        if not status['active']:
+            gcmd.respond_info("Resonance monitor is not active")
+            return
+        gcmd.respond_info("\n".join([
+            "%s: peak %.1f Hz (%.1f mm/s^2), vibrations %.1f mm/s^2" % (
+                axis, status[axis]['peak_freq'],
+                status[axis]['peak_amplitude'], status[axis]['vibrations'])
+            for axis in AXES]))
+
+def load_config(config):
+    return ResonanceMonitor(config)
@@ -3,8 +3,8 @@
 # Copyright (C) 2020  Dmitry Butyugin <dmbutyugin@google.com>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, math, os, time
-from . import shaper_calibrate
+import logging, math, multiprocessing, os, time
+from . import adxl345, shaper_calibrate
 
 class TestAxis:
     def __init__(self, axis=None, vib_dir=None):
@@ -148,7 +148,7 @@ class ResonanceTester:
                 for chip_axis, chip_name in self.accel_chip_names]
 
     def _run_test(self, gcmd, axes, helper, raw_name_suffix=None,
-                  accel_chips=None, test_point=None):
+                  accel_chips=None, test_point=None, sync_name_suffix=None):
         toolhead = self.printer.lookup_object('toolhead')
         calibration_data = {axis: None for axis in axes}
 
@@ -181,6 +181,15 @@ class ResonanceTester:
                         aclient = chip.start_internal_client()
                         raw_values.append((axis, aclient, chip.name))
 
+                psds = {}
+                if (helper is not None and raw_name_suffix is None
+                        and sync_name_suffix is None):
+                    # Calculate the PSD while the test runs
+                    for chip_axis, aclient, chip_name in raw_values:
+                        psd = helper.create_psd_accumulator()
+                        aclient.stream_samples(psd.add_samples)
+                        psds[aclient] = psd
+
                 # Generate moves
                 self.test.run_test(axis, gcmd)
                 for chip_axis, aclient, chip_name in raw_values:
@@ -194,19 +203,60 @@ class ResonanceTester:
                         gcmd.respond_info(
                                 "Writing raw accelerometer data to "
                                 "%s file" % (raw_name,))
+                if sync_name_suffix is not None:
+                    sync_name = self.get_filename(
+                            'synced_data', sync_name_suffix, axis,
+                            point if len(test_points) > 1 else None)
+                    self._write_synced_data(gcmd, raw_values, sync_name)
                 if helper is None:
                     continue
                 for chip_axis, aclient, chip_name in raw_values:
-                    if not aclient.has_valid_samples():
-                        raise gcmd.error(
-                            "accelerometer '%s' measured no data" % (
-                                chip_name,))
-                    new_data = helper.process_accelerometer_data(aclient)
+                    psd = psds.get(aclient)
+                    if psd is not None:
+                        if not psd.has_valid_samples():
+                            raise gcmd.error(
+                                "accelerometer '%s' measured no data" % (
+                                    chip_name,))
+                        new_data = psd.get_calibration_data()
+                        if new_data is None:
+                            raise gcmd.error(
+                                "accelerometer '%s' measured too little data"
+                                % (chip_name,))
+                    else:
+                        if not aclient.has_valid_samples():
+                            raise gcmd.error(
+                                "accelerometer '%s' measured no data" % (
+                                    chip_name,))
+                        new_data = helper.process_accelerometer_data(aclient)
                     if calibration_data[axis] is None:
                         calibration_data[axis] = new_data
                     else:
                         calibration_data[axis].add_data(new_data)
         return calibration_data
+    def _write_synced_data(self, gcmd, raw_values, filename):
+        columns = adxl345.synchronize_samples(
+                [aclient.get_samples() for _, aclient, _ in raw_values])
+        if not columns or not columns[0]:
+            raise gcmd.error("accelerometers measured no overlapping data")
+        header = ['time'] + ['%s_%s' % (chip_name.replace(' ', '_'), a)
+                             for _, _, chip_name in raw_values for a in 'xyz']
+        def write_impl():
+            try:
+                # Try to re-nice writing process
+                os.nice(20)
+            except:
+                pass
+            f = open(filename, "w")
+            f.write("#%s\n" % (','.join(header),))
+            fmt = ','.join(['%.6f'] * len(columns)) + '\n'
+            for row in zip(*columns):
+                f.write(fmt % row)
+            f.close()
+        write_proc = multiprocessing.Process(target=write_impl)
+        write_proc.daemon = True
+        write_proc.start()
+        gcmd.respond_info("Writing synchronized accelerometer data to"
+                          " %s file" % (filename,))
     def _parse_chips(self, accel_chips):
         parsed_chips = []
         for chip_name in accel_chips.split(','):
@@ -238,9 +288,10 @@ class ResonanceTester:
 
         outputs = gcmd.get("OUTPUT", "resonances").lower().split(',')
         for output in outputs:
-            if output not in ['resonances', 'raw_data']:
-                raise gcmd.error("Unsupported output '%s', only 'resonances'"
-                                 " and 'raw_data' are supported" % (output,))
+            if output not in ['resonances', 'raw_data', 'synced_data']:
+                raise gcmd.error("Unsupported output '%s', only 'resonances',"
+                                 " 'raw_data', and 'synced_data' are"
+                                 " supported" % (output,))
         if not outputs:
             raise gcmd.error("No output specified, at least one of 'resonances'"
                              " or 'raw_data' must be set in OUTPUT parameter")
@@ -249,6 +300,7 @@ class ResonanceTester:
             raise gcmd.error("Invalid NAME parameter")
         csv_output = 'resonances' in outputs
         raw_output = 'raw_data' in outputs
+        sync_output = 'synced_data' in outputs
 
         # Setup calculation of resonances
         if csv_output:
@@ -259,7 +311,8 @@ class ResonanceTester:
         data = self._run_test(
                 gcmd, [axis], helper,
                 raw_name_suffix=name_suffix if raw_output else None,
-                accel_chips=accel_chips, test_point=test_point)[axis]
+                accel_chips=accel_chips, test_point=test_point,
+                sync_name_suffix=name_suffix if sync_output else None)[axis]
         if csv_output:
             csv_name = self.save_calibration_data('resonances', name_suffix,
                                                   helper, axis, data,
@@ -282,6 +335,7 @@ class ResonanceTester:
 
         max_smoothing = gcmd.get_float(
                 "MAX_SMOOTHING", self.max_smoothing, minval=0.05)
+        smoothers = gcmd.get_int("SMOOTHERS", 0, minval=0, maxval=1)
 
         name_suffix = gcmd.get("NAME", time.strftime("%Y%m%d_%H%M%S"))
         if not self.is_valid_name_suffix(name_suffix):
@@ -303,7 +357,8 @@ class ResonanceTester:
                     % (axis_name,))
             calibration_data[axis].normalize_to_frequencies()
             best_shaper, all_shapers = helper.find_best_shaper(
-                    calibration_data[axis], max_smoothing, gcmd.respond_info)
+                    calibration_data[axis], max_smoothing, gcmd.respond_info,
+                    smoothers)
             gcmd.respond_info(
                     "Recommended shaper_type_%s = %s, shaper_freq_%s = %.1f Hz"
                     % (axis_name, best_shaper.name,
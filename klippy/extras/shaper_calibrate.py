@@ -9,11 +9,17 @@ shaper_defs = importlib.import_module('.shaper_defs', 'extras')
 MIN_FREQ = 5.
 MAX_FREQ = 200.
 WINDOW_T_SEC = 0.5
+# Number of half windows of samples sent at once to the PSD process
+PSD_BATCH_WINDOWS = 4
 MAX_SHAPER_FREQ = 150.
 
 TEST_DAMPING_RATIOS=[0.075, 0.1, 0.15]
+# Number of pulses used to approximate the kernel of smooth shapers
+SMOOTHER_PULSES = 64
 
 AUTOTUNE_SHAPERS = ['zv', 'mzv', 'ei', '2hump_ei', '3hump_ei']
+# Smooth shapers are slow to fit, so they are only tested on request
+AUTOTUNE_SMOOTHERS = ['smooth_zv', 'smooth_ei']
 
 ######################################################################
 # Frequency response calculation and shaper auto-tuning
@@ -53,6 +59,129 @@ class CalibrationData:
         return self._psd_map[axis]
 
 
+# Incrementally calculate the PSD of accelerometer samples (using the
+# same Welch's algorithm as ShaperCalibrate._psd()) as they arrive, so
+# that only the samples of the current window need to be retained.
+# Samples are buffered and sent in batches to a background process
+# that runs the FFT of each window, so the calculations do not delay
+# the reactor.
+class PSDAccumulator:
+    def __init__(self, calibrate):
+        self.calibrate = calibrate
+        self.numpy = calibrate.numpy
+        self.pending = []
+        self.pending_count = 0
+        self.buffer = None
+        self.nfft = None
+        self.psd_sum = None
+        self.window_count = 0
+        self.sample_count = 0
+        self.first_time = self.last_time = 0.
+        self.worker = self.data_conn = None
+    def add_samples(self, samples):
+        if not samples:
+            return
+        if not self.sample_count:
+            self.first_time = samples.times[0]
+        self.last_time = samples.times[-1]
+        self.sample_count += len(samples)
+        self.pending.append(samples)
+        self.pending_count += len(samples)
+        if self.nfft is None:
+            # Wait for enough data to determine the sampling frequency
+            if self.last_time - self.first_time < 2. * WINDOW_T_SEC:
+                return
+            self.nfft = self._calc_nfft()
+        if self.pending_count >= PSD_BATCH_WINDOWS * self.nfft // 2:
+            self._flush_pending()
+    def _calc_nfft(self):
+        fs = self.sample_count / (self.last_time - self.first_time)
+        # Round up to the nearest power of 2 for faster FFT
+        return 1 << int(fs * WINDOW_T_SEC - 1).bit_length()
+    def _flush_pending(self):
+        data = [s.columns[1:4] for s in self.pending]
+        self.pending = []
+        self.pending_count = 0
+        if self.calibrate.printer is None:
+            self._process_windows(data)
+            return
+        if self.worker is None:
+            recv_conn, self.data_conn = multiprocessing.Pipe(duplex=False)
+            self.worker = self.calibrate.background_process_start(
+                self._psd_worker, (recv_conn, self.data_conn))
+            recv_conn.close()
+        self.data_conn.send(data)
+    def _psd_worker(self, recv_conn, send_conn):
+        # Runs in the background process
+        send_conn.close()
+        while 1:
+            try:
+                data = recv_conn.recv()
+            except EOFError:
+                return None
+            if data is None:
+                return self.psd_sum, self.window_count
+            self._process_windows(data)
+    def _process_windows(self, pending):
+        np = self.numpy
+        data = np.array([np.concatenate([np.frombuffer(c[i]) for c in pending])
+                         for i in range(3)])
+        if self.buffer is not None:
+            data = np.concatenate((self.buffer, data), axis=1)
+        nfft = self.nfft
+        overlap = nfft // 2
+        if data.shape[1] < nfft:
+            self.buffer = data
+            return
+        window = np.kaiser(nfft, 6.)
+        # Split each axis into overlapping windows of size nfft
+        x = np.stack([self.calibrate._split_into_windows(
+            data[i], nfft, overlap) for i in range(3)])
+        # First detrend, then apply windowing function
+        x = window[:, None] * (x - np.mean(x, axis=1, keepdims=True))
+        # Calculate frequency response for each window using FFT
+        result = np.fft.rfft(x, n=nfft, axis=1)
+        result = (np.conjugate(result) * result).real.sum(axis=-1)
+        if self.psd_sum is None:
+            self.psd_sum = result
+        else:
+            self.psd_sum += result
+        n_windows = x.shape[-1]
+        self.window_count += n_windows
+        self.buffer = data[:, n_windows * (nfft - overlap):]
+    def has_valid_samples(self):
+        return self.sample_count > 0
+    def get_calibration_data(self):
+        np = self.numpy
+        if self.sample_count < 2 or self.last_time <= self.first_time:
+            return None
+        fs = self.sample_count / (self.last_time - self.first_time)
+        if self.nfft is None:
+            self.nfft = self._calc_nfft()
+        if self.pending:
+            self._flush_pending()
+        if self.worker is not None:
+            self.data_conn.send(None)
+            self.data_conn.close()
+            self.psd_sum, self.window_count = \
+                self.calibrate.background_process_wait(self.worker)
+            self.worker = self.data_conn = None
+        if not self.window_count or self.sample_count <= self.nfft:
+            return None
+        window = np.kaiser(self.nfft, 6.)
+        # Compensation for windowing loss
+        scale = 1.0 / (window**2).sum()
+        psd = self.psd_sum * (scale / (fs * self.window_count))
+        # For one-sided FFT output the response must be doubled, except
+        # the last point for unpaired Nyquist frequency (assuming even nfft)
+        # and the 'DC' term (0 Hz)
+        psd[:,1:-1] *= 2.
+        freqs = np.fft.rfftfreq(self.nfft, 1. / fs)
+        px, py, pz = psd
+        calibration_data = CalibrationData(freqs, px+py+pz, px, py, pz)
+        calibration_data.set_numpy(np)
+        return calibration_data
+
 CalibrationResult = collections.namedtuple(
         'CalibrationResult',
         ('name', 'freq', 'vals', 'vibrs', 'smoothing', 'score', 'max_accel'))
@@ -69,9 +198,7 @@ class ShaperCalibrate:
                     "installed via `~/klippy-env/bin/pip install` (refer to "
                     "docs/Measuring_Resonances.md for more details).")
 
-    def background_process_exec(self, method, args):
-        if self.printer is None:
-            return method(*args)
+    def background_process_start(self, method, args):
         import queuelogger
         parent_conn, child_conn = multiprocessing.Pipe()
         def wrapper():
@@ -88,6 +215,10 @@ class ShaperCalibrate:
         calc_proc = multiprocessing.Process(target=wrapper)
         calc_proc.daemon = True
         calc_proc.start()
+        return calc_proc, parent_conn
+
+    def background_process_wait(self, bg_process):
+        calc_proc, parent_conn = bg_process
         # Wait for the process to finish
         reactor = self.printer.get_reactor()
         gcode = self.printer.lookup_object("gcode")
@@ -105,6 +236,12 @@ class ShaperCalibrate:
         parent_conn.close()
         return res
 
+    def background_process_exec(self, method, args):
+        if self.printer is None:
+            return method(*args)
+        return self.background_process_wait(
+            self.background_process_start(method, args))
+
     def _split_into_windows(self, x, window_size, overlap):
         # Memory-efficient algorithm to split an input 'x' into a series
         # of overlapping windows
@@ -150,15 +287,15 @@ class ShaperCalibrate:
         if raw_values is None:
             return None
         if isinstance(raw_values, np.ndarray):
-            data = raw_values
+            columns = raw_values.T
         else:
             samples = raw_values.get_samples()
             if not samples:
                 return None
-            data = np.array(samples)
+            columns = [np.frombuffer(c) for c in samples.columns]
 
-        N = data.shape[0]
-        T = data[-1,0] - data[0,0]
+        N = len(columns[0])
+        T = columns[0][-1] - columns[0][0]
         SAMPLING_FREQ = N / T
         # Round up to the nearest power of 2 for faster FFT
         M = 1 << int(SAMPLING_FREQ * WINDOW_T_SEC - 1).bit_length()
@@ -167,11 +304,14 @@ class ShaperCalibrate:
 
         # Calculate PSD (power spectral density) of vibrations per
         # frequency bins (the same bins for X, Y, and Z)
-        fx, px = self._psd(data[:,1], SAMPLING_FREQ, M)
-        fy, py = self._psd(data[:,2], SAMPLING_FREQ, M)
-        fz, pz = self._psd(data[:,3], SAMPLING_FREQ, M)
+        fx, px = self._psd(columns[1], SAMPLING_FREQ, M)
+        fy, py = self._psd(columns[2], SAMPLING_FREQ, M)
+        fz, pz = self._psd(columns[3], SAMPLING_FREQ, M)
         return CalibrationData(fx, px+py+pz, px, py, pz)
 
+    def create_psd_accumulator(self):
+        return PSDAccumulator(self)
+
     def process_accelerometer_data(self, data):
         calibration_data = self.background_process_exec(
                 self.calc_freq_response, (data,))
@@ -181,32 +321,51 @@ class ShaperCalibrate:
         calibration_data.set_numpy(self.numpy)
         return calibration_data
 
-    def _estimate_shaper(self, shaper, test_damping_ratio, test_freqs):
+    def _estimate_shapers(self, A, T, test_damping_ratio, test_freqs):
+        # Calculate the response of a set of shapers (one per row of A
+        # and T) at each of the test frequencies
         np = self.numpy
-
-        A, T = np.array(shaper[0]), np.array(shaper[1])
-        inv_D = 1. / A.sum()
+        inv_D = 1. / A.sum(axis=-1)
 
         omega = 2. * math.pi * test_freqs
         damping = test_damping_ratio * omega
         omega_d = omega * math.sqrt(1. - test_damping_ratio**2)
-        W = A * np.exp(np.outer(-damping, (T[-1] - T)))
-        S = W * np.sin(np.outer(omega_d, T))
-        C = W * np.cos(np.outer(omega_d, T))
-        return np.sqrt(S.sum(axis=1)**2 + C.sum(axis=1)**2) * inv_D
+        W = A[:,None,:] * np.exp(
+                -damping[None,:,None] * (T[:,-1:] - T)[:,None,:])
+        S = W * np.sin(omega_d[None,:,None] * T[:,None,:])
+        C = W * np.cos(omega_d[None,:,None] * T[:,None,:])
+        return np.sqrt(S.sum(axis=-1)**2 + C.sum(axis=-1)**2) * inv_D[:,None]
 
-    def _estimate_remaining_vibrations(self, shaper, test_damping_ratio,
+    def _estimate_remaining_vibrations(self, A, T, test_damping_ratio,
                                        freq_bins, psd):
-        vals = self._estimate_shaper(shaper, test_damping_ratio, freq_bins)
+        np = self.numpy
+        vals = self._estimate_shapers(A, T, test_damping_ratio, freq_bins)
         # The input shaper can only reduce the amplitude of vibrations by
         # SHAPER_VIBRATION_REDUCTION times, so all vibrations below that
         # threshold can be igonred
         vibr_threshold = psd.max() / shaper_defs.SHAPER_VIBRATION_REDUCTION
-        remaining_vibrations = self.numpy.maximum(
-                vals * psd - vibr_threshold, 0).sum()
-        all_vibrations = self.numpy.maximum(psd - vibr_threshold, 0).sum()
+        remaining_vibrations = np.maximum(
+                vals * psd - vibr_threshold, 0).sum(axis=-1)
+        all_vibrations = np.maximum(psd - vibr_threshold, 0).sum()
         return (remaining_vibrations / all_vibrations, vals)
 
+    def _get_smoother_pulses(self, smoother):
+        # Approximate a smoother kernel with a series of pulses (using
+        # Gauss-Legendre quadrature over the kernel time range)
+        np = self.numpy
+        C, t_sm = smoother
+        s, weights = np.polynomial.legendre.leggauss(SMOOTHER_PULSES)
+        A = weights * np.polynomial.polynomial.polyval(s, C)
+        T = (s + 1.) * .5 * t_sm
+        return (A, T)
+
+    def _init_shaper(self, shaper_cfg, shaper_freq):
+        shaper = shaper_cfg.init_func(shaper_freq,
+                                      shaper_defs.DEFAULT_DAMPING_RATIO)
+        if isinstance(shaper_cfg, shaper_defs.InputSmootherCfg):
+            return self._get_smoother_pulses(shaper)
+        return shaper
+
     def _get_shaper_smoothing(self, shaper, accel=5000, scv=5.):
         half_accel = accel * .5
 
@@ -230,51 +389,66 @@ class ShaperCalibrate:
     def fit_shaper(self, shaper_cfg, calibration_data, max_smoothing):
         np = self.numpy
 
-        test_freqs = np.arange(shaper_cfg.min_freq, MAX_SHAPER_FREQ, .2)
+        test_freqs = np.arange(shaper_cfg.min_freq, MAX_SHAPER_FREQ, .2)[::-1]
 
         freq_bins = calibration_data.freq_bins
         psd = calibration_data.psd_sum[freq_bins <= MAX_FREQ]
         freq_bins = freq_bins[freq_bins <= MAX_FREQ]
 
-        best_res = None
-        results = []
-        for test_freq in test_freqs[::-1]:
-            shaper_vibrations = 0.
-            shaper_vals = np.zeros(shape=freq_bins.shape)
-            shaper = shaper_cfg.init_func(
-                    test_freq, shaper_defs.DEFAULT_DAMPING_RATIO)
-            shaper_smoothing = self._get_shaper_smoothing(shaper)
-            if max_smoothing and shaper_smoothing > max_smoothing and best_res:
-                return best_res
-            # Exact damping ratio of the printer is unknown, pessimizing
-            # remaining vibrations over possible damping values
-            for dr in TEST_DAMPING_RATIOS:
-                vibrations, vals = self._estimate_remaining_vibrations(
-                        shaper, dr, freq_bins, psd)
-                shaper_vals = np.maximum(shaper_vals, vals)
-                if vibrations > shaper_vibrations:
-                    shaper_vibrations = vibrations
-            max_accel = self.find_shaper_max_accel(shaper)
-            # The score trying to minimize vibrations, but also accounting
-            # the growth of smoothing. The formula itself does not have any
-            # special meaning, it simply shows good results on real user data
-            shaper_score = shaper_smoothing * (shaper_vibrations**1.5 +
-                                               shaper_vibrations * .2 + .01)
-            results.append(
-                    CalibrationResult(
-                        name=shaper_cfg.name, freq=test_freq, vals=shaper_vals,
-                        vibrs=shaper_vibrations, smoothing=shaper_smoothing,
-                        score=shaper_score, max_accel=max_accel))
-            if best_res is None or best_res.vibrs > results[-1].vibrs:
-                # The current frequency is better for the shaper.
-                best_res = results[-1]
-        # Try to find an 'optimal' shapper configuration: the one that is not
-        # much worse than the 'best' one, but gives much less smoothing
-        selected = best_res
-        for res in results[::-1]:
-            if res.vibrs < best_res.vibrs * 1.1 and res.score < selected.score:
-                selected = res
-        return selected
+        shapers = [self._init_shaper(shaper_cfg, test_freq)
+                   for test_freq in test_freqs]
+        smoothings = [self._get_shaper_smoothing(s) for s in shapers]
+        # Frequencies are tested from highest to lowest - stop at the
+        # first one (after the highest) that smooths too much
+        count = len(shapers)
+        if max_smoothing:
+            for i in range(1, count):
+                if smoothings[i] > max_smoothing:
+                    count = i
+                    break
+        A = np.array([s[0] for s in shapers[:count]])
+        T = np.array([s[1] for s in shapers[:count]])
+        smoothings = np.array(smoothings[:count])
+
+        # Exact damping ratio of the printer is unknown, pessimizing
+        # remaining vibrations over possible damping values
+        shaper_vals = np.zeros(shape=(count, freq_bins.shape[0]))
+        shaper_vibrations = np.zeros(shape=(count,))
+        for dr in TEST_DAMPING_RATIOS:
+            vibrations, vals = self._estimate_remaining_vibrations(
+                    A, T, dr, freq_bins, psd)
+            shaper_vals = np.maximum(shaper_vals, vals)
+            shaper_vibrations = np.maximum(shaper_vibrations, vibrations)
+        # The score trying to minimize vibrations, but also accounting
+        # the growth of smoothing. The formula itself does not have any
+        # special meaning, it simply shows good results on real user data
+        shaper_scores = smoothings * (shaper_vibrations**1.5 +
+                                      shaper_vibrations * .2 + .01)
+        # The lowest vibrations found (the highest such frequency)
+        best = selected = int(np.argmin(shaper_vibrations))
+        if count == len(shapers):
+            # Try to find an 'optimal' shapper configuration: the one that
+            # is not much worse than the 'best' one, but gives much less
+            # smoothing
+            for i in range(count-1, -1, -1):
+                if (shaper_vibrations[i] < shaper_vibrations[best] * 1.1
+                        and shaper_scores[i] < shaper_scores[selected]):
+                    selected = i
+        return CalibrationResult(
+                name=shaper_cfg.name, freq=test_freqs[selected],
+                vals=shaper_vals[selected],
+                vibrs=shaper_vibrations[selected],
+                smoothing=smoothings[selected], score=shaper_scores[selected],
+                max_accel=self.find_shaper_max_accel(shapers[selected]))
+
+    def fit_shapers(self, calibration_data, max_smoothing, smoothers=False):
+        autotune = AUTOTUNE_SHAPERS
+        if smoothers:
+            autotune = AUTOTUNE_SHAPERS + AUTOTUNE_SMOOTHERS
+        return [self.fit_shaper(shaper_cfg, calibration_data, max_smoothing)
+                for shaper_cfg in (shaper_defs.INPUT_SHAPERS
+                                   + shaper_defs.INPUT_SMOOTHERS)
+                if shaper_cfg.name in autotune]
 
     def _bisect(self, func):
         left = right = 1.
@@ -300,14 +474,14 @@ class ShaperCalibrate:
             shaper, test_accel) <= TARGET_SMOOTHING)
         return max_accel
 
-    def find_best_shaper(self, calibration_data, max_smoothing, logger=None):
+    def find_best_shaper(self, calibration_data, max_smoothing, logger=None,
+                         smoothers=False):
         best_shaper = None
         all_shapers = []
-        for shaper_cfg in shaper_defs.INPUT_SHAPERS:
-            if shaper_cfg.name not in AUTOTUNE_SHAPERS:
-                continue
-            shaper = self.background_process_exec(self.fit_shaper, (
-                shaper_cfg, calibration_data, max_smoothing))
+        # Fit all shapers in a single background process
+        shapers = self.background_process_exec(self.fit_shapers, (
+            calibration_data, max_smoothing, smoothers))
+        for shaper in shapers:
             if logger is not None:
                 logger("Fitted shaper '%s' frequency = %.1f Hz "
                        "(vibrations = %.1f%%, smoothing ~= %.3f)" % (
@@ -10,6 +10,8 @@ DEFAULT_DAMPING_RATIO = 0.1
 
 InputShaperCfg = collections.namedtuple(
         'InputShaperCfg', ('name', 'init_func', 'min_freq'))
+InputSmootherCfg = collections.namedtuple(
+        'InputSmootherCfg', ('name', 'init_func', 'min_freq'))
 
 def get_none_shaper():
     return ([], [])
@@ -91,6 +93,23 @@ def get_3hump_ei_shaper(shaper_freq, damping_ratio):
     T = [0., .5*t_d, t_d, 1.5*t_d, 2.*t_d]
     return (A, T)
 
+# Smooth shapers use a polynomial kernel over the time range
+# [0, smooth_time], in terms of the normalized time s = -1..1:
+#   w(s) = (1 - s^2) * (q0 + q1*s + q2*s^2)
+# Returns the coefficients of w(s) (in increasing powers of s) and
+# smooth_time.  The kernels were optimized numerically for damping
+# ratios between 0.075 and 0.15, so the damping_ratio is not used.
+def init_smoother(q, smooth_time):
+    q0, q1, q2 = q
+    C = [q0, q1, q2 - q0, -q1, -q2]
+    return (C, smooth_time)
+
+def get_smooth_zv_shaper(shaper_freq, damping_ratio):
+    return init_smoother([0.5003, -0.2992, 1.249], 1.1 / shaper_freq)
+
+def get_smooth_ei_shaper(shaper_freq, damping_ratio):
+    return init_smoother([0.7579, -0.3883, -0.03958], 1.7 / shaper_freq)
+
 # min_freq for each shaper is chosen to have projected max_accel ~= 1500
 INPUT_SHAPERS = [
     InputShaperCfg('zv', get_zv_shaper, min_freq=21.),
@@ -100,3 +119,8 @@ INPUT_SHAPERS = [
     InputShaperCfg('2hump_ei', get_2hump_ei_shaper, min_freq=39.),
     InputShaperCfg('3hump_ei', get_3hump_ei_shaper, min_freq=48.),
 ]
+
+INPUT_SMOOTHERS = [
+    InputSmootherCfg('smooth_zv', get_smooth_zv_shaper, min_freq=24.),
+    InputSmootherCfg('smooth_ei', get_smooth_ei_shaper, min_freq=30.),
+]
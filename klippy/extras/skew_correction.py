@@ -20,7 +20,7 @@ class PrinterSkew:
     def __init__(self, config):
         self.printer = config.get_printer()
         self.name = config.get_name()
-        self.toolhead = None
+        self.transform = None
         self.xy_factor = 0.
         self.xz_factor = 0.
         self.yz_factor = 0.
@@ -28,7 +28,6 @@ class PrinterSkew:
         self._load_storage(config)
         self.printer.register_event_handler("klippy:connect",
                                             self._handle_connect)
-        self.next_transform = None
         gcode = self.printer.lookup_object('gcode')
         gcode.register_command('GET_CURRENT_SKEW', self.cmd_GET_CURRENT_SKEW,
                                desc=self.cmd_GET_CURRENT_SKEW_help)
@@ -41,7 +40,8 @@ class PrinterSkew:
                                desc=self.cmd_SKEW_PROFILE_help)
     def _handle_connect(self):
         gcode_move = self.printer.lookup_object('gcode_move')
-        self.next_transform = gcode_move.set_move_transform(self, force=True)
+        self.transform = gcode_move.add_transform_stage(force=True)
+        self._update_transform(self.xy_factor, self.xz_factor, self.yz_factor)
     def _load_storage(self, config):
         stored_profs = config.get_prefix_sections(self.name)
         # Remove primary skew_correction section, as it is not a stored profile
@@ -54,22 +54,13 @@ class PrinterSkew:
                 'xz_skew': profile.getfloat("xz_skew"),
                 'yz_skew': profile.getfloat("yz_skew"),
             }
-    def calc_skew(self, pos):
-        skewed_x = pos[0] - pos[1] * self.xy_factor \
-            - pos[2] * (self.xz_factor - (self.xy_factor * self.yz_factor))
-        skewed_y = pos[1] - pos[2] * self.yz_factor
-        return [skewed_x, skewed_y, pos[2], pos[3]]
-    def calc_unskew(self, pos):
-        skewed_x = pos[0] + pos[1] * self.xy_factor \
-            + pos[2] * self.xz_factor
-        skewed_y = pos[1] + pos[2] * self.yz_factor
-        return [skewed_x, skewed_y, pos[2], pos[3]]
-    def get_position(self):
-        return self.calc_unskew(self.next_transform.get_position())
-    def move(self, newpos, speed):
-        corrected_pos = self.calc_skew(newpos)
-        self.next_transform.move(corrected_pos, speed)
+    def _update_transform(self, xy, xz, yz):
+        self.transform.set_affine([[1., -xy, -(xz - xy * yz), 0.],
+                                   [0., 1., -yz, 0.],
+                                   [0., 0., 1., 0.]])
     def _update_skew(self, xy_factor, xz_factor, yz_factor):
+        # The transform is left unchanged if the factors are rejected
+        self._update_transform(xy_factor, xz_factor, yz_factor)
         self.xy_factor = xy_factor
         self.xz_factor = xz_factor
         self.yz_factor = yz_factor
@@ -99,7 +90,8 @@ class PrinterSkew:
             self._update_skew(0., 0., 0.)
             return
         planes = ["XY", "XZ", "YZ"]
-        for plane in planes:
+        factors = [self.xy_factor, self.xz_factor, self.yz_factor]
+        for i, plane in enumerate(planes):
             lengths = gcmd.get(plane, None)
             if lengths is not None:
                 try:
@@ -111,8 +103,8 @@ class PrinterSkew:
                     raise gcmd.error(
                         "skew_correction: improperly formatted entry for "
                         "plane [%s]\n%s" % (plane, gcmd.get_commandline()))
-                factor = plane.lower() + '_factor'
-                setattr(self, factor, calc_skew_factor(*lengths))
+                factors[i] = calc_skew_factor(*lengths)
+        self._update_skew(*factors)
     cmd_SKEW_PROFILE_help = "Profile management for skew_correction"
     def cmd_SKEW_PROFILE(self, gcmd):
         if gcmd.get('LOAD', None) is not None:
@@ -0,0 +1,165 @@
+# Verify actual mcu step times against the commanded step times
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import logging, math, threading
+
+BYTES_PER_ENTRY = 5
+TRACE_FLUSH_TIME = 0.100
+
+# Expand queue_step history into a list of step clocks
+def expand_steps(history):
+    clocks = []
+    for s in history:
+        first_clock, interval, add = s.first_clock, s.interval, s.add
+        for i in range(abs(s.step_count)):
+            clocks.append(first_clock + i * interval + add * i * (i - 1) // 2)
+    return clocks
+
+# Compare the traced steps of a stepper with the steps commanded during
+# the trace session.  Both lists are in step order, so the n-th traced
+# step is compared with the n-th commanded step.
+def compare_steps(actual, expected):
+    count = min(len(actual), len(expected))
+    res = {'count': len(actual), 'expected': len(expected),
+           'missing': max(0, len(expected) - len(actual)),
+           'extra': max(0, len(actual) - len(expected))}
+    if not count:
+        return res
+    diffs = [a - e for a, e in zip(actual, expected)]
+    avg = float(sum(diffs)) / count
+    stddev = math.sqrt(sum([(d - avg)**2 for d in diffs]) / count)
+    res.update({'avg': avg, 'stddev': stddev,
+                'max': max([abs(d) for d in diffs])})
+    return res
+
+class StepperTrace:
+    def __init__(self, config):
+        self.printer = config.get_printer()
+        self.buffer_entries = config.getint('buffer_entries', 256,
+                                            minval=10, maxval=32767)
+        self.lock = threading.Lock()
+        self.traces = {}
+        self.mcu_cmds = {}
+        self.last_sequence = {}
+        self.printer.register_event_handler("klippy:mcu_identify",
+                                            self._handle_mcu_identify)
+        gcode = self.printer.lookup_object('gcode')
+        gcode.register_command("STEPPER_TRACE", self.cmd_STEPPER_TRACE,
+                               desc=self.cmd_STEPPER_TRACE_help)
+    def _handle_mcu_identify(self):
+        # Allocate the trace buffer on each mcu that supports tracing
+        for n, mcu in self.printer.lookup_objects(module='mcu'):
+            cmd = mcu.try_lookup_command("stepper_trace oid=%c enable=%c")
+            if cmd is None:
+                continue
+            mcu.add_config_cmd("config_stepper_trace entries=%d"
+                               % (self.buffer_entries,))
+            def handle_data(params, mcu=mcu):
+                self._handle_trace_data(mcu, params)
+            mcu.register_response(handle_data, "stepper_trace_data")
+            self.mcu_cmds[mcu] = cmd
+    def _handle_trace_data(self, mcu, params):
+        d = bytearray(params['data'])
+        with self.lock:
+            # Entries dropped by the mcu (or messages lost in transit)
+            # can not be attributed to a stepper, so they are counted
+            # against all traces on the mcu
+            seq = params['sequence']
+            last_seq = self.last_sequence.get(mcu)
+            self.last_sequence[mcu] = seq
+            lost = 0
+            if last_seq is not None:
+                lost = (seq - last_seq - 1) & 0xffff
+            for (trace_mcu, oid), trace in self.traces.items():
+                if trace_mcu is mcu:
+                    trace['overflows'] += params['overflows']
+                    trace['lost_blocks'] += lost
+            for i in range(len(d) // BYTES_PER_ENTRY):
+                e = d[i*BYTES_PER_ENTRY:(i+1)*BYTES_PER_ENTRY]
+                trace = self.traces.get((mcu, e[0]))
+                if trace is None:
+                    continue
+                clock32 = e[1] | (e[2] << 8) | (e[3] << 16) | (e[4] << 24)
+                trace['clocks'].append(mcu.clock32_to_clock64(clock32))
+    def _get_history(self, mcu_stepper, start_clock, end_clock):
+        history = []
+        while 1:
+            data, count = mcu_stepper.dump_steps(128, start_clock, end_clock)
+            if not count:
+                break
+            history.extend([data[i] for i in range(count)])
+            if count < len(data):
+                break
+            end_clock = data[count-1].first_clock
+        history.sort(key=lambda s: s.first_clock)
+        return history
+    def _report(self, gcmd, mcu_stepper, trace):
+        start_clock, end_clock = trace['start_clock'], trace['end_clock']
+        history = self._get_history(mcu_stepper, start_clock, end_clock)
+        expected = [c for c in expand_steps(history)
+                    if start_clock <= c <= end_clock]
+        res = compare_steps(trace['clocks'], expected)
+        mcu = mcu_stepper.get_mcu()
+        msg = ("stepper '%s': %d steps traced, %d commanded"
+               % (mcu_stepper.get_name(), res['count'], res['expected']))
+        if res['missing'] or res['extra']:
+            msg += " (%d missing, %d extra)" % (res['missing'], res['extra'])
+        if trace['overflows'] or trace['lost_blocks']:
+            # The traced steps can no longer be matched with the
+            # commanded steps
+            msg += ("\n%d trace entries dropped and %d trace messages lost"
+                    " - increase buffer_entries or trace fewer steps"
+                    % (trace['overflows'], trace['lost_blocks']))
+        elif 'avg' in res:
+            us_per_tick = 1000000. / mcu.seconds_to_clock(1.)
+            msg += ("\nstep time error: avg=%.3fus stddev=%.3fus max=%.3fus"
+                    " (max_stepper_error=%.3fus)" % (
+                        res['avg'] * us_per_tick, res['stddev'] * us_per_tick,
+                        res['max'] * us_per_tick,
+                        mcu.get_max_stepper_error() * 1000000.))
+        logging.info(msg)
+        gcmd.respond_info(msg)
+    def _get_clock(self, mcu):
+        reactor = self.printer.get_reactor()
+        print_time = mcu.estimated_print_time(reactor.monotonic())
+        return mcu.print_time_to_clock(print_time)
+    cmd_STEPPER_TRACE_help = "Record and verify actual stepper step times"
+    def cmd_STEPPER_TRACE(self, gcmd):
+        name = gcmd.get('STEPPER')
+        enable = gcmd.get_int('ENABLE', 1, minval=0, maxval=1)
+        force_move = self.printer.lookup_object('force_move')
+        try:
+            mcu_stepper = force_move.lookup_stepper(name)
+        except self.printer.config_error as e:
+            raise gcmd.error(str(e))
+        mcu = mcu_stepper.get_mcu()
+        cmd = self.mcu_cmds.get(mcu)
+        if cmd is None:
+            raise gcmd.error("mcu '%s' firmware does not support step tracing"
+                             % (mcu.get_name(),))
+        key = (mcu, mcu_stepper.get_oid())
+        toolhead = self.printer.lookup_object('toolhead')
+        toolhead.wait_moves()
+        if enable:
+            # The toolhead is idle, so all steps after this clock are
+            # part of the trace session
+            with self.lock:
+                self.traces[key] = {'clocks': [], 'overflows': 0,
+                                    'lost_blocks': 0,
+                                    'start_clock': self._get_clock(mcu)}
+            cmd.send([mcu_stepper.get_oid(), 1])
+            return
+        if key not in self.traces:
+            raise gcmd.error("Stepper '%s' is not being traced" % (name,))
+        end_clock = self._get_clock(mcu)
+        cmd.send([mcu_stepper.get_oid(), 0])
+        # Wait for the mcu to flush any remaining trace entries
+        reactor = self.printer.get_reactor()
+        reactor.pause(reactor.monotonic() + TRACE_FLUSH_TIME)
+        with self.lock:
+            trace = self.traces.pop(key)
+        trace['end_clock'] = end_clock
+        self._report(gcmd, mcu_stepper, trace)
+
+def load_config(config):
+    return StepperTrace(config)
@@ -5,6 +5,7 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import logging, math
 import stepper
+from . import move_limits
 
 class CoreXZKinematics:
     def __init__(self, toolhead, config):
@@ -30,6 +31,8 @@ class CoreXZKinematics:
         self.max_z_accel = config.getfloat(
             'max_z_accel', max_accel, above=0., maxval=max_accel)
         self.limits = [(1.0, -1.0)] * 3
+        self.move_limits = move_limits.MoveLimits(self.max_z_velocity,
+                                                  self.max_z_accel)
         ranges = [r.get_range() for r in self.rails]
         self.axes_min = toolhead.Coord(*[r[0] for r in ranges], e=0.)
         self.axes_max = toolhead.Coord(*[r[1] for r in ranges], e=0.)
@@ -43,9 +46,11 @@ class CoreXZKinematics:
             rail.set_position(newpos)
             if i in homing_axes:
                 self.limits[i] = rail.get_range()
+        self.move_limits.set_ranges(self.limits)
     def note_z_not_homed(self):
         # Helper for Safe Z Home
         self.limits[2] = (1.0, -1.0)
+        self.move_limits.set_ranges(self.limits)
     def home(self, homing_state):
         # Each axis is homed independently and in order
         for axis in homing_state.get_axes():
@@ -64,6 +69,9 @@ class CoreXZKinematics:
             homing_state.home_rails([rail], forcepos, homepos)
     def _motor_off(self, print_time):
         self.limits = [(1.0, -1.0)] * 3
+        self.move_limits.set_ranges(self.limits)
+    def get_move_limits(self):
+        return self.move_limits.get_c_limits()
     def _check_endstops(self, move):
         end_pos = move.end_pos
         for i in (0, 1, 2):
@@ -5,6 +5,7 @@
 # This file may be distributed under the terms of the GNU GPLv3 license.
 import math, logging
 import stepper, mathutil
+from . import move_limits
 
 # Slow moves once the ratio of tower to XY movement exceeds SLOW_RATIO
 SLOW_RATIO = 3.
@@ -90,6 +91,12 @@ class DeltaKinematics:
                         math.sqrt(self.very_slow_xy2)))
         self.axes_min = toolhead.Coord(-max_xy, -max_xy, self.min_z, 0.)
         self.axes_max = toolhead.Coord(max_xy, max_xy, self.max_z, 0.)
+        self.move_limits = move_limits.MoveLimits(self.max_z_velocity,
+                                                  self.max_z_accel)
+        self.move_limits.set_delta(
+            radius, self.min_arm_length, self.limit_z, self.max_xy2,
+            self.slow_xy2, self.very_slow_xy2, self.max_velocity,
+            self.max_accel)
         self.set_position([0., 0., 0.], ())
     def get_steppers(self):
         return [s for rail in self.rails for s in rail.get_steppers()]
@@ -105,6 +112,7 @@ class DeltaKinematics:
         self.limit_xy2 = -1.
         if tuple(homing_axes) == (0, 1, 2):
             self.need_home = False
+            self._update_move_limits()
     def home(self, homing_state):
         # All axes are homed simultaneously
         homing_state.set_axes([0, 1, 2])
@@ -114,6 +122,14 @@ class DeltaKinematics:
     def _motor_off(self, print_time):
         self.limit_xy2 = -1.
         self.need_home = True
+        self._update_move_limits()
+    def _update_move_limits(self):
+        z_range = (self.min_z, self.max_z)
+        if self.need_home:
+            z_range = (1., -1.)
+        self.move_limits.set_ranges([(1., -1.), (1., -1.), z_range])
+    def get_move_limits(self):
+        return self.move_limits.get_c_limits()
     def check_move(self, move):
         end_pos = move.end_pos
         end_xy2 = end_pos[0]**2 + end_pos[1]**2
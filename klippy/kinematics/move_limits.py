@@ -0,0 +1,26 @@
+# Compiled move limit checks shared by several kinematics
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import chelper
+
+class MoveLimits:
+    def __init__(self, max_z_velocity, max_z_accel):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        self.move_limits = ffi_main.gc(ffi_lib.move_limits_alloc(),
+                                       ffi_lib.free)
+        ffi_lib.move_limits_set_z_limits(self.move_limits,
+                                         max_z_velocity, max_z_accel)
+    def set_ranges(self, limits):
+        # Update the (min, max) range of each axis (min > max if the
+        # axis is not homed)
+        ffi_main, ffi_lib = chelper.get_ffi()
+        for i, (l, h) in enumerate(limits):
+            ffi_lib.move_limits_set_range(self.move_limits, i, l, h)
+    def set_delta(self, radius, min_arm_length, limit_z, max_xy2, slow_xy2,
+                  very_slow_xy2, max_velocity, max_accel):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        ffi_lib.move_limits_set_delta(
+            self.move_limits, radius, min_arm_length, limit_z,
+            max_xy2, slow_xy2, very_slow_xy2, max_velocity, max_accel)
+    def get_c_limits(self):
+        return self.move_limits
@@ -984,7 +984,11 @@ class MCU:
     def stats(self, eventtime):
         load = "mcu_awake=%.03f mcu_task_avg=%.06f mcu_task_stddev=%.06f" % (
             self._mcu_tick_awake, self._mcu_tick_avg, self._mcu_tick_stddev)
-        stats = ' '.join([load, self._serial.stats(eventtime),
+        ffi_main, ffi_lib = chelper.get_ffi()
+        step_bytes = sum([ffi_lib.stepcompress_get_msg_bytes(sq)
+                          for sq in self._stepqueues])
+        stats = ' '.join([load, "step_bytes=%d" % (step_bytes,),
+                          self._serial.stats(eventtime),
                           self._clocksync.stats(eventtime)])
         parts = [s.split('=', 1) for s in stats.split()]
         last_stats = {k:(float(v) if '.' in v else int(v)) for k, v in parts}
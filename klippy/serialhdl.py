@@ -3,7 +3,7 @@
 # Copyright (C) 2016-2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import logging, threading, os
+import logging, threading, os, socket, stat
 import serial
 
 import msgproto, chelper, util
@@ -164,13 +164,21 @@ class SerialReader:
             if self.reactor.monotonic() > start_time + 90.:
                 self._error("Unable to connect")
             try:
-                fd = os.open(filename, os.O_RDWR | os.O_NOCTTY)
-            except OSError as e:
+                if stat.S_ISSOCK(os.stat(filename).st_mode):
+                    # Linux mcu shared memory transport
+                    serial_dev = socket.socket(socket.AF_UNIX,
+                                               socket.SOCK_STREAM)
+                    serial_dev.connect(filename)
+                    serial_fd_type = b's'
+                else:
+                    fd = os.open(filename, os.O_RDWR | os.O_NOCTTY)
+                    serial_dev = os.fdopen(fd, 'rb+', 0)
+                    serial_fd_type = b'u'
+            except (OSError, socket.error) as e:
                 logging.warn("%sUnable to open port: %s", self.warn_prefix, e)
                 self.reactor.pause(self.reactor.monotonic() + 5.)
                 continue
-            serial_dev = os.fdopen(fd, 'rb+', 0)
-            ret = self._start_session(serial_dev)
+            ret = self._start_session(serial_dev, serial_fd_type)
             if ret:
                 break
     def connect_uart(self, serialport, baud, rts=True):
@@ -20,11 +20,14 @@ MIN_BOTH_EDGE_DURATION = 0.000000200
 class MCU_stepper:
     def __init__(self, name, step_pin_params, dir_pin_params,
                  rotation_dist, steps_per_rotation,
-                 step_pulse_duration=None, units_in_radians=False):
+                 step_pulse_duration=None, units_in_radians=False,
+                 max_error=None, max_error_ratio=.5):
         self._name = name
         self._rotation_dist = rotation_dist
         self._steps_per_rotation = steps_per_rotation
         self._step_pulse_duration = step_pulse_duration
+        self._max_error = max_error
+        self._max_error_ratio = max_error_ratio
         self._units_in_radians = units_in_radians
         self._step_dist = rotation_dist / steps_per_rotation
         self._mcu = step_pin_params['chip']
@@ -98,11 +101,15 @@ class MCU_stepper:
         self._get_position_cmd = self._mcu.lookup_query_command(
             "stepper_get_position oid=%c",
             "stepper_position oid=%c pos=%i", oid=self._oid)
-        max_error = self._mcu.get_max_stepper_error()
+        max_error = self._max_error
+        if max_error is None:
+            max_error = self._mcu.get_max_stepper_error()
         max_error_ticks = self._mcu.seconds_to_clock(max_error)
         ffi_main, ffi_lib = chelper.get_ffi()
         ffi_lib.stepcompress_fill(self._stepqueue, max_error_ticks,
                                   step_cmd_tag, dir_cmd_tag)
+        ffi_lib.stepcompress_set_error_ratio(self._stepqueue,
+                                             self._max_error_ratio)
     def get_oid(self):
         return self._oid
     def get_step_dist(self):
@@ -245,9 +252,13 @@ def PrinterStepper(config, units_in_radians=False):
         config, units_in_radians, True)
     step_pulse_duration = config.getfloat('step_pulse_duration', None,
                                           minval=0., maxval=.001)
+    max_error = config.getfloat('max_stepper_error', None, minval=0.)
+    max_error_ratio = config.getfloat('max_stepper_error_ratio', .5,
+                                      above=0., maxval=.5)
     mcu_stepper = MCU_stepper(name, step_pin_params, dir_pin_params,
                               rotation_dist, steps_per_rotation,
-                              step_pulse_duration, units_in_radians)
+                              step_pulse_duration, units_in_radians,
+                              max_error, max_error_ratio)
     # Register with helper modules
     for mname in ['stepper_enable', 'force_move', 'motion_report']:
         m = printer.load_object(config, mname)
@@ -38,13 +38,15 @@ class Move:
         else:
             inv_move_d = 1. / move_d
         self.axes_r = [d * inv_move_d for d in axes_d]
+        self.start_axes_r = self.end_axes_r = self.axes_r
+        self.arc_k = 0.
         self.min_move_t = move_d / velocity
         # Junction speeds are tracked in velocity squared.  The
         # delta_v2 is the maximum amount of this squared-velocity that
         # can change in this move.
         self.max_start_v2 = 0.
         self.max_cruise_v2 = velocity**2
-        self.delta_v2 = 2.0 * move_d * self.accel
+        self.delta_v2 = 2.0 * move_d * self.accel * toolhead.accel_ratio
         self.max_smoothed_v2 = 0.
         self.smooth_delta_v2 = 2.0 * move_d * toolhead.max_accel_to_decel
     def limit_speed(self, speed, accel):
@@ -53,7 +55,8 @@ class Move:
             self.max_cruise_v2 = speed2
             self.min_move_t = self.move_d / speed
         self.accel = min(self.accel, accel)
-        self.delta_v2 = 2.0 * self.move_d * self.accel
+        accel_r = self.toolhead.accel_ratio
+        self.delta_v2 = 2.0 * self.move_d * self.accel * accel_r
         self.smooth_delta_v2 = min(self.smooth_delta_v2, self.delta_v2)
     def move_error(self, msg="Move out of range"):
         ep = self.end_pos
@@ -65,8 +68,8 @@ class Move:
         # Allow extruder to calculate its maximum junction
         extruder_v2 = self.toolhead.extruder.calc_junction(prev_move, self)
         # Find max velocity using "approximated centripetal velocity"
-        axes_r = self.axes_r
-        prev_axes_r = prev_move.axes_r
+        axes_r = self.start_axes_r
+        prev_axes_r = prev_move.end_axes_r
         junction_cos_theta = -(axes_r[0] * prev_axes_r[0]
                                + axes_r[1] * prev_axes_r[1]
                                + axes_r[2] * prev_axes_r[2])
@@ -92,7 +95,7 @@ class Move:
             , prev_move.max_smoothed_v2 + prev_move.smooth_delta_v2)
     def set_junction(self, start_v2, cruise_v2, end_v2):
         # Determine accel, cruise, and decel portions of the move distance
-        half_inv_accel = .5 / self.accel
+        half_inv_accel = .5 / (self.accel * self.toolhead.accel_ratio)
         accel_d = (cruise_v2 - start_v2) * half_inv_accel
         decel_d = (cruise_v2 - end_v2) * half_inv_accel
         cruise_d = self.move_d - accel_d - decel_d
@@ -106,84 +109,221 @@ class Move:
         self.cruise_t = cruise_d / cruise_v
         self.decel_t = decel_d / ((end_v + cruise_v) * 0.5)
 
+# Class to track a circular arc move.  The arc rotates the 'arc_a'
+# radius vector (from the arc center to the start position) towards
+# 'arc_b' (the same vector rotated 90 degrees in the direction of
+# travel) by 'angle' radians.  Any remaining travel to 'end_pos' (such
+# as helical travel) is linear.
+class ArcMove(Move):
+    def __init__(self, toolhead, start_pos, end_pos, arc_a, arc_b, angle,
+                 speed):
+        self.toolhead = toolhead
+        self.start_pos = tuple(start_pos)
+        self.end_pos = tuple(end_pos)
+        self.accel = toolhead.max_accel
+        self.junction_deviation = toolhead.junction_deviation
+        self.timing_callbacks = []
+        velocity = min(speed, toolhead.max_velocity)
+        self.is_kinematic_move = True
+        self.axes_d = axes_d = [end_pos[i] - start_pos[i] for i in (0, 1, 2, 3)]
+        self.arc_a = arc_a = tuple(arc_a)
+        self.arc_b = arc_b = tuple(arc_b)
+        radius = math.sqrt(sum([a*a for a in arc_a]))
+        # Linear travel not covered by the rotation of the arc vectors
+        ca, sa = math.cos(angle) - 1., math.sin(angle)
+        lin_d = [axes_d[i] - arc_a[i] * ca - arc_b[i] * sa for i in (0, 1, 2)]
+        self.move_d = move_d = math.sqrt(
+            (radius * angle)**2 + sum([d*d for d in lin_d]))
+        inv_move_d = 1. / move_d
+        self.axes_r = [d * inv_move_d for d in lin_d + [axes_d[3]]]
+        self.arc_k = angle * inv_move_d
+        self.radius = radius
+        self.start_axes_r = self.get_direction(0.)
+        self.end_axes_r = self.get_direction(angle)
+        self.min_move_t = move_d / velocity
+        self.max_start_v2 = 0.
+        self.max_cruise_v2 = velocity**2
+        self.delta_v2 = 2.0 * move_d * self.accel * toolhead.accel_ratio
+        self.max_smoothed_v2 = 0.
+        self.smooth_delta_v2 = 2.0 * move_d * toolhead.max_accel_to_decel
+    def get_position(self, phi):
+        # Position after rotating 'phi' radians along the arc
+        d = phi / self.arc_k
+        ca, sa = math.cos(phi) - 1., math.sin(phi)
+        return [self.start_pos[i] + self.axes_r[i] * d + self.arc_a[i] * ca
+                + self.arc_b[i] * sa for i in (0, 1, 2)] + [
+                    self.start_pos[3] + self.axes_r[3] * d]
+    def get_direction(self, phi):
+        # Unit direction of travel at 'phi' radians along the arc
+        k, c, s = self.arc_k, math.cos(phi), math.sin(phi)
+        dr = [self.axes_r[i] + k * (self.arc_b[i] * c - self.arc_a[i] * s)
+              for i in (0, 1, 2)]
+        inv_d = 1. / math.sqrt(sum([d*d for d in dr]))
+        return [d * inv_d for d in dr]
+    def limit_speed(self, speed, accel):
+        Move.limit_speed(self, speed, accel)
+        # Limit centripetal acceleration to the move acceleration
+        centripetal_v2 = self.accel / (self.arc_k**2 * self.radius)
+        if centripetal_v2 < self.max_cruise_v2:
+            self.max_cruise_v2 = centripetal_v2
+            self.min_move_t = self.move_d / math.sqrt(centripetal_v2)
+
+ARC_CHECK_ANGLE = math.pi / 8.
+
 LOOKAHEAD_FLUSH_TIME = 0.250
 
 # Class to track a list of pending move requests and to facilitate
 # "look-ahead" across moves to reduce acceleration between moves.
 class MoveQueue:
-    def __init__(self, toolhead):
+    def __init__(self, toolhead, flush_time=LOOKAHEAD_FLUSH_TIME,
+                 flush_moves=0):
         self.toolhead = toolhead
         self.queue = []
-        self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        # Cached backward pass results (one entry per queued move)
+        self.junctions = []
+        self.prev_peaks = []
+        self.queue_start = 0
+        self.flush_time = flush_time
+        self.flush_moves = flush_moves
+        self.junction_flush = flush_time
+        self.junction_moves = 0
     def reset(self):
         del self.queue[:]
-        self.junction_flush = LOOKAHEAD_FLUSH_TIME
+        del self.junctions[:]
+        del self.prev_peaks[:]
+        self.junction_flush = self.flush_time
+        self.junction_moves = 0
     def set_flush_time(self, flush_time):
         self.junction_flush = flush_time
     def get_last(self):
         if self.queue:
             return self.queue[-1]
         return None
+    def _update_junctions(self):
+        # Traverse queue from last to first move and determine maximum
+        # junction speed assuming the robot comes to a complete stop
+        # after the last move.  Appending a move only alters the
+        # results of the moves leading up to it, so stop at the first
+        # move whose cached results are unchanged.
+        queue = self.queue
+        junctions = self.junctions
+        count = len(queue)
+        updates = []
+        next_end_v2 = next_smoothed_v2 = 0.
+        next_delayed = False
+        for i in range(count-1, -1, -1):
+            move = queue[i]
+            start_v2 = min(move.max_start_v2, next_end_v2 + move.delta_v2)
+            reachable_smoothed_v2 = next_smoothed_v2 + move.smooth_delta_v2
+            smoothed_v2 = min(move.max_smoothed_v2, reachable_smoothed_v2)
+            is_delayed = is_peak = False
+            if smoothed_v2 < reachable_smoothed_v2:
+                # It's possible for this move to accelerate - it is a
+                # peak if it can decelerate or if it is a full accel
+                # move after a full decel move
+                is_peak = (smoothed_v2 + move.smooth_delta_v2
+                           > next_smoothed_v2 or next_delayed)
+            else:
+                is_delayed = True
+            junction = (start_v2, smoothed_v2, is_delayed, is_peak)
+            if i < len(junctions) and junctions[i] == junction:
+                break
+            updates.append(junction)
+            next_end_v2 = start_v2
+            next_smoothed_v2 = smoothed_v2
+            next_delayed = is_delayed
+        # Store the new results and track the closest peak to each move
+        first = count - len(updates)
+        del junctions[first:]
+        prev_peaks = self.prev_peaks
+        del prev_peaks[first:]
+        prev_peak = -1
+        if first:
+            prev_peak = prev_peaks[-1]
+        for i, junction in enumerate(reversed(updates), first):
+            if junction[3]:
+                prev_peak = self.queue_start + i
+            junctions.append(junction)
+            prev_peaks.append(prev_peak)
+    def _find_flush_count(self):
+        # Moves before the second to last peak can no longer be
+        # altered by moves that are appended later
+        prev_peaks = self.prev_peaks
+        last_peak = prev_peaks[-1] - self.queue_start
+        if last_peak <= 0:
+            return 0
+        return max(0, prev_peaks[last_peak - 1] - self.queue_start)
     def flush(self, lazy=False):
-        self.junction_flush = LOOKAHEAD_FLUSH_TIME
-        update_flush_count = lazy
+        self.junction_flush = self.flush_time
+        self.junction_moves = 0
         queue = self.queue
+        if not queue:
+            return
+        self._update_junctions()
+        junctions = self.junctions
         flush_count = len(queue)
-        # Traverse queue from last to first move and determine maximum
-        # junction speed assuming the robot comes to a complete stop
-        # after the last move.
+        if lazy:
+            flush_count = self._find_flush_count()
+            if not flush_count:
+                return
+        # Determine the final junction speeds of the moves to be
+        # flushed (the peak move that remains in the queue provides
+        # the initial peak_cruise_v2)
         delayed = []
         next_end_v2 = next_smoothed_v2 = peak_cruise_v2 = 0.
+        if flush_count < len(queue):
+            move = queue[flush_count]
+            next_end_v2, next_smoothed_v2 = junctions[flush_count][:2]
+            reachable_smoothed_v2 = move.smooth_delta_v2
+            if flush_count + 1 < len(queue):
+                reachable_smoothed_v2 += junctions[flush_count + 1][1]
+            peak_cruise_v2 = min(move.max_cruise_v2, (
+                next_smoothed_v2 + reachable_smoothed_v2) * .5)
         for i in range(flush_count-1, -1, -1):
             move = queue[i]
-            reachable_start_v2 = next_end_v2 + move.delta_v2
-            start_v2 = min(move.max_start_v2, reachable_start_v2)
-            reachable_smoothed_v2 = next_smoothed_v2 + move.smooth_delta_v2
-            smoothed_v2 = min(move.max_smoothed_v2, reachable_smoothed_v2)
-            if smoothed_v2 < reachable_smoothed_v2:
-                # It's possible for this move to accelerate
-                if (smoothed_v2 + move.smooth_delta_v2 > next_smoothed_v2
-                    or delayed):
-                    # This move can decelerate or this is a full accel
-                    # move after a full decel move
-                    if update_flush_count and peak_cruise_v2:
-                        flush_count = i
-                        update_flush_count = False
+            start_v2, smoothed_v2, is_delayed, is_peak = junctions[i]
+            if is_delayed:
+                # Delay calculating this move until peak_cruise_v2 is known
+                delayed.append((move, start_v2, next_end_v2))
+            else:
+                if is_peak:
+                    reachable_smoothed_v2 = (next_smoothed_v2
+                                             + move.smooth_delta_v2)
                     peak_cruise_v2 = min(move.max_cruise_v2, (
                         smoothed_v2 + reachable_smoothed_v2) * .5)
                     if delayed:
                         # Propagate peak_cruise_v2 to any delayed moves
-                        if not update_flush_count and i < flush_count:
-                            mc_v2 = peak_cruise_v2
-                            for m, ms_v2, me_v2 in reversed(delayed):
-                                mc_v2 = min(mc_v2, ms_v2)
-                                m.set_junction(min(ms_v2, mc_v2), mc_v2
-                                               , min(me_v2, mc_v2))
+                        mc_v2 = peak_cruise_v2
+                        for m, ms_v2, me_v2 in reversed(delayed):
+                            mc_v2 = min(mc_v2, ms_v2)
+                            m.set_junction(min(ms_v2, mc_v2), mc_v2
+                                           , min(me_v2, mc_v2))
                         del delayed[:]
-                if not update_flush_count and i < flush_count:
-                    cruise_v2 = min((start_v2 + reachable_start_v2) * .5
-                                    , move.max_cruise_v2, peak_cruise_v2)
-                    move.set_junction(min(start_v2, cruise_v2), cruise_v2
-                                      , min(next_end_v2, cruise_v2))
-            else:
-                # Delay calculating this move until peak_cruise_v2 is known
-                delayed.append((move, start_v2, next_end_v2))
+                reachable_start_v2 = next_end_v2 + move.delta_v2
+                cruise_v2 = min((start_v2 + reachable_start_v2) * .5
+                                , move.max_cruise_v2, peak_cruise_v2)
+                move.set_junction(min(start_v2, cruise_v2), cruise_v2
+                                  , min(next_end_v2, cruise_v2))
             next_end_v2 = start_v2
             next_smoothed_v2 = smoothed_v2
-        if update_flush_count or not flush_count:
-            return
         # Generate step times for all moves ready to be flushed
         self.toolhead._process_moves(queue[:flush_count])
         # Remove processed moves from the queue
         del queue[:flush_count]
+        del self.junctions[:flush_count]
+        del self.prev_peaks[:flush_count]
+        self.queue_start += flush_count
     def add_move(self, move):
         self.queue.append(move)
         if len(self.queue) == 1:
             return
         move.calc_junction(self.queue[-2])
         self.junction_flush -= move.min_move_t
-        if self.junction_flush <= 0.:
-            # Enough moves have been queued to reach the target flush time.
+        self.junction_moves += 1
+        if (self.junction_flush <= 0.
+            or self.junction_moves == self.flush_moves):
+            # Enough moves have been queued to reach the target flush
+            # time (or move count).
             self.flush(lazy=True)
 
 MIN_KIN_TIME = 0.100
@@ -206,7 +346,11 @@ class ToolHead:
         self.can_pause = True
         if self.mcu.is_fileoutput():
             self.can_pause = False
-        self.move_queue = MoveQueue(self)
+        # Look-ahead queue
+        lookahead_time = config.getfloat('lookahead_time',
+                                         LOOKAHEAD_FLUSH_TIME, above=0.)
+        lookahead_moves = config.getint('lookahead_moves', 0, minval=0)
+        self.move_queue = MoveQueue(self, lookahead_time, lookahead_moves)
         self.commanded_pos = [0., 0., 0., 0.]
         self.printer.register_event_handler("klippy:shutdown",
                                             self._handle_shutdown)
@@ -218,6 +362,15 @@ class ToolHead:
         self.max_accel_to_decel = self.requested_accel_to_decel
         self.square_corner_velocity = config.getfloat(
             'square_corner_velocity', 5., minval=0.)
+        # The peak acceleration of an S-curve velocity change is 1.5
+        # times its average acceleration, so moves are planned using
+        # 'accel_ratio' times the (peak) move acceleration
+        profiles = {'trapezoid': 'trapezoid', 'scurve': 'scurve'}
+        self.accel_profile = config.getchoice('accel_profile', profiles,
+                                              'trapezoid')
+        self.accel_ratio = 1.
+        if self.accel_profile == 'scurve':
+            self.accel_ratio = 2. / 3.
         self.junction_deviation = 0.
         self._calc_junction_deviation()
         # Print time tracking
@@ -244,7 +397,9 @@ class ToolHead:
         # Setup iterative solver
         ffi_main, ffi_lib = chelper.get_ffi()
         self.trapq = ffi_main.gc(ffi_lib.trapq_alloc(), ffi_lib.trapq_free)
+        ffi_lib.trapq_set_scurve(self.trapq, self.accel_profile == 'scurve')
         self.trapq_append = ffi_lib.trapq_append
+        self.trapq_append_arc = ffi_lib.trapq_append_arc
         self.trapq_finalize_moves = ffi_lib.trapq_finalize_moves
         self.step_generators = []
         # Create kinematics class
@@ -263,6 +418,10 @@ class ToolHead:
             msg = "Error loading kinematics '%s'" % (kin_name,)
             logging.exception(msg)
             raise config.error(msg)
+        # Compiled move limit checks (if supported by the kinematics)
+        self.move_limits = None
+        if hasattr(self.kin, "get_move_limits"):
+            self.move_limits = self.kin.get_move_limits()
         # Register commands
         gcode.register_command('G4', self.cmd_G4)
         gcode.register_command('M400', self.cmd_M400)
@@ -315,7 +474,16 @@ class ToolHead:
         # Queue moves into trapezoid motion queue (trapq)
         next_move_time = self.print_time
         for move in moves:
-            if move.is_kinematic_move:
+            if move.arc_k:
+                arc_a, arc_b = move.arc_a, move.arc_b
+                self.trapq_append_arc(
+                    self.trapq, next_move_time,
+                    move.accel_t, move.cruise_t, move.decel_t,
+                    move.start_pos[0], move.start_pos[1], move.start_pos[2],
+                    move.axes_r[0], move.axes_r[1], move.axes_r[2],
+                    arc_a[0], arc_a[1], arc_a[2], arc_b[0], arc_b[1], arc_b[2],
+                    move.arc_k, move.start_v, move.cruise_v, move.accel)
+            elif move.is_kinematic_move:
                 self.trapq_append(
                     self.trapq, next_move_time,
                     move.accel_t, move.cruise_t, move.decel_t,
@@ -426,6 +594,65 @@ class ToolHead:
         self.move_queue.add_move(move)
         if self.print_time > self.need_check_stall:
             self._check_stall()
+    def _check_chords(self, move, prev_pos, positions, speed):
+        for pos in positions:
+            chord = Move(self, prev_pos, pos, speed)
+            if not chord.is_kinematic_move:
+                continue
+            self.kin.check_move(chord)
+            if chord.axes_d[3]:
+                self.extruder.check_move(chord)
+            move.limit_speed(math.sqrt(chord.max_cruise_v2), chord.accel)
+            prev_pos = pos
+    def _check_chord_limits(self, move, positions, speed):
+        ffi_main, ffi_lib = chelper.get_ffi()
+        coords = ffi_main.new('double[]', [c for p in positions for c in p])
+        limits = ffi_main.new('double[2]',
+                              [math.sqrt(move.max_cruise_v2), move.accel])
+        chords = ffi_main.new('int[4]')
+        ret = ffi_lib.move_limits_check(
+            self.move_limits, ffi_main.new('double[4]', move.start_pos),
+            coords, len(positions), limits, chords)
+        if ret:
+            # Out of range - check each chord to report the error
+            self._check_chords(move, move.start_pos, positions, speed)
+            return
+        move.limit_speed(limits[0], limits[1])
+        # The extruder limits are highest on the chord with the
+        # greatest extrusion ratio.  Also check the last chord so the
+        # kinematics can track the final toolhead position.
+        try:
+            for start, end in sorted(set([tuple(chords[0:2]),
+                                          tuple(chords[2:4])])):
+                if end < 0:
+                    continue
+                prev_pos = move.start_pos if start < 0 else positions[start]
+                self._check_chords(move, prev_pos, [positions[end]], speed)
+        except self.printer.command_error:
+            # Report the error of the first chord that is out of range
+            self._check_chords(move, move.start_pos, positions, speed)
+            raise
+    def arc_move(self, newpos, arc_a, arc_b, angle, speed):
+        move = ArcMove(self, self.commanded_pos, newpos, arc_a, arc_b, angle,
+                       speed)
+        # Check the limits along a series of chords of the arc
+        count = int(math.ceil(angle / ARC_CHECK_ANGLE))
+        angles = [angle * (i + 1) / count for i in range(count)]
+        for a, b in zip(arc_a, arc_b):
+            # Add the positions with the most travel along each axis
+            if a or b:
+                phi = math.atan2(b, a) % math.pi
+                angles.extend([p for p in (phi, phi + math.pi) if p < angle])
+        positions = [move.end_pos if phi >= angle else move.get_position(phi)
+                     for phi in sorted(angles)]
+        if self.move_limits is None:
+            self._check_chords(move, move.start_pos, positions, speed)
+        else:
+            self._check_chord_limits(move, positions, speed)
+        self.commanded_pos[:] = move.end_pos
+        self.move_queue.add_move(move)
+        if self.print_time > self.need_check_stall:
+            self._check_stall()
     def manual_move(self, coord, speed):
         curpos = list(self.commanded_pos)
         for i in range(len(coord)):
@@ -545,11 +772,13 @@ class ToolHead:
         self.last_kin_move_time = max(self.last_kin_move_time, kin_time)
     def get_max_velocity(self):
         return self.max_velocity, self.max_accel
+    def get_accel_profile(self):
+        return self.accel_profile
     def _calc_junction_deviation(self):
         scv2 = self.square_corner_velocity**2
         self.junction_deviation = scv2 * (math.sqrt(2.) - 1.) / self.max_accel
-        self.max_accel_to_decel = min(self.requested_accel_to_decel,
-                                      self.max_accel)
+        self.max_accel_to_decel = self.accel_ratio * min(
+            self.requested_accel_to_decel, self.max_accel)
     def cmd_G4(self, gcmd):
         # Dwell
         delay = gcmd.get_float('P', 0., minval=0.) / 1000.
@@ -3,7 +3,8 @@
 # Copyright (C) 2020 Eric Callahan <arksine.code@gmail.com>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license
-import logging, socket, os, sys, errno, json, collections
+import logging, socket, os, sys, errno, json, collections, struct, array
+import itertools
 import gcode
 
 REQUEST_LOG_SIZE = 20
@@ -26,6 +27,54 @@ if sys.version_info.major < 3:
                     for k, v in data.items()}
         return data
 
+# Binary frames are sent in place of a JSON message (only to clients
+# that request them) and have the form:
+#   <0x02><header_len:u32le><body_len:u32le><json_header><body>
+# The json_header is the message with its "data" field replaced by a
+# "data_format" description of the column arrays stored in the body.
+BINARY_FRAME_START = b"\x02"
+
+# Python 2 arrays have no tobytes() method and no "q" typecode (its "l"
+# typecode is only 64bit on some hosts - doubles are used otherwise)
+INT64_TYPECODE = 'q'
+array_tobytes = lambda arr: arr.tobytes()
+if sys.version_info.major < 3:
+    INT64_TYPECODE = 'l' if array.array('l').itemsize == 8 else None
+    array_tobytes = lambda arr: arr.tostring()
+
+def _column_array(col):
+    if isinstance(col, array.array) and col.typecode == 'd':
+        return 'd', col
+    if INT64_TYPECODE is not None:
+        try:
+            return 'q', array.array(INT64_TYPECODE, col)
+        except (TypeError, OverflowError):
+            pass
+    return 'd', array.array('d', col)
+
+# Convert a list of data columns into little-endian arrays (each column
+# is a sequence of numbers or a sequence of equal length number lists)
+def encode_columns(columns):
+    count = len(columns[0]) if columns else 0
+    fmt = []
+    body = []
+    for col in columns:
+        if len(col) != count:
+            raise ValueError("Inconsistent column length in binary data")
+        width = 1
+        if count and isinstance(col[0], (tuple, list)):
+            width = len(col[0])
+            col = list(itertools.chain.from_iterable(col))
+            if len(col) != count * width:
+                raise ValueError("Inconsistent row width in binary data")
+        typecode, arr = _column_array(col)
+        if sys.byteorder != 'little':
+            arr = array.array(arr.typecode, arr)
+            arr.byteswap()
+        fmt.append([typecode, width])
+        body.append(array_tobytes(arr))
+    return {'count': count, 'columns': fmt}, b"".join(body)
+
 class WebRequestError(gcode.CommandError):
     def __init__(self, message,):
         Exception.__init__(self, message)
@@ -279,6 +328,20 @@ class ClientConnection:
         if not self.is_blocking:
             self._do_send()
 
+    def send_binary(self, data, body):
+        try:
+            jmsg = json.dumps(data, separators=(',', ':')).encode()
+        except (TypeError, ValueError) as e:
+            msg = ("json encoding error: %s" % (str(e),))
+            logging.exception(msg)
+            self.printer.invoke_shutdown(msg)
+            return
+        self.send_buffer += b"".join([
+            BINARY_FRAME_START, struct.pack("<II", len(jmsg), len(body)),
+            jmsg, body])
+        if not self.is_blocking:
+            self._do_send()
+
     def _do_send(self, eventtime=None):
         if self.fd_handle is None:
             return
@@ -451,13 +514,17 @@ class GCodeHelper:
 
 SUBSCRIPTION_REFRESH_TIME = .25
 
+# Printer objects may optionally implement a get_status_version()
+# method that returns a value which changes whenever the content of
+# get_status() changes.  Unchanged objects are then neither queried
+# nor compared against the previously reported state.
 class QueryStatusHelper:
     def __init__(self, printer):
         self.printer = printer
         self.clients = {}
         self.pending_queries = []
         self.query_timer = None
-        self.last_query = {}
+        self.status_cache = {}
         # Register webhooks
         webhooks = printer.lookup_object('webhooks')
         webhooks.register_endpoint("objects/list", self._handle_list)
@@ -467,33 +534,57 @@ class QueryStatusHelper:
         objects = [n for n, o in self.printer.lookup_objects()
                    if hasattr(o, 'get_status')]
         web_request.send({'objects': objects})
+    def _query_object(self, obj_name, query, eventtime):
+        res = query.get(obj_name)
+        if res is not None:
+            return res
+        po = self.printer.lookup_object(obj_name, None)
+        if po is None or not hasattr(po, 'get_status'):
+            res = query[obj_name] = (None, {})
+            return res
+        get_version = getattr(po, 'get_status_version', None)
+        if get_version is None:
+            res = query[obj_name] = (None, po.get_status(eventtime))
+            return res
+        version = get_version()
+        res = self.status_cache.get(obj_name)
+        if res is None or res[0] != version:
+            res = self.status_cache[obj_name] = (version,
+                                                 po.get_status(eventtime))
+        query[obj_name] = res
+        return res
     def _do_query(self, eventtime):
-        last_query = self.last_query
-        query = self.last_query = {}
+        query = {}
         msglist = self.pending_queries
         self.pending_queries = []
-        msglist.extend(self.clients.values())
-        # Generate get_status() info for each client
-        for cconn, subscription, send_func, template in msglist:
-            is_query = cconn is None
-            if not is_query and cconn.is_closed():
+        for cconn, client in list(self.clients.items()):
+            if cconn.is_closed():
                 del self.clients[cconn]
                 continue
+            if eventtime < client['next_time']:
+                continue
+            # Allow for timer jitter so that updates are not skipped
+            client['next_time'] = (eventtime + client['refresh_time']
+                                   - .5 * SUBSCRIPTION_REFRESH_TIME)
+            msglist.append((False, client['subscription'],
+                            client['send_func'], client['template'],
+                            client['last_status']))
+        # Generate get_status() info for each client
+        for is_query, subscription, send_func, template, last in msglist:
             # Query each requested printer object
             cquery = {}
+            if last is None:
+                last = {}
             for obj_name, req_items in subscription.items():
-                res = query.get(obj_name, None)
-                if res is None:
-                    po = self.printer.lookup_object(obj_name, None)
-                    if po is None or not hasattr(po, 'get_status'):
-                        res = query[obj_name] = {}
-                    else:
-                        res = query[obj_name] = po.get_status(eventtime)
+                version, res = self._query_object(obj_name, query, eventtime)
                 if req_items is None:
                     req_items = list(res.keys())
                     if req_items:
                         subscription[obj_name] = req_items
-                lres = last_query.get(obj_name, {})
+                lversion, lres = last.get(obj_name, (None, {}))
+                last[obj_name] = (version, res)
+                if version is not None and version == lversion:
+                    continue
                 cres = {}
                 for ri in req_items:
                     rd = res.get(ri, None)
@@ -506,11 +597,12 @@ class QueryStatusHelper:
                 tmp = dict(template)
                 tmp['params'] = {'eventtime': eventtime, 'status': cquery}
                 send_func(tmp)
-        if not query:
+        if not self.clients and not self.pending_queries:
             # Unregister timer if there are no longer any subscriptions
             reactor = self.printer.get_reactor()
             reactor.unregister_timer(self.query_timer)
             self.query_timer = None
+            self.status_cache.clear()
             return reactor.NEVER
         return eventtime + SUBSCRIPTION_REFRESH_TIME
     def _handle_query(self, web_request, is_subscribe=False):
@@ -523,14 +615,22 @@ class QueryStatusHelper:
                 for ri in v:
                     if type(ri) != str:
                         raise web_request.error("Invalid argument")
+        refresh_time = SUBSCRIPTION_REFRESH_TIME
+        if is_subscribe:
+            refresh_time = web_request.get_float('refresh_time', refresh_time)
+            refresh_time = max(refresh_time, SUBSCRIPTION_REFRESH_TIME)
         # Add to pending queries
         cconn = web_request.get_client_connection()
         template = web_request.get_dict('response_template', {})
         if is_subscribe and cconn in self.clients:
             del self.clients[cconn]
+        last_status = None
+        if is_subscribe:
+            last_status = {}
         reactor = self.printer.get_reactor()
         complete = reactor.completion()
-        self.pending_queries.append((None, objects, complete.complete, {}))
+        self.pending_queries.append((True, objects, complete.complete, {},
+                                     last_status))
         # Start timer if needed
         if self.query_timer is None:
             qt = reactor.register_timer(self._do_query, reactor.NOW)
@@ -539,7 +639,13 @@ class QueryStatusHelper:
         msg = complete.wait()
         web_request.send(msg['params'])
         if is_subscribe:
-            self.clients[cconn] = (cconn, objects, cconn.send, template)
+            eventtime = msg['params']['eventtime']
+            self.clients[cconn] = {
+                'subscription': objects, 'send_func': cconn.send,
+                'template': template, 'last_status': last_status,
+                'refresh_time': refresh_time,
+                'next_time': (eventtime + refresh_time
+                              - .5 * SUBSCRIPTION_REFRESH_TIME)}
     def _handle_subscribe(self, web_request):
         self._handle_query(web_request, is_subscribe=True)
 
@@ -58,6 +58,9 @@ for TARGET in test/configs/*.config ; do
     size out/*.elf
     finish_test mcu_compile "$TARGET"
     cp out/klipper.dict ${DICTDIR}/$(basename ${TARGET} .config).dict
+    if [ "$(basename ${TARGET})" = "linuxprocess.config" ]; then
+        cp out/klipper.elf ${BUILD_DIR}/linuxprocess.elf
+    fi
 done
 
 
@@ -80,3 +83,15 @@ finish_test klippy "Test invoke klippy (Python3)"
 start_test klippy "Test invoke klippy (Python2)"
 $PYTHON2 scripts/test_klippy.py -d ${DICTDIR} test/klippy/*.test
 finish_test klippy "Test invoke klippy (Python2)"
+
+start_test klippy "Test stepper_trace analyzer (Python3)"
+$PYTHON scripts/test_stepper_trace.py
+finish_test klippy "Test stepper_trace analyzer (Python3)"
+
+start_test klippy "Test status subscriptions (Python3)"
+$PYTHON scripts/test_status_subscription.py
+finish_test klippy "Test status subscriptions (Python3)"
+
+start_test klippy "Test linux mcu shared memory transport (Python3)"
+$PYTHON scripts/test_shm_transport.py ${BUILD_DIR}/linuxprocess.elf
+finish_test klippy "Test linux mcu shared memory transport (Python3)"
@@ -14,7 +14,7 @@ TASK_MAX=0.0025
 
 APPLY_PREFIX = [
     'mcu_awake', 'mcu_task_avg', 'mcu_task_stddev', 'bytes_write',
-    'bytes_read', 'bytes_retransmit', 'freq', 'adj',
+    'bytes_read', 'bytes_retransmit', 'step_bytes', 'freq', 'adj',
     'target', 'temp', 'pwm'
 ]
 
@@ -89,9 +89,11 @@ def plot_mcu(data, maxbw):
     # Generate data for plot
     basetime = lasttime = data[0]['#sampletime']
     lastbw = float(data[0]['bytes_write']) + float(data[0]['bytes_retransmit'])
+    laststepbw = float(data[0].get('step_bytes', 0.))
     sample_resets = find_print_restarts(data)
     times = []
     bwdeltas = []
+    stepbwdeltas = []
     loads = []
     awake = []
     hostbuffers = []
@@ -101,8 +103,10 @@ def plot_mcu(data, maxbw):
         if timedelta <= 0.:
             continue
         bw = float(d['bytes_write']) + float(d['bytes_retransmit'])
-        if bw < lastbw:
+        stepbw = float(d.get('step_bytes', 0.))
+        if bw < lastbw or stepbw < laststepbw:
             lastbw = bw
+            laststepbw = stepbw
             continue
         load = float(d['mcu_task_avg']) + 3*float(d['mcu_task_stddev'])
         if st - basetime < 15.:
@@ -116,10 +120,12 @@ def plot_mcu(data, maxbw):
         hostbuffers.append(hb)
         times.append(datetime.datetime.utcfromtimestamp(st))
         bwdeltas.append(100. * (bw - lastbw) / (maxbw * timedelta))
+        stepbwdeltas.append(100. * (stepbw - laststepbw) / (maxbw * timedelta))
         loads.append(100. * load / TASK_MAX)
         awake.append(100. * float(d.get('mcu_awake', 0.)) / STATS_INTERVAL)
         lasttime = st
         lastbw = bw
+        laststepbw = stepbw
 
     # Build plot
     fig, ax1 = matplotlib.pyplot.subplots()
@@ -127,6 +133,7 @@ def plot_mcu(data, maxbw):
     ax1.set_xlabel('Time')
     ax1.set_ylabel('Usage (%)')
     ax1.plot_date(times, bwdeltas, 'g', label='Bandwidth', alpha=0.8)
+    ax1.plot_date(times, stepbwdeltas, 'b', label='Step bandwidth', alpha=0.6)
     ax1.plot_date(times, loads, 'r', label='MCU load', alpha=0.8)
     ax1.plot_date(times, hostbuffers, 'c', label='Host buffer', alpha=0.8)
     ax1.plot_date(times, awake, 'y', label='Awake time', alpha=0.6)
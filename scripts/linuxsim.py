@@ -0,0 +1,381 @@
+#!/usr/bin/env python3
+# Run the linux mcu code with a host controlled (simulated) clock
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, optparse, time, mmap, signal, struct, subprocess, select
+
+# Layout of 'struct simclock_s' in src/linux/timer.c
+SIMCLOCK_FMT = "=QIIQQIIiHHH"
+SIMCLOCK_FIELDS = ("limit_ns", "grant_seq", "ack_seq", "time_ns",
+                   "next_wake_ns", "timer_events", "max_lateness",
+                   "min_margin", "move_used", "max_move_used", "move_count")
+NSECS = 1000000000
+LINUX_CLOCK_FREQ = 50000000
+
+MESSAGE_MIN = 5
+MESSAGE_MAX = 64
+MESSAGE_DEST = 0x10
+MESSAGE_SEQ_MASK = 0x0f
+MESSAGE_SYNC = 0x7e
+# Free move queue entries required before sending another message block
+MOVE_RESERVE = 16
+# Size of the mcu step trace buffer (when step output is requested)
+TRACE_ENTRIES = 1024
+
+def import_msgproto():
+    global msgproto
+    # Load msgproto.py module
+    kdir = os.path.join(os.path.dirname(__file__), '..', 'klippy')
+    sys.path.append(kdir)
+    import msgproto
+
+
+######################################################################
+# Simulated clock
+######################################################################
+
+# The mcu clock only advances when the harness grants it more time.
+# The mcu then runs each of its timers at exactly the scheduled time
+# (up to the granted limit) and acknowledges the grant once it is
+# idle.  Simulated time does not progress while the mcu code runs,
+# so the results do not depend on host cpu load or scheduling.
+class SimClock:
+    def __init__(self, clockfile, rate, quantum):
+        self.rate = rate
+        self.quantum = int(quantum * NSECS)
+        self.fd = os.open(clockfile, os.O_RDWR | os.O_CREAT | os.O_TRUNC)
+        os.write(self.fd, b'\0' * mmap.PAGESIZE)
+        self.mm = mmap.mmap(self.fd, mmap.PAGESIZE)
+        self.proc = None
+        # The mcu acknowledges this initial grant (without a SIGALRM)
+        # once it has started up
+        self.grant_seq = 1
+        self.limit = 0
+        struct.pack_into("=QI", self.mm, 0, self.limit, self.grant_seq)
+        self.start_time = time.time()
+        self.max_lag = 0.
+    def start(self, proc):
+        self.proc = proc
+        self.start_time = time.time()
+    def get_status(self):
+        res = struct.unpack_from(SIMCLOCK_FMT, self.mm, 0)
+        return dict(zip(SIMCLOCK_FIELDS, res))
+    def is_acked(self):
+        return self.get_status()['ack_seq'] == self.grant_seq
+    def grant(self, limit):
+        # Allow the mcu to advance its clock up to 'limit'
+        self.limit = limit
+        self.grant_seq = (self.grant_seq + 1) & 0xffffffff
+        struct.pack_into("=QI", self.mm, 0, limit, self.grant_seq)
+        self.proc.send_signal(signal.SIGALRM)
+    def wait_ack(self, idle_cb=None):
+        while not self.is_acked():
+            if self.proc.poll() is not None:
+                raise OSError("mcu process exited")
+            if idle_cb is not None:
+                idle_cb(0.000050)
+            else:
+                time.sleep(0.000010)
+    def next_limit(self):
+        target = self.limit + self.quantum
+        if not self.rate:
+            return target
+        # Real-time pacing (needed when klippy is connected directly)
+        while 1:
+            real = int((time.time() - self.start_time) * self.rate * NSECS)
+            self.max_lag = max(self.max_lag, (real - self.limit) / NSECS)
+            if real > self.limit:
+                return min(real, target)
+            time.sleep(0.000050)
+    def stats(self):
+        st = self.get_status()
+        us_per_tick = 1000000. / LINUX_CLOCK_FREQ
+        margin = "none"
+        if st['min_margin'] != 0x7fffffff:
+            margin = "%.3fus" % (st['min_margin'] * us_per_tick,)
+        out = ["simulated_time=%.6f timer_events=%d"
+               " max_timer_lateness=%.3fus min_timer_margin=%s"
+               " max_move_queue=%d/%d" % (
+                   st['time_ns'] / float(NSECS), st['timer_events'],
+                   st['max_lateness'] * us_per_tick, margin,
+                   st['max_move_used'], st['move_count'])]
+        if self.rate:
+            out.append("max_lag=%.6f" % (self.max_lag,))
+        return " ".join(out)
+
+
+######################################################################
+# Replay of a klippy message stream
+######################################################################
+
+# Split a raw message stream (as produced by "klippy.py -o") into blocks
+def split_blocks(data):
+    blocks = []
+    pos = 0
+    while pos + MESSAGE_MIN <= len(data):
+        msglen = data[pos]
+        if (msglen < MESSAGE_MIN or pos + msglen > len(data)
+            or data[pos + msglen - 1] != MESSAGE_SYNC):
+            raise ValueError("Invalid message block at offset %d" % (pos,))
+        blocks.append(bytearray(data[pos:pos + msglen]))
+        pos += msglen
+    return blocks
+
+# Feed recorded klippy commands to the mcu and collect its responses.
+# Blocks are only sent between clock grants and only while the mcu has
+# free move queue entries, so a given input always produces the same
+# mcu behavior.  When a step output file is requested, step tracing is
+# enabled on every stepper once the mcu config is finalized.
+class Replay:
+    def __init__(self, port, blocks, msgparser, stepfile):
+        self.blocks = blocks
+        self.pos = 0
+        self.send_seq = 0
+        self.ack_seq = None
+        self.msgparser = msgparser
+        self.stepfile = stepfile
+        self.stepper_oids = []
+        self.trace_configured = False
+        self.step_count = self.trace_overflows = 0
+        self.shutdown_reason = None
+        self.data = bytearray()
+        self.fd = self._open(port)
+    def _open(self, port):
+        for i in range(500):
+            try:
+                return os.open(port, os.O_RDWR | os.O_NOCTTY | os.O_NONBLOCK)
+            except OSError:
+                time.sleep(0.010)
+        raise OSError("Unable to open mcu port %s" % (port,))
+    def is_done(self):
+        return self.pos >= len(self.blocks)
+    def can_send(self, status):
+        if self.is_done():
+            return False
+        count = status['move_count']
+        return not count or count - status['move_used'] >= MOVE_RESERVE
+    def send_next(self, sc):
+        block = self.blocks[self.pos]
+        self.pos += 1
+        if self.stepfile is None:
+            self._send_block(sc, block)
+            return
+        names = []
+        for params in self._parse_block(block):
+            names.append(params['#name'])
+            if params['#name'] == 'config_stepper':
+                self.stepper_oids.append(params['oid'])
+        if ('finalize_config' in names
+            and 'config_stepper_trace' not in names
+            and not self.trace_configured):
+            # The trace buffer must be allocated before the config is
+            # finalized
+            self._send_command(sc, "config_stepper_trace entries=%hu",
+                               [TRACE_ENTRIES])
+        if 'config_stepper_trace' in names:
+            self.trace_configured = True
+        self._send_block(sc, block)
+        if 'finalize_config' in names:
+            self.set_trace(sc, 1)
+    def set_trace(self, sc, enable):
+        for oid in self.stepper_oids:
+            self._send_command(sc, "stepper_trace oid=%c enable=%c",
+                               [oid, enable])
+    def _send_command(self, sc, msgformat, params):
+        try:
+            cmd = self.msgparser.lookup_command(msgformat)
+        except msgproto.error:
+            raise OSError("mcu firmware does not support step tracing")
+        data = cmd.encode(params)
+        block = bytearray([MESSAGE_MIN + len(data), MESSAGE_DEST] + data
+                          + [0, 0, MESSAGE_SYNC])
+        self._send_block(sc, block)
+    def finish(self, sc):
+        if self.stepfile is not None and self.shutdown_reason is None:
+            # Flush any pending step trace entries
+            self.set_trace(sc, 0)
+        sc.grant(sc.limit)
+        sc.wait_ack(self.process_output)
+        while self.process_output(0.050):
+            pass
+    def _send_block(self, sc, block):
+        # Renumber the block to match the mcu sequence
+        msglen = len(block)
+        block[1] = (self.send_seq & MESSAGE_SEQ_MASK) | MESSAGE_DEST
+        block[msglen-3:msglen-1] = msgproto.crc16_ccitt(block[:msglen-3])
+        self.send_seq += 1
+        os.write(self.fd, block)
+        # Wait for the mcu to process the block (mcu time is not
+        # advanced until the acknowledgment arrives)
+        want_seq = (self.send_seq & MESSAGE_SEQ_MASK) | MESSAGE_DEST
+        while self.ack_seq != want_seq:
+            if sc.proc.poll() is not None:
+                raise OSError("mcu process exited")
+            self.process_output(0.001)
+    def process_output(self, timeout):
+        res = select.select([self.fd], [], [], timeout)
+        if not res[0]:
+            return False
+        try:
+            self.data += os.read(self.fd, 4096)
+        except OSError:
+            return False
+        while len(self.data) >= MESSAGE_MIN:
+            msglen = self.data[0]
+            if MESSAGE_MIN <= msglen <= MESSAGE_MAX and msglen > len(self.data):
+                break
+            if (msglen < MESSAGE_MIN or msglen > MESSAGE_MAX
+                or self.data[msglen-1] != MESSAGE_SYNC):
+                # Discard data up to the next sync byte
+                syncpos = self.data.find(MESSAGE_SYNC)
+                del self.data[:syncpos + 1 if syncpos >= 0 else None]
+                continue
+            block = self.data[:msglen]
+            del self.data[:msglen]
+            self.ack_seq = block[1]
+            if self.msgparser is not None and msglen > MESSAGE_MIN:
+                self._handle_block(block)
+        return True
+    def _parse_block(self, block):
+        mp = self.msgparser
+        msgs = []
+        pos = 2
+        while pos < len(block) - 3:
+            mid = mp.messages_by_id.get(block[pos], mp.unknown)
+            params, pos = mid.parse(block, pos)
+            params['#name'] = mid.name
+            msgs.append(params)
+        return msgs
+    def _handle_block(self, block):
+        for params in self._parse_block(block):
+            if params['#name'] == 'stepper_trace_data':
+                self._handle_trace(params)
+            elif params['#name'] in ('shutdown', 'is_shutdown'):
+                self.shutdown_reason = params.get('static_string_id')
+    def _handle_trace(self, params):
+        d = bytearray(params['data'])
+        # Each message reports the entries dropped since the last one
+        self.trace_overflows += params['overflows']
+        for i in range(0, len(d) - 4, 5):
+            clock = d[i+1] | (d[i+2] << 8) | (d[i+3] << 16) | (d[i+4] << 24)
+            self.step_count += 1
+            if self.stepfile is not None:
+                self.stepfile.write("%d %d\n" % (d[i], clock))
+    def stats(self):
+        out = ["blocks_sent=%d" % (self.pos,)]
+        if self.msgparser is not None:
+            out.append("steps_traced=%d trace_overflows=%d" % (
+                self.step_count, self.trace_overflows))
+        if self.shutdown_reason is not None:
+            out.append("shutdown=%s" % (repr(self.shutdown_reason),))
+        return " ".join(out)
+
+
+######################################################################
+# Startup
+######################################################################
+
+def run_replay(sc, replay, max_time, settle_time):
+    end_time = max_time
+    while sc.limit < end_time:
+        sc.wait_ack(replay.process_output)
+        while replay.can_send(sc.get_status()):
+            replay.send_next(sc)
+            # Synchronize with the mcu so that its move queue status
+            # reflects the block just sent
+            sc.grant(sc.limit)
+            sc.wait_ack(replay.process_output)
+        if replay.shutdown_reason is not None:
+            break
+        if (end_time == max_time and replay.is_done()
+            and not sc.get_status()['move_used']):
+            # All moves loaded - run the final moves to completion
+            end_time = min(max_time, sc.limit + settle_time)
+        sc.grant(sc.next_limit())
+    sc.wait_ack(replay.process_output)
+    replay.finish(sc)
+
+def run_free(sc, max_time):
+    while sc.limit < max_time:
+        sc.wait_ack()
+        sc.grant(sc.next_limit())
+
+def main():
+    usage = "%prog [options] <klipper.elf>"
+    opts = optparse.OptionParser(usage)
+    opts.add_option("-r", "--rate", type="float", dest="pacing_rate",
+                    default=0., help="pace simulated time to real time"
+                    " at the given rate (eg, 1.0 when klippy is connected)")
+    opts.add_option("-q", "--quantum", type="float", dest="quantum",
+                    default=0.001, help="max simulated time per clock grant")
+    opts.add_option("-t", "--time", type="float", dest="max_time",
+                    default=0., help="stop after the given simulated time")
+    opts.add_option("-s", "--settle", type="float", dest="settle_time",
+                    default=2., help="simulated time to run after the"
+                    " replayed moves are loaded")
+    opts.add_option("-c", "--clockfile", type="string", dest="clockfile",
+                    default="/tmp/klipper_simclock",
+                    help="shared file holding the simulated clock")
+    opts.add_option("-I", "--port", type="string", dest="port",
+                    default="/tmp/klipper_host_mcu",
+                    help="pseudo-tty device for the mcu to create")
+    opts.add_option("-i", "--input", type="string", dest="input",
+                    help="replay a message stream recorded with klippy -o")
+    opts.add_option("-d", "--dictionary", type="string", dest="dictfile",
+                    help="mcu data dictionary (to decode mcu responses)")
+    opts.add_option("-o", "--output", type="string", dest="stepfile",
+                    help="write traced step times to the given file")
+    options, args = opts.parse_args()
+    if len(args) != 1:
+        opts.error("Incorrect number of arguments")
+    if options.stepfile and not options.dictfile:
+        opts.error("Step output requires a data dictionary (-d)")
+    max_time = float("inf")
+    if options.max_time:
+        max_time = int(options.max_time * NSECS)
+    elif not options.input and not options.pacing_rate:
+        opts.error("Must specify an input file, a pacing rate, or a time")
+    import_msgproto()
+    msgparser = stepfile = None
+    if options.dictfile:
+        msgparser = msgproto.MessageParser()
+        f = open(options.dictfile, 'rb')
+        msgparser.process_identify(f.read(), decompress=False)
+        f.close()
+    if options.stepfile:
+        stepfile = open(options.stepfile, 'w')
+    blocks = None
+    if options.input:
+        f = open(options.input, 'rb')
+        blocks = split_blocks(bytearray(f.read()))
+        f.close()
+    sc = SimClock(options.clockfile, options.pacing_rate, options.quantum)
+    proc = subprocess.Popen([args[0], "-I", options.port,
+                             "-c", options.clockfile])
+    sc.start(proc)
+    sys.stdout.write("Starting linux mcu simulation: port=%s rate=%.3f\n" % (
+        options.port, options.pacing_rate))
+    sys.stdout.flush()
+    replay = None
+    try:
+        if blocks is not None:
+            replay = Replay(options.port, blocks, msgparser, stepfile)
+            run_replay(sc, replay, max_time,
+                       int(options.settle_time * NSECS))
+        else:
+            run_free(sc, max_time)
+    except KeyboardInterrupt:
+        pass
+    finally:
+        proc.terminate()
+        proc.wait()
+        stats = sc.stats()
+        if replay is not None:
+            stats += " " + replay.stats()
+        sys.stdout.write(stats + "\n")
+        if stepfile is not None:
+            stepfile.close()
+        os.unlink(options.clockfile)
+
+if __name__ == '__main__':
+    main()
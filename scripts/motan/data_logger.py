@@ -4,9 +4,12 @@
 # Copyright (C) 2020-2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import sys, os, optparse, socket, select, json, errno, time, zlib
+import sys, os, optparse, socket, select, json, errno, time, zlib, struct
+import readlog
 
 INDEX_UPDATE_TIME = 5.0
+BINARY_FRAME_START = b"\x02"
+FRAME_LENGTHS = struct.Struct("<II")
 ClientInfo = {'program': 'motan_data_logger', 'version': 'v0.1'}
 
 def webhook_socket_create(uds_filename):
@@ -34,7 +37,7 @@ class LogWriter:
         self.comp = zlib.compressobj(zlib.Z_DEFAULT_COMPRESSION,
                                      zlib.DEFLATED, 31)
         self.raw_pos = self.file_pos = 0
-    def add_data(self, data):
+    def add_data(self, data, qid=""):
         d = self.comp.compress(data + b"\x03")
         self.file.write(d)
         self.file_pos += len(d)
@@ -52,16 +55,56 @@ class LogWriter:
         self.file = None
         self.comp = None
 
+# Write messages to an uncompressed columnar file (see readlog.py)
+class BinaryLogWriter:
+    def __init__(self, filename):
+        self.file = open(filename, "wb")
+        self.file.write(readlog.BINARY_MAGIC)
+        self.file.write(readlog.BINARY_INDEX_POS.pack(0))
+        self.file_pos = readlog.BINARY_DATA_START
+        # Location of the next index block position to fill in
+        self.index_link_pos = len(readlog.BINARY_MAGIC)
+    def _add_record(self, rtype, qid, header, body):
+        qid = qid.encode()
+        rhdr = readlog.BINARY_RECORD.pack(rtype, len(qid), len(header),
+                                          len(body))
+        self.file.write(rhdr + qid + header)
+        self.file.write(body)
+        self.file_pos += len(rhdr) + len(qid) + len(header) + len(body)
+    def add_data(self, data, qid=""):
+        self._add_record(b'J', qid, data, b"")
+    def add_frame(self, header, body, qid=""):
+        self._add_record(b'D', qid, header, body)
+    def add_index(self, data):
+        # Link the previous index block (or the file header) to this one
+        index_pos = self.file_pos
+        self.file.seek(self.index_link_pos)
+        self.file.write(readlog.BINARY_INDEX_POS.pack(index_pos))
+        self.file.seek(index_pos)
+        self._add_record(b'I', "", data, readlog.BINARY_INDEX_POS.pack(0))
+        self.index_link_pos = self.file_pos - readlog.BINARY_INDEX_POS.size
+    def flush(self):
+        self.file.flush()
+        return self.file_pos
+    def close(self):
+        self.file.close()
+        self.file = None
+
 class DataLogger:
-    def __init__(self, uds_filename, log_prefix):
+    def __init__(self, uds_filename, log_prefix, binary=False):
         # IO
         self.webhook_socket = webhook_socket_create(uds_filename)
         self.poll = select.poll()
         self.poll.register(self.webhook_socket, select.POLLIN | select.POLLHUP)
         self.socket_data = b""
         # Data log
-        self.logger = LogWriter(log_prefix + ".json.gz")
-        self.index = LogWriter(log_prefix + ".index.gz")
+        self.binary = binary
+        if binary:
+            # The index is stored in the data file
+            self.logger = self.index = BinaryLogWriter(log_prefix + ".bin")
+        else:
+            self.logger = LogWriter(log_prefix + ".json.gz")
+            self.index = LogWriter(log_prefix + ".index.gz")
         # Handlers
         self.query_handlers = {}
         self.async_handlers = {}
@@ -76,7 +119,8 @@ class DataLogger:
     def finish(self, msg):
         self.error(msg)
         self.logger.close()
-        self.index.close()
+        if self.index is not self.logger:
+            self.index.close()
         sys.exit(0)
     # Unix Domain Socket IO
     def send_query(self, msg_id, method, params, cb):
@@ -85,34 +129,59 @@ class DataLogger:
         cm = json.dumps(msg, separators=(',', ':')).encode()
         self.webhook_socket.send(cm + b"\x03")
     def process_socket(self):
-        data = self.webhook_socket.recv(4096)
+        data = self.webhook_socket.recv(65536)
         if not data:
             self.finish("Socket closed")
-        parts = data.split(b"\x03")
-        parts[0] = self.socket_data + parts[0]
-        self.socket_data = parts.pop()
-        for part in parts:
-            try:
-                msg = json.loads(part)
-            except:
-                self.error("ERROR: Unable to parse line")
-                continue
-            self.logger.add_data(part)
-            msg_q = msg.get("q")
-            if msg_q is not None:
-                hdl = self.async_handlers.get(msg_q)
-                if hdl is not None:
-                    hdl(msg, part)
+        sdata = self.socket_data + data
+        pos = 0
+        while pos < len(sdata):
+            if sdata[pos:pos+1] == BINARY_FRAME_START:
+                # Binary frame (only sent when requested)
+                hpos = pos + 1 + FRAME_LENGTHS.size
+                if hpos > len(sdata):
+                    break
+                hlen, blen = FRAME_LENGTHS.unpack_from(sdata, pos + 1)
+                if hpos + hlen + blen > len(sdata):
+                    break
+                self.process_frame(sdata[hpos:hpos+hlen],
+                                   sdata[hpos+hlen:hpos+hlen+blen])
+                pos = hpos + hlen + blen
                 continue
-            msg_id = msg.get("id")
-            hdl = self.query_handlers.get(msg_id)
+            end = sdata.find(b"\x03", pos)
+            if end < 0:
+                break
+            self.process_msg(sdata[pos:end])
+            pos = end + 1
+        self.socket_data = sdata[pos:]
+    def process_frame(self, header, body):
+        try:
+            msg = json.loads(header)
+        except:
+            self.error("ERROR: Unable to parse binary frame")
+            return
+        self.logger.add_frame(header, body, msg.get("q", ""))
+    def process_msg(self, part):
+        try:
+            msg = json.loads(part)
+        except:
+            self.error("ERROR: Unable to parse line")
+            return
+        msg_q = msg.get("q")
+        self.logger.add_data(part, msg_q or "")
+        if msg_q is not None:
+            hdl = self.async_handlers.get(msg_q)
             if hdl is not None:
-                del self.query_handlers[msg_id]
                 hdl(msg, part)
-                if not self.query_handlers:
-                    self.flush_index()
-                continue
-            self.error("ERROR: Message with unknown id")
+            return
+        msg_id = msg.get("id")
+        hdl = self.query_handlers.get(msg_id)
+        if hdl is not None:
+            del self.query_handlers[msg_id]
+            hdl(msg, part)
+            if not self.query_handlers:
+                self.flush_index()
+            return
+        self.error("ERROR: Message with unknown id")
     def run(self):
         try:
             while 1:
@@ -128,6 +197,8 @@ class DataLogger:
             cb = self.handle_dump
         if async_cb is not None:
             self.async_handlers[msg_id] = async_cb
+        elif self.binary:
+            params["binary_frames"] = True
         params["response_template"] = {"q": msg_id}
         self.send_query(msg_id, method, params, cb)
     def handle_info(self, msg, raw_msg):
@@ -169,8 +240,14 @@ class DataLogger:
             return
         self.db.setdefault("subscriptions", {})[msg_id] = msg["result"]
     def flush_index(self):
-        self.db['file_position'] = self.logger.flush()
-        self.index.add_data(json.dumps(self.db, separators=(',', ':')).encode())
+        if self.binary:
+            self.logger.add_index(json.dumps(
+                self.db, separators=(',', ':')).encode())
+            self.logger.flush()
+        else:
+            self.db['file_position'] = self.logger.flush()
+            self.index.add_data(json.dumps(
+                self.db, separators=(',', ':')).encode())
         self.db = {"status": {}}
     def handle_async_db(self, msg, raw_msg):
         params = msg["params"]
@@ -192,12 +269,14 @@ def nice():
 def main():
     usage = "%prog [options] <socket filename> <log name>"
     opts = optparse.OptionParser(usage)
+    opts.add_option("-b", "--binary", action="store_true",
+                    help="write a columnar binary data file")
     options, args = opts.parse_args()
     if len(args) != 2:
         opts.error("Incorrect number of arguments")
 
     nice()
-    dl = DataLogger(args[0], args[1])
+    dl = DataLogger(args[0], args[1], options.binary)
     dl.run()
 
 if __name__ == '__main__':
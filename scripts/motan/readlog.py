@@ -3,7 +3,7 @@
 # Copyright (C) 2021  Kevin O'Connor <kevin@koconnor.net>
 #
 # This file may be distributed under the terms of the GNU GPLv3 license.
-import json, zlib
+import os, sys, math, json, zlib, struct, mmap, array, logging
 
 class error(Exception):
     pass
@@ -16,6 +16,14 @@ class error(Exception):
 # Log data handlers: {name: class, ...}
 LogHandlers = {}
 
+# Return the "data" of a dump message as a list of columns
+def get_columns(jmsg):
+    columns = jmsg.get('columns')
+    if columns is None:
+        # Messages from a json log store a list of rows
+        columns = jmsg['columns'] = list(zip(*jmsg.pop('data')))
+    return columns
+
 # Extract status fields from log
 class HandleStatusField:
     SubscriptionIdParts = 0
@@ -57,7 +65,8 @@ class HandleTrapQ:
     def __init__(self, lmanager, name, name_parts):
         self.name = name
         self.jdispatch = lmanager.get_jdispatch()
-        self.cur_data = [(0., 0., 0., 0., (0., 0., 0.), (0., 0., 0.))]
+        self.cur_data = [[0.], [0.], [0.], [0.], [(0., 0., 0.)],
+                         [(0., 0., 0.)]]
         self.data_pos = 0
         tq, trapq_name, datasel = name_parts
         ptypes = {}
@@ -94,49 +103,75 @@ class HandleTrapQ:
     def _find_move(self, req_time):
         data_pos = self.data_pos
         while 1:
-            move = self.cur_data[data_pos]
-            print_time, move_t, start_v, accel, start_pos, axes_r = move
-            if req_time <= print_time + move_t:
+            print_times, move_ts = self.cur_data[:2]
+            print_time = print_times[data_pos]
+            if req_time <= print_time + move_ts[data_pos]:
+                move = [c[data_pos] for c in self.cur_data]
                 return move, req_time >= print_time
             data_pos += 1
-            if data_pos < len(self.cur_data):
+            if data_pos < len(print_times):
                 self.data_pos = data_pos
                 continue
             jmsg = self.jdispatch.pull_msg(req_time, self.name)
             if jmsg is None:
-                return move, False
-            self.cur_data = jmsg['data']
+                return [c[-1] for c in self.cur_data], False
+            self.cur_data = get_columns(jmsg)
             self.data_pos = data_pos = 0
+    def _calc_motion(self, move, mtime):
+        # Return the distance, velocity, and acceleration along a move
+        print_time, move_t, start_v, accel, start_pos, axes_r = move[:6]
+        c3 = c4 = 0.
+        if len(move) >= 8:
+            c3, c4 = move[7]
+        dist = (start_v + (.5 * accel + (c3 + c4 * mtime) * mtime)
+                * mtime) * mtime
+        velocity = start_v + (accel + (3. * c3 + 4. * c4 * mtime)
+                              * mtime) * mtime
+        accel = accel + (6. * c3 + 12. * c4 * mtime) * mtime
+        return dist, velocity, accel
+    def _calc_arc(self, move, dist):
+        # Return the position, direction, and curvature terms of arc moves
+        if len(move) < 7 or not move[6][6]:
+            return 0., 0., 0.
+        arc = move[6]
+        a, b, k = arc[self.axis], arc[self.axis + 3], arc[6]
+        c, s = math.cos(k * dist), math.sin(k * dist)
+        return a * (c - 1.) + b * s, k * (b * c - a * s), -k*k * (a*c + b*s)
     def _pull_axis_position(self, req_time):
         move, in_range = self._find_move(req_time)
-        print_time, move_t, start_v, accel, start_pos, axes_r = move
+        print_time, move_t, start_v, accel, start_pos, axes_r = move[:6]
         mtime = max(0., min(move_t, req_time - print_time))
-        dist = (start_v + .5 * accel * mtime) * mtime;
-        return start_pos[self.axis] + axes_r[self.axis] * dist
+        dist, velocity, accel = self._calc_motion(move, mtime)
+        arc_pos, arc_r, arc_c = self._calc_arc(move, dist)
+        return start_pos[self.axis] + axes_r[self.axis] * dist + arc_pos
     def _pull_axis_velocity(self, req_time):
         move, in_range = self._find_move(req_time)
         if not in_range:
             return 0.
-        print_time, move_t, start_v, accel, start_pos, axes_r = move
-        return (start_v + accel * (req_time - print_time)) * axes_r[self.axis]
+        print_time, move_t, start_v, accel, start_pos, axes_r = move[:6]
+        dist, velocity, accel = self._calc_motion(move, req_time - print_time)
+        arc_pos, arc_r, arc_c = self._calc_arc(move, dist)
+        return velocity * (axes_r[self.axis] + arc_r)
     def _pull_axis_accel(self, req_time):
         move, in_range = self._find_move(req_time)
         if not in_range:
             return 0.
-        print_time, move_t, start_v, accel, start_pos, axes_r = move
-        return accel * axes_r[self.axis]
+        print_time, move_t, start_v, accel, start_pos, axes_r = move[:6]
+        dist, velocity, accel = self._calc_motion(move, req_time - print_time)
+        arc_pos, arc_r, arc_c = self._calc_arc(move, dist)
+        return accel * (axes_r[self.axis] + arc_r) + velocity**2 * arc_c
     def _pull_velocity(self, req_time):
         move, in_range = self._find_move(req_time)
         if not in_range:
             return 0.
-        print_time, move_t, start_v, accel, start_pos, axes_r = move
-        return start_v + accel * (req_time - print_time)
+        print_time = move[0]
+        return self._calc_motion(move, req_time - print_time)[1]
     def _pull_accel(self, req_time):
         move, in_range = self._find_move(req_time)
         if not in_range:
             return 0.
-        print_time, move_t, start_v, accel, start_pos, axes_r = move
-        return accel
+        print_time = move[0]
+        return self._calc_motion(move, req_time - print_time)[2]
 LogHandlers["trapq"] = HandleTrapQ
 
 # Extract positions from queue_step log
@@ -207,9 +242,10 @@ class HandleStepQ:
             if req_time <= last_time:
                 break
         # Process block into (time, half_position, position) 3-tuples
+        intervals, counts, adds = get_columns(jmsg)
         first_time = step_time = jmsg['first_step_time']
         first_clock = jmsg['first_clock']
-        step_clock = first_clock - jmsg['data'][0][0]
+        step_clock = first_clock - intervals[0]
         cdiff = jmsg['last_clock'] - first_clock
         tdiff = last_time - first_time
         inv_freq = 0.
@@ -219,7 +255,7 @@ class HandleStepQ:
         step_pos = jmsg['start_position']
         if not step_data[0][0]:
             step_data[0] = (0., step_pos, step_pos)
-        for interval, raw_count, add in jmsg['data']:
+        for interval, raw_count, add in zip(intervals, counts, adds):
             qs_dist = step_dist
             count = raw_count
             if count < 0:
@@ -309,9 +345,10 @@ class HandleStepPhase:
             if req_time <= last_time:
                 break
         # Process block into (time, position) 2-tuples
+        intervals, counts, adds = get_columns(jmsg)
         first_time = step_time = jmsg['first_step_time']
         first_clock = jmsg['first_clock']
-        step_clock = first_clock - jmsg['data'][0][0]
+        step_clock = first_clock - intervals[0]
         cdiff = jmsg['last_clock'] - first_clock
         tdiff = last_time - first_time
         inv_freq = 0.
@@ -320,7 +357,7 @@ class HandleStepPhase:
         step_pos = jmsg['start_mcu_position']
         if not step_data[0][0]:
             step_data[0] = (0., step_pos)
-        for interval, raw_count, add in jmsg['data']:
+        for interval, raw_count, add in zip(intervals, counts, adds):
             qs_dist = 1
             count = raw_count
             if count < 0:
@@ -346,8 +383,8 @@ class HandleADXL345:
         self.adxl_name = name_parts[1]
         self.jdispatch = lmanager.get_jdispatch()
         self.next_accel_time = self.last_accel_time = 0.
-        self.next_accel = self.last_accel = (0., 0., 0.)
-        self.cur_data = []
+        self.next_accel = self.last_accel = 0.
+        self.cur_times = self.cur_accels = []
         self.data_pos = 0
         if name_parts[2] not in 'xyz':
             raise error("Unknown adxl345 data selection '%s'" % (name,))
@@ -356,25 +393,26 @@ class HandleADXL345:
         label = '%s %s acceleration' % (self.adxl_name, 'xyz'[self.axis])
         return {'label': label, 'units': 'Acceleration\n(mm/s^2)'}
     def pull_data(self, req_time):
-        axis = self.axis
         while 1:
             if req_time <= self.next_accel_time:
-                adiff = self.next_accel[axis] - self.last_accel[axis]
+                adiff = self.next_accel - self.last_accel
                 tdiff = self.next_accel_time - self.last_accel_time
                 rtdiff = req_time - self.last_accel_time
-                return self.last_accel[axis] + rtdiff * adiff / tdiff
-            if self.data_pos >= len(self.cur_data):
+                return self.last_accel + rtdiff * adiff / tdiff
+            if self.data_pos >= len(self.cur_times):
                 # Read next data block
                 jmsg = self.jdispatch.pull_msg(req_time, self.name)
                 if jmsg is None:
                     return 0.
-                self.cur_data = jmsg['data']
+                columns = get_columns(jmsg)
+                self.cur_times = columns[0]
+                self.cur_accels = columns[self.axis + 1]
                 self.data_pos = 0
                 continue
             self.last_accel = self.next_accel
             self.last_accel_time = self.next_accel_time
-            self.next_accel_time, x, y, z = self.cur_data[self.data_pos]
-            self.next_accel = (x, y, z)
+            self.next_accel_time = self.cur_times[self.data_pos]
+            self.next_accel = self.cur_accels[self.data_pos]
             self.data_pos += 1
 LogHandlers["adxl345"] = HandleADXL345
 
@@ -391,7 +429,7 @@ class HandleAngle:
         self.jdispatch = lmanager.get_jdispatch()
         self.next_angle_time = self.last_angle_time = 0.
         self.next_angle = self.last_angle = 0.
-        self.cur_data = []
+        self.cur_times = self.cur_angles = []
         self.data_pos = 0
         self.position_offset = 0.
         self.angle_dist = 1.
@@ -421,13 +459,13 @@ class HandleAngle:
                 po = rtdiff * pdiff / tdiff
                 return ((self.last_angle + po) * self.angle_dist
                         + self.position_offset)
-            if self.data_pos >= len(self.cur_data):
+            if self.data_pos >= len(self.cur_times):
                 # Read next data block
                 jmsg = self.jdispatch.pull_msg(req_time, self.name)
                 if jmsg is None:
                     return (self.next_angle * self.angle_dist
                             + self.position_offset)
-                self.cur_data = jmsg['data']
+                self.cur_times, self.cur_angles = get_columns(jmsg)
                 position_offset = jmsg.get('position_offset')
                 if position_offset is not None:
                     self.position_offset = position_offset
@@ -435,7 +473,8 @@ class HandleAngle:
                 continue
             self.last_angle = self.next_angle
             self.last_angle_time = self.next_angle_time
-            self.next_angle_time, self.next_angle = self.cur_data[self.data_pos]
+            self.next_angle_time = self.cur_times[self.data_pos]
+            self.next_angle = self.cur_angles[self.data_pos]
             self.data_pos += 1
 LogHandlers["angle"] = HandleAngle
 
@@ -472,13 +511,124 @@ class JsonLogReader:
             parts[0] = msgs[0] + parts[0]
             self.msgs = msgs = parts
 
+# The columnar binary data file (data_logger.py --binary) starts with
+# BINARY_MAGIC and the BINARY_INDEX_POS position of the first index
+# block, followed by a series of records.  Each record has a
+# BINARY_RECORD header (record type, subscription id length, json
+# header length, body length) followed by the subscription id, the
+# json header, and the body.  Record type 'J' stores a regular API
+# message (with an empty body) and type 'D' stores an API binary frame
+# whose body contains the typed "data" column arrays.  Record type 'I'
+# is a time index block - it is written every few seconds and its json
+# header holds the status changes since the previous index block (the
+# first index block holds the initial status and subscriptions).  The
+# body of an index block is the BINARY_INDEX_POS position of the next
+# index block (or zero for the last one), so the index can be read
+# without visiting the other records.  Reading may start at the record
+# following any index block.
+BINARY_MAGIC = b"motan-bin-v3\n\0\0\0"
+BINARY_INDEX_POS = struct.Struct("<Q")
+BINARY_RECORD = struct.Struct("<cBII")
+BINARY_DATA_START = len(BINARY_MAGIC) + BINARY_INDEX_POS.size
+
+if sys.version_info.major < 3:
+    array_frombytes = lambda arr, data: arr.fromstring(data)
+else:
+    array_frombytes = lambda arr, data: arr.frombytes(data)
+
+# Memory map a columnar binary log and decode requested messages
+class BinaryLogReader:
+    def __init__(self, filename, wanted_ids):
+        self.file = open(filename, "rb")
+        self.data = mmap.mmap(self.file.fileno(), 0, access=mmap.ACCESS_READ)
+        if self.data[:len(BINARY_MAGIC)] != BINARY_MAGIC:
+            raise error("File '%s' is not a motan binary log" % (filename,))
+        self.wanted_ids = wanted_ids
+        self.pos = BINARY_DATA_START
+    def seek(self, pos):
+        self.pos = max(pos, BINARY_DATA_START)
+    def _read_record(self, pos):
+        # Returns (rtype, subscription id pos, qlen, hlen, end) or None
+        hpos = pos + BINARY_RECORD.size
+        if hpos > len(self.data):
+            return None
+        rtype, qlen, hlen, blen = BINARY_RECORD.unpack_from(self.data, pos)
+        end = hpos + qlen + hlen + blen
+        if end > len(self.data):
+            # Truncated record at end of log
+            return None
+        return rtype, hpos, qlen, hlen, end
+    def _decode_columns(self, data_format, body_pos):
+        count = data_format['count']
+        columns = []
+        for typecode, width in data_format['columns']:
+            arr = array.array(typecode)
+            size = arr.itemsize * count * width
+            array_frombytes(arr, self.data[body_pos:body_pos+size])
+            if sys.byteorder != 'little':
+                arr.byteswap()
+            body_pos += size
+            if width > 1:
+                arr = list(zip(*[iter(arr)]*width))
+            columns.append(arr)
+        return columns
+    def get_first_index(self):
+        return BINARY_INDEX_POS.unpack_from(self.data, len(BINARY_MAGIC))[0]
+    def pull_index(self, pos):
+        # Returns (index json, end of index record, next index position)
+        rec = self._read_record(pos) if pos else None
+        if rec is None or rec[0] != b'I':
+            return None, pos, 0
+        rtype, hpos, qlen, hlen, end = rec
+        hpos += qlen
+        next_pos = BINARY_INDEX_POS.unpack_from(self.data, hpos + hlen)[0]
+        return json.loads(self.data[hpos:hpos+hlen]), end, next_pos
+    def pull_msg(self):
+        data = self.data
+        while 1:
+            rec = self._read_record(self.pos)
+            if rec is None:
+                return None
+            rtype, hpos, qlen, hlen, self.pos = rec
+            if rtype == b'I':
+                continue
+            qid = data[hpos:hpos+qlen].decode()
+            if qid not in self.wanted_ids:
+                continue
+            hpos += qlen
+            try:
+                json_msg = json.loads(data[hpos:hpos+hlen])
+            except:
+                logging.exception("Unable to parse record")
+                continue
+            if rtype == b'D':
+                params = json_msg['params']
+                params['columns'] = self._decode_columns(
+                    params.pop('data_format'), hpos + hlen)
+            return json_msg
+
+# Iterate through the index blocks of a columnar binary log
+class BinaryIndexReader:
+    def __init__(self, log_reader):
+        self.log_reader = log_reader
+        self.pos = log_reader.get_first_index()
+    def pull_msg(self):
+        fmsg, end, self.pos = self.log_reader.pull_index(self.pos)
+        if fmsg is not None:
+            fmsg['file_position'] = end
+        return fmsg
+
 # Store messages in per-subscription queues until handlers are ready for them
 class JsonDispatcher:
     def __init__(self, log_prefix):
         self.names = {}
         self.queues = {}
         self.last_read_time = 0.
-        self.log_reader = JsonLogReader(log_prefix + ".json.gz")
+        if os.path.exists(log_prefix + ".bin"):
+            self.log_reader = BinaryLogReader(log_prefix + ".bin",
+                                              self.queues)
+        else:
+            self.log_reader = JsonLogReader(log_prefix + ".json.gz")
         self.is_eof = False
     def check_end_of_data(self):
         return self.is_eof and not any(self.queues.values())
@@ -566,8 +716,12 @@ def list_datasets():
 class LogManager:
     error = error
     def __init__(self, log_prefix):
-        self.index_reader = JsonLogReader(log_prefix + ".index.gz")
         self.jdispatch = JsonDispatcher(log_prefix)
+        log_reader = self.jdispatch.log_reader
+        if isinstance(log_reader, BinaryLogReader):
+            self.index_reader = BinaryIndexReader(log_reader)
+        else:
+            self.index_reader = JsonLogReader(log_prefix + ".index.gz")
         self.initial_start_time = self.start_time = 0.
         self.datasets = {}
         self.initial_status = {}
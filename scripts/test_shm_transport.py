@@ -0,0 +1,92 @@
+#!/usr/bin/env python
+# Tests for the linux mcu shared memory transport
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, subprocess, tempfile, shutil, time, logging, unittest
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+import reactor, serialhdl
+
+MCU_ELF = None
+
+class TestShmTransport(unittest.TestCase):
+    def setUp(self):
+        self.tmpdir = tempfile.mkdtemp()
+        self.sock = os.path.join(self.tmpdir, "klipper_host_mcu")
+        self.mcu_log = open(os.path.join(self.tmpdir, "mcu.log"), "w")
+        self.proc = subprocess.Popen([MCU_ELF, "-s", "-I", self.sock],
+                                     stderr=self.mcu_log)
+        for i in range(100):
+            if os.path.exists(self.sock):
+                break
+            time.sleep(.05)
+        self.reactor = reactor.Reactor()
+    def tearDown(self):
+        self.proc.terminate()
+        self.proc.wait()
+        self.mcu_log.close()
+        shutil.rmtree(self.tmpdir)
+    def run_reactor(self, func):
+        result = []
+        def callback(eventtime):
+            try:
+                func()
+            except Exception as e:
+                result.append(e)
+            self.reactor.end()
+        self.reactor.register_callback(callback)
+        self.reactor.run()
+        self.reactor.finalize()
+        if result:
+            raise result[0]
+    def connect(self):
+        ser = serialhdl.SerialReader(self.reactor)
+        ser.connect_pipe(self.sock)
+        self.assertEqual(ser.get_msgparser().get_constant('MCU'), 'linux')
+        return ser
+    def check_uptime(self, ser):
+        params = ser.send_with_response('get_uptime', 'uptime')
+        self.assertIn('clock', params)
+    def test_identify(self):
+        def func():
+            ser = self.connect()
+            for i in range(10):
+                self.check_uptime(ser)
+            ser.disconnect()
+        self.run_reactor(func)
+    def test_flood(self):
+        # Responses to a burst of commands may exceed the ring size -
+        # the mcu must drop them rather than stall
+        def func():
+            ser = self.connect()
+            responses = []
+            ser.register_response(responses.append, 'clock')
+            for i in range(2000):
+                ser.send('get_clock')
+            self.reactor.pause(self.reactor.monotonic() + 1.)
+            self.assertGreater(len(responses), 0)
+            self.check_uptime(ser)
+            ser.disconnect()
+        self.run_reactor(func)
+        self.assertIsNone(self.proc.poll())
+    def test_reconnect(self):
+        def func():
+            ser = self.connect()
+            self.check_uptime(ser)
+            ser.disconnect()
+            ser = self.connect()
+            self.check_uptime(ser)
+            ser.disconnect()
+        self.run_reactor(func)
+
+def main():
+    global MCU_ELF
+    if len(sys.argv) < 2:
+        sys.stderr.write("Usage: %s <linux mcu klipper.elf> [unittest args]\n"
+                         % (sys.argv[0],))
+        sys.exit(-1)
+    MCU_ELF = sys.argv[1]
+    logging.basicConfig(level=logging.WARN)
+    unittest.main(argv=[sys.argv[0]] + sys.argv[2:])
+
+if __name__ == '__main__':
+    main()
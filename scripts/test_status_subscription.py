@@ -0,0 +1,135 @@
+#!/usr/bin/env python
+# Unit tests for the change tracking of status subscriptions
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, unittest
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+import webhooks
+from extras import gcode_macro
+
+class FakeWebHooks:
+    def register_endpoint(self, path, callback):
+        pass
+
+class FakePrinter:
+    def __init__(self, objects):
+        self.objects = dict(objects)
+        self.objects['webhooks'] = FakeWebHooks()
+    def lookup_object(self, name, default=None):
+        return self.objects.get(name, default)
+    def lookup_objects(self):
+        return list(self.objects.items())
+
+class FakeClientConnection:
+    def __init__(self):
+        self.messages = []
+    def is_closed(self):
+        return False
+    def send(self, msg):
+        self.messages.append(msg['params']['status'])
+
+class FakeGCodeCommand:
+    error = Exception
+    def __init__(self, params):
+        self.params = params
+    def get(self, name):
+        return self.params[name]
+
+# Object without get_status_version()
+class PlainObject:
+    def __init__(self):
+        self.status = {'value': 0}
+    def get_status(self, eventtime):
+        return dict(self.status)
+
+def make_macro(variables):
+    # Create a gcode_macro object without the gcode/template setup
+    macro = gcode_macro.GCodeMacro.__new__(gcode_macro.GCodeMacro)
+    macro.variables = dict(variables)
+    macro.status_version = 0
+    return macro
+
+class TestStatusSubscription(unittest.TestCase):
+    def setUp(self):
+        self.macro = make_macro({'count': 0, 'name': "a"})
+        self.plain = PlainObject()
+        self.printer = FakePrinter({'gcode_macro test': self.macro,
+                                    'plain': self.plain})
+        self.helper = webhooks.QueryStatusHelper(self.printer)
+        self.eventtime = 100.
+    def subscribe(self, objects, refresh_time=None):
+        if refresh_time is None:
+            refresh_time = webhooks.SUBSCRIPTION_REFRESH_TIME
+        # Mimic objects/subscribe (the initial query reports everything)
+        cconn = FakeClientConnection()
+        last_status = {}
+        self.helper.pending_queries.append(
+            (True, objects, cconn.send, {}, last_status))
+        self.helper.clients[cconn] = {
+            'subscription': objects, 'send_func': cconn.send, 'template': {},
+            'last_status': last_status, 'refresh_time': refresh_time,
+            'next_time': (self.eventtime + refresh_time
+                          - .5 * webhooks.SUBSCRIPTION_REFRESH_TIME)}
+        return cconn
+    def query(self):
+        self.helper._do_query(self.eventtime)
+        self.eventtime += webhooks.SUBSCRIPTION_REFRESH_TIME
+    def set_variable(self, variable, value):
+        self.macro.cmd_SET_GCODE_VARIABLE(
+            FakeGCodeCommand({'VARIABLE': variable, 'VALUE': value}))
+    def test_initial_status(self):
+        cconn = self.subscribe({'gcode_macro test': None, 'plain': None})
+        self.query()
+        self.assertEqual(cconn.messages, [
+            {'gcode_macro test': {'count': 0, 'name': "a"},
+             'plain': {'value': 0}}])
+    def test_unchanged(self):
+        cconn = self.subscribe({'gcode_macro test': None, 'plain': None})
+        self.query()
+        self.query()
+        self.query()
+        self.assertEqual(len(cconn.messages), 1)
+    def test_macro_variable_change(self):
+        cconn = self.subscribe({'gcode_macro test': None})
+        self.query()
+        self.set_variable('count', '5')
+        self.query()
+        self.assertEqual(cconn.messages[1], {'gcode_macro test': {'count': 5}})
+        # Setting a variable to its current value is not reported
+        self.set_variable('count', '5')
+        self.query()
+        self.assertEqual(len(cconn.messages), 2)
+        self.set_variable('name', '"b"')
+        self.query()
+        self.assertEqual(cconn.messages[2], {'gcode_macro test': {'name': "b"}})
+    def test_requested_fields(self):
+        cconn = self.subscribe({'gcode_macro test': ['name']})
+        self.query()
+        self.set_variable('count', '1')
+        self.query()
+        self.assertEqual(len(cconn.messages), 1)
+        self.set_variable('name', '"c"')
+        self.query()
+        self.assertEqual(cconn.messages[1], {'gcode_macro test': {'name': "c"}})
+    def test_plain_object_change(self):
+        cconn = self.subscribe({'plain': None})
+        self.query()
+        self.plain.status['value'] = 3
+        self.query()
+        self.assertEqual(cconn.messages[1], {'plain': {'value': 3}})
+    def test_clients_track_changes_separately(self):
+        # A change seen by one client must still reach a client with a
+        # slower refresh_time on its next update
+        fast = self.subscribe({'gcode_macro test': None})
+        slow = self.subscribe({'gcode_macro test': None}, refresh_time=1.)
+        self.query()
+        self.set_variable('count', '7')
+        for i in range(4):
+            self.query()
+        self.assertEqual(fast.messages[1], {'gcode_macro test': {'count': 7}})
+        self.assertEqual(len(fast.messages), 2)
+        self.assertEqual(slow.messages[1:],
+                         [{'gcode_macro test': {'count': 7}}])
+
+if __name__ == '__main__':
+    unittest.main()
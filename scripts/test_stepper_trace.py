@@ -0,0 +1,57 @@
+#!/usr/bin/env python
+# Unit tests for the stepper_trace step time analyzer
+#
+# This file may be distributed under the terms of the GNU GPLv3 license.
+import sys, os, collections, unittest
+sys.path.append(os.path.join(os.path.dirname(__file__), '../klippy'))
+from extras import stepper_trace
+
+QueueStep = collections.namedtuple(
+    'QueueStep', ('first_clock', 'interval', 'add', 'step_count'))
+
+class TestExpandSteps(unittest.TestCase):
+    def test_expand(self):
+        history = [QueueStep(1000, 100, 0, 3), QueueStep(1400, 50, 10, -3)]
+        self.assertEqual(stepper_trace.expand_steps(history),
+                         [1000, 1100, 1200, 1400, 1450, 1510])
+
+class TestCompareSteps(unittest.TestCase):
+    expected = [1000 + 100 * i for i in range(20)]
+    def test_exact(self):
+        res = stepper_trace.compare_steps(list(self.expected), self.expected)
+        self.assertEqual(res['count'], 20)
+        self.assertEqual(res['expected'], 20)
+        self.assertEqual((res['missing'], res['extra']), (0, 0))
+        self.assertEqual((res['avg'], res['stddev'], res['max']), (0., 0., 0))
+    def test_offset(self):
+        actual = [c + 7 for c in self.expected]
+        actual[5] += 4
+        res = stepper_trace.compare_steps(actual, self.expected)
+        self.assertAlmostEqual(res['avg'], 7.2)
+        self.assertEqual(res['max'], 11)
+        self.assertGreater(res['stddev'], 0.)
+    def test_missing_step(self):
+        # A step missing in the middle must not be hidden by matching
+        # each traced step with its nearest commanded step
+        actual = self.expected[:10] + self.expected[11:]
+        res = stepper_trace.compare_steps(actual, self.expected)
+        self.assertEqual((res['missing'], res['extra']), (1, 0))
+        self.assertEqual(res['max'], 100)
+    def test_extra_step(self):
+        actual = self.expected[:10] + [1950] + self.expected[10:]
+        res = stepper_trace.compare_steps(actual, self.expected)
+        self.assertEqual((res['missing'], res['extra']), (0, 1))
+        self.assertEqual(res['max'], 100)
+    def test_large_error(self):
+        # Errors larger than half a step interval are reported in full
+        actual = [c + 80 for c in self.expected]
+        res = stepper_trace.compare_steps(actual, self.expected)
+        self.assertEqual(res['max'], 80)
+        self.assertAlmostEqual(res['avg'], 80.)
+    def test_no_steps(self):
+        res = stepper_trace.compare_steps([], self.expected)
+        self.assertEqual((res['count'], res['missing']), (0, 20))
+        self.assertNotIn('avg', res)
+
+if __name__ == '__main__':
+    unittest.main()
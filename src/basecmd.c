@@ -5,6 +5,7 @@
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
 #include <string.h> // memset
+#include "autoconf.h" // CONFIG_MACH_LINUX
 #include "basecmd.h" // oid_lookup
 #include "board/irq.h" // irq_save
 #include "board/misc.h" // alloc_maxsize
@@ -60,7 +61,7 @@ alloc_chunks(size_t size, size_t count, uint16_t *avail)
 
 static struct move_node *move_free_list;
 static void *move_list;
-static uint16_t move_count;
+static uint16_t move_count, move_used;
 static uint8_t move_item_size;
 
 // Is the config and move queue finalized?
@@ -78,6 +79,8 @@ move_free(void *m)
     struct move_node *mf = m;
     mf->next = move_free_list;
     move_free_list = mf;
+    if (CONFIG_MACH_LINUX)
+        move_used--;
 }
 
 // Allocate runtime storage
@@ -89,10 +92,23 @@ move_alloc(void)
     if (!mf)
         shutdown("Move queue overflow");
     move_free_list = mf->next;
+    if (CONFIG_MACH_LINUX)
+        move_used++;
     irq_restore(flag);
     return mf;
 }
 
+// Report the number of allocated and available move storage items
+// (only tracked on linux, for the simulated clock statistics)
+void
+move_alloc_stats(uint16_t *used, uint16_t *count)
+{
+    irqstatus_t flag = irq_save();
+    *used = move_used;
+    *count = move_count;
+    irq_restore(flag);
+}
+
 // Check if a move_queue is empty
 int
 move_queue_empty(struct move_queue_head *mh)
@@ -163,6 +179,7 @@ move_reset(void)
     struct move_node *mf = move_list + (move_count - 1)*move_item_size;
     mf->next = NULL;
     move_free_list = move_list;
+    move_used = 0;
 }
 DECL_SHUTDOWN(move_reset);
 
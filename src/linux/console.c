@@ -1,4 +1,4 @@
-// TTY based IO
+// TTY (or shared memory) based IO
 //
 // Copyright (C) 2017-2021  Kevin O'Connor <kevin@koconnor.net>
 //
@@ -11,7 +11,11 @@
 #include <pty.h> // openpty
 #include <stdio.h> // fprintf
 #include <string.h> // memmove
+#include <sys/eventfd.h> // eventfd
+#include <sys/mman.h> // memfd_create
+#include <sys/socket.h> // sendmsg
 #include <sys/stat.h> // chmod
+#include <sys/un.h> // struct sockaddr_un
 #include <time.h> // struct timespec
 #include <unistd.h> // ttyname
 #include "board/irq.h" // irq_wait
@@ -19,9 +23,11 @@
 #include "command.h" // command_find_block
 #include "internal.h" // console_setup
 #include "sched.h" // sched_wake_task
+#include "shm_ring.h" // shm_ring_write
 
-static struct pollfd main_pfd[1];
+static struct pollfd main_pfd[2];
 #define MP_TTY_IDX   0
+#define MP_SHM_IDX   1
 
 // Report 'errno' in a message written to stderr
 void
@@ -85,6 +91,7 @@ console_setup(char *name)
         return -1;
     main_pfd[MP_TTY_IDX].fd = mfd;
     main_pfd[MP_TTY_IDX].events = POLLIN;
+    main_pfd[MP_SHM_IDX].fd = -1;
 
     // Create symlink to tty
     unlink(name);
@@ -113,6 +120,175 @@ console_setup(char *name)
 }
 
 
+/****************************************************************
+ * Shared memory transport
+ ****************************************************************/
+
+static struct {
+    struct shm_region *shm;
+    int mem_fd, kick_host_fd, client_fd;
+} ShmInfo = { .client_fd = -1 };
+
+// Create a unix socket that hands out the shared region and eventfds
+int
+console_setup_shm(char *name)
+{
+    int mfd = memfd_create("klipper_mcu_shm", MFD_CLOEXEC);
+    if (mfd < 0) {
+        report_errno("memfd_create", mfd);
+        return -1;
+    }
+    int ret = ftruncate(mfd, sizeof(struct shm_region));
+    if (ret) {
+        report_errno("ftruncate", ret);
+        return -1;
+    }
+    ShmInfo.shm = mmap(NULL, sizeof(struct shm_region), PROT_READ | PROT_WRITE
+                       , MAP_SHARED, mfd, 0);
+    if (ShmInfo.shm == MAP_FAILED) {
+        report_errno("mmap", -1);
+        return -1;
+    }
+    ShmInfo.mem_fd = mfd;
+    int kick_mcu_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    ShmInfo.kick_host_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (kick_mcu_fd < 0 || ShmInfo.kick_host_fd < 0) {
+        report_errno("eventfd", -1);
+        return -1;
+    }
+
+    // Create listening socket
+    int sfd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (sfd < 0) {
+        report_errno("socket", sfd);
+        return -1;
+    }
+    struct sockaddr_un addr;
+    memset(&addr, 0, sizeof(addr));
+    addr.sun_family = AF_UNIX;
+    strncpy(addr.sun_path, name, sizeof(addr.sun_path) - 1);
+    unlink(name);
+    ret = bind(sfd, (struct sockaddr *)&addr, sizeof(addr));
+    if (ret) {
+        report_errno("bind", ret);
+        return -1;
+    }
+    ret = chmod(name, 0660);
+    if (ret) {
+        report_errno("chmod", ret);
+        return -1;
+    }
+    ret = listen(sfd, 1);
+    if (ret) {
+        report_errno("listen", ret);
+        return -1;
+    }
+    main_pfd[MP_TTY_IDX].fd = sfd;
+    main_pfd[MP_TTY_IDX].events = POLLIN;
+    main_pfd[MP_SHM_IDX].fd = kick_mcu_fd;
+    main_pfd[MP_SHM_IDX].events = POLLIN;
+
+    // Make sure stderr is non-blocking
+    ret = set_non_blocking(STDERR_FILENO);
+    if (ret)
+        return -1;
+
+    return 0;
+}
+
+// Accept a new host connection and send it the shared region
+static void
+shm_accept(void)
+{
+    int cfd = accept4(main_pfd[MP_TTY_IDX].fd, NULL, NULL, SOCK_CLOEXEC);
+    if (cfd < 0) {
+        if (errno != EWOULDBLOCK)
+            report_errno("accept", cfd);
+        return;
+    }
+    // Only one host at a time - restart the transport
+    if (ShmInfo.client_fd >= 0)
+        close(ShmInfo.client_fd);
+    ShmInfo.client_fd = cfd;
+    memset(ShmInfo.shm, 0, sizeof(*ShmInfo.shm));
+    int fds[3] = { ShmInfo.mem_fd, main_pfd[MP_SHM_IDX].fd
+                   , ShmInfo.kick_host_fd };
+    char dummy = 0;
+    struct iovec iov = { .iov_base = &dummy, .iov_len = sizeof(dummy) };
+    union {
+        struct cmsghdr hdr;
+        char buf[CMSG_SPACE(sizeof(fds))];
+    } cbuf;
+    memset(&cbuf, 0, sizeof(cbuf));
+    struct msghdr msg = {
+        .msg_iov = &iov, .msg_iovlen = 1,
+        .msg_control = cbuf.buf, .msg_controllen = sizeof(cbuf.buf),
+    };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+    int ret = sendmsg(cfd, &msg, MSG_NOSIGNAL);
+    if (ret < 0)
+        report_errno("sendmsg", ret);
+}
+
+// Read any pending data from the host
+static int
+shm_read(uint8_t *buf, int len)
+{
+    if (main_pfd[MP_TTY_IDX].revents)
+        shm_accept();
+    uint64_t count;
+    int ret = read(main_pfd[MP_SHM_IDX].fd, &count, sizeof(count));
+    if (ret < 0 && errno != EWOULDBLOCK)
+        report_errno("eventfd read", ret);
+    return shm_ring_read(&ShmInfo.shm->to_mcu, buf, len);
+}
+
+// Wake the host to process the data in its ring
+static void
+shm_kick_host(void)
+{
+    uint64_t kick = 1;
+    int ret = write(ShmInfo.kick_host_fd, &kick, sizeof(kick));
+    if (ret < 0)
+        report_errno("eventfd write", ret);
+}
+
+// Check if a host is still connected to the shared memory transport
+static int
+shm_host_connected(void)
+{
+    if (ShmInfo.client_fd < 0)
+        return 0;
+    uint8_t dummy;
+    int ret = recv(ShmInfo.client_fd, &dummy, sizeof(dummy)
+                   , MSG_PEEK | MSG_DONTWAIT);
+    if (ret == 0 || (ret < 0 && errno != EWOULDBLOCK)) {
+        close(ShmInfo.client_fd);
+        ShmInfo.client_fd = -1;
+        return 0;
+    }
+    return 1;
+}
+
+// Transmit a message block to the host
+static void
+shm_write(uint8_t *buf, int len)
+{
+    // Never wait for the host (as with a non-blocking tty write) - if
+    // the ring is full the message is dropped
+    if (!shm_ring_write(&ShmInfo.shm->to_host, buf, len)) {
+        if (shm_host_connected())
+            fprintf(stderr, "Shared memory ring full - message dropped\n");
+        return;
+    }
+    shm_kick_host();
+}
+
+
 /****************************************************************
  * Console handling
  ****************************************************************/
@@ -135,8 +311,17 @@ console_task(void)
         return;
 
     // Read data
-    int ret = read(main_pfd[MP_TTY_IDX].fd, &receive_buf[receive_pos]
+    int ret;
+    if (ShmInfo.shm) {
+        ret = shm_read(&receive_buf[receive_pos]
+                       , sizeof(receive_buf) - receive_pos);
+        if (ret)
+            // Ring may still hold data - check again on next pass
+            sched_wake_task(&console_wake);
+    } else {
+        ret = read(main_pfd[MP_TTY_IDX].fd, &receive_buf[receive_pos]
                    , sizeof(receive_buf) - receive_pos);
+    }
     if (ret < 0) {
         if (errno == EWOULDBLOCK) {
             ret = 0;
@@ -173,6 +358,10 @@ console_sendf(const struct command_encoder *ce, va_list args)
     uint_fast8_t msglen = command_encode_and_frame(buf, ce, args);
 
     // Transmit message
+    if (ShmInfo.shm) {
+        shm_write(buf, msglen);
+        return;
+    }
     int ret = write(main_pfd[MP_TTY_IDX].fd, buf, msglen);
     if (ret < 0)
         report_errno("write", ret);
@@ -188,6 +377,6 @@ console_sleep(sigset_t *sigset)
             report_errno("ppoll main_pfd", ret);
         return;
     }
-    if (main_pfd[MP_TTY_IDX].revents)
+    if (main_pfd[MP_TTY_IDX].revents || main_pfd[MP_SHM_IDX].revents)
         sched_wake_task(&console_wake);
 }
@@ -37,6 +37,15 @@ struct gpio_line {
 };
 static struct gpio_line gpio_lines[9 * MAX_GPIO_LINES];
 static int gpio_chip_fd[9] = { -1, -1, -1, -1, -1, -1, -1, -1, -1 };
+static int gpio_simulated;
+
+// Keep the state of all gpio lines in memory instead of accessing a
+// gpio chip device (used with a simulated clock)
+void
+gpio_simulate_setup(void)
+{
+    gpio_simulated = 1;
+}
 
 static int
 get_chip_fd(uint8_t chipId)
@@ -88,6 +97,10 @@ gpio_release_line(struct gpio_line *line)
 void
 gpio_out_reset(struct gpio_out g, uint8_t val)
 {
+    if (gpio_simulated) {
+        g.line->state = !!val;
+        return;
+    }
     gpio_release_line(g.line);
     struct gpiohandle_request req;
     memset(&req, 0, sizeof(req));
@@ -110,11 +123,13 @@ gpio_out_reset(struct gpio_out g, uint8_t val)
 void
 gpio_out_write(struct gpio_out g, uint8_t val)
 {
+    g.line->state = !!val;
+    if (gpio_simulated)
+        return;
     struct gpiohandle_data data;
     memset(&data, 0, sizeof(data));
     data.values[0] = !!val;
     ioctl(g.line->fd, GPIOHANDLE_SET_LINE_VALUES_IOCTL, &data);
-    g.line->state = !!val;
 }
 
 void
@@ -143,6 +158,11 @@ gpio_in_setup(uint32_t pin, int8_t pull_up)
 void
 gpio_in_reset(struct gpio_in g, int8_t pull_up)
 {
+    if (gpio_simulated) {
+        // Simulated inputs read as their pull-up (or pull-down) level
+        g.line->state = pull_up > 0;
+        return;
+    }
     gpio_release_line(g.line);
     struct gpiohandle_request req;
     memset(&req, 0, sizeof(req));
@@ -170,6 +190,8 @@ gpio_in_reset(struct gpio_in g, int8_t pull_up)
 uint8_t
 gpio_in_read(struct gpio_in g)
 {
+    if (gpio_simulated)
+        return g.line->state;
     struct gpiohandle_data data;
     memset(&data, 0, sizeof(data));
     ioctl(g.line->fd, GPIOHANDLE_GET_LINE_VALUES_IOCTL, &data);
@@ -19,12 +19,17 @@ void report_errno(char *where, int rc);
 int set_non_blocking(int fd);
 int set_close_on_exec(int fd);
 int console_setup(char *name);
+int console_setup_shm(char *name);
 void console_sleep(sigset_t *sigset);
 
+// gpio.c
+void gpio_simulate_setup(void);
+
 // timer.c
 int timer_check_periodic(uint32_t *ts);
 void timer_disable_signals(void);
 void timer_enable_signals(void);
+int timer_simclock_setup(char *name);
 
 // watchdog.c
 int watchdog_setup(void);
@@ -68,9 +68,9 @@ main(int argc, char **argv)
 {
     // Parse program args
     orig_argv = argv;
-    int opt, watchdog = 0, realtime = 0;
-    char *serial = "/tmp/klipper_host_mcu";
-    while ((opt = getopt(argc, argv, "wrI:")) != -1) {
+    int opt, watchdog = 0, realtime = 0, use_shm = 0;
+    char *serial = "/tmp/klipper_host_mcu", *simclock = NULL;
+    while ((opt = getopt(argc, argv, "wrsI:c:")) != -1) {
         switch (opt) {
         case 'w':
             watchdog = 1;
@@ -78,22 +78,35 @@ main(int argc, char **argv)
         case 'r':
             realtime = 1;
             break;
+        case 's':
+            use_shm = 1;
+            break;
         case 'I':
             serial = optarg;
             break;
+        case 'c':
+            simclock = optarg;
+            break;
         default:
-            fprintf(stderr, "Usage: %s [-w] [-r] [-I path]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-w] [-r] [-s] [-I path]"
+                    " [-c clockfile]\n", argv[0]);
             return -1;
         }
     }
 
     // Initial setup
+    if (simclock) {
+        int ret = timer_simclock_setup(simclock);
+        if (ret)
+            return ret;
+        gpio_simulate_setup();
+    }
     if (realtime) {
         int ret = realtime_setup();
         if (ret)
             return ret;
     }
-    int ret = console_setup(serial);
+    int ret = use_shm ? console_setup_shm(serial) : console_setup(serial);
     if (ret)
         return -1;
     if (watchdog) {
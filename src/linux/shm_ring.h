@@ -0,0 +1,52 @@
+// Memory region shared between klippy and the linux mcu process.  The
+// host side copy of this layout is in klippy/chelper/shm_ring.h.
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+#ifndef __LINUX_SHM_RING_H
+#define __LINUX_SHM_RING_H
+
+#include <stdint.h> // uint32_t
+
+#define SHM_RING_SIZE 4096
+
+struct shm_ring {
+    uint32_t head, tail;
+    uint8_t data[SHM_RING_SIZE];
+};
+
+struct shm_region {
+    struct shm_ring to_mcu, to_host;
+};
+
+// Copy data into a ring (only called by the ring's producer).  Message
+// blocks must never be split, so nothing is written (and 0 returned)
+// unless there is space for all of 'buf'.
+static inline int
+shm_ring_write(struct shm_ring *r, const uint8_t *buf, int len)
+{
+    uint32_t head = r->head, tail = __atomic_load_n(&r->tail, __ATOMIC_ACQUIRE);
+    if (len > SHM_RING_SIZE - (int)(head - tail))
+        return 0;
+    int i;
+    for (i=0; i<len; i++)
+        r->data[(head + i) % SHM_RING_SIZE] = buf[i];
+    __atomic_store_n(&r->head, head + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+// Copy data out of a ring (only called by the ring's consumer)
+static inline int
+shm_ring_read(struct shm_ring *r, uint8_t *buf, int len)
+{
+    uint32_t tail = r->tail, head = __atomic_load_n(&r->head, __ATOMIC_ACQUIRE);
+    int avail = head - tail;
+    if (len > avail)
+        len = avail;
+    int i;
+    for (i=0; i<len; i++)
+        buf[i] = r->data[(tail + i) % SHM_RING_SIZE];
+    __atomic_store_n(&r->tail, tail + len, __ATOMIC_RELEASE);
+    return len;
+}
+
+#endif // shm_ring.h
@@ -4,11 +4,15 @@
 //
 // This file may be distributed under the terms of the GNU GPLv3 license.
 
+#include <fcntl.h> // open
+#include <sys/mman.h> // mmap
 #include <time.h> // struct timespec
+#include <unistd.h> // close
 #include "autoconf.h" // CONFIG_CLOCK_FREQ
 #include "board/io.h" // readl
 #include "board/irq.h" // irq_disable
 #include "board/misc.h" // timer_from_us
+#include "basecmd.h" // move_alloc_stats
 #include "command.h" // DECL_CONSTANT
 #include "internal.h" // console_sleep
 #include "sched.h" // DECL_INIT
@@ -27,8 +31,28 @@ static struct {
     // Unix signal tracking
     timer_t t_alarm;
     sigset_t ss_alarm, ss_sleep;
+    // Host driven clock (when running under scripts/linuxsim.py)
+    struct simclock_s *simclock;
+    uint64_t sim_time_ns;
+    uint32_t sim_waketime, sim_kicked;
 } TimerInfo;
 
+// Layout of the shared memory page used for simulated time.  The
+// host harness grants time by writing 'limit_ns' and then 'grant_seq'
+// (followed by a SIGALRM).  The mcu advances its clock through its
+// timers up to that limit and then stores 'grant_seq' in 'ack_seq'.
+// The host owns 'limit_ns' and 'grant_seq'; the mcu owns all other
+// fields.
+struct simclock_s {
+    volatile uint64_t limit_ns;
+    volatile uint32_t grant_seq, ack_seq;
+    volatile uint64_t time_ns, next_wake_ns;
+    // Statistics reported to the host harness
+    volatile uint32_t timer_events, max_lateness;
+    volatile int32_t min_margin;
+    volatile uint16_t move_used, max_move_used, move_count;
+};
+
 
 /****************************************************************
  * Timespec helpers
@@ -67,6 +91,12 @@ static struct timespec
 timespec_read(void)
 {
     struct timespec ts;
+    if (TimerInfo.simclock) {
+        uint64_t t = TimerInfo.sim_time_ns;
+        ts.tv_sec = t / NSECS;
+        ts.tv_nsec = t % NSECS;
+        return ts;
+    }
     clock_gettime(CLOCK_MONOTONIC, &ts);
     return ts;
 }
@@ -118,6 +148,10 @@ timer_read_time(void)
 void
 timer_kick(void)
 {
+    if (TimerInfo.simclock) {
+        TimerInfo.must_wake_timers = TimerInfo.sim_kicked = 1;
+        return;
+    }
     struct itimerspec it = { .it_interval = {0, 0}, .it_value = {0, 1} };
     timer_settime(TimerInfo.t_alarm, TIMER_ABSTIME, &it, NULL);
 }
@@ -127,6 +161,30 @@ timer_kick(void)
 
 #define TIMER_MIN_TRY_TICKS timer_from_us(2)
 
+// Note the lateness of the timer that just ran (or, after a
+// timer_kick(), the margin of a newly added timer) when running with a
+// host driven clock
+static void
+simclock_note_timer(uint32_t next)
+{
+    struct simclock_s *sc = TimerInfo.simclock;
+    uint32_t now = TimerInfo.last_read_time;
+    if (TimerInfo.sim_kicked) {
+        // The timer added ahead of all others is now next - this is
+        // how close it came to a "Timer too close" shutdown
+        TimerInfo.sim_kicked = 0;
+        int32_t margin = next - now;
+        if (margin < sc->min_margin)
+            sc->min_margin = margin;
+    } else {
+        sc->timer_events++;
+        int32_t lateness = now - TimerInfo.sim_waketime;
+        if (lateness > (int32_t)sc->max_lateness)
+            sc->max_lateness = lateness;
+    }
+    TimerInfo.sim_waketime = next;
+}
+
 // Invoke timers
 static void
 timer_dispatch(void)
@@ -135,6 +193,8 @@ timer_dispatch(void)
     for (;;) {
         // Run the next software timer
         next = sched_timer_dispatch();
+        if (unlikely(TimerInfo.simclock))
+            simclock_note_timer(next);
 
         repeat_count--;
         uint32_t lrt = TimerInfo.last_read_time;
@@ -144,7 +204,8 @@ timer_dispatch(void)
 
         uint32_t now = timer_read_time();
         int32_t diff = next - now;
-        if (diff > (int32_t)TIMER_MIN_TRY_TICKS)
+        if (diff > (int32_t)TIMER_MIN_TRY_TICKS
+            || (TimerInfo.simclock && diff > 0))
             // Schedule next timer normally.
             break;
 
@@ -168,6 +229,13 @@ timer_dispatch(void)
     TimerInfo.next_wake = it.it_value = timespec_from_time(next);
     TimerInfo.next_wake_counter = next;
     TimerInfo.must_wake_timers = 0;
+    struct simclock_s *sc = TimerInfo.simclock;
+    if (sc) {
+        // Clock is advanced to next_wake_ns in simclock_advance()
+        sc->next_wake_ns = ((uint64_t)it.it_value.tv_sec * NSECS
+                            + it.it_value.tv_nsec);
+        return;
+    }
     timer_settime(TimerInfo.t_alarm, TIMER_ABSTIME, &it, NULL);
 }
 
@@ -175,7 +243,10 @@ timer_dispatch(void)
 static void
 timer_signal(int signal)
 {
-    TimerInfo.must_wake_timers = 1;
+    // With a host driven clock SIGALRM only wakes the mcu to check
+    // for a new time grant
+    if (!TimerInfo.simclock)
+        TimerInfo.must_wake_timers = 1;
 }
 
 void
@@ -208,22 +279,85 @@ timer_init(void)
     TimerInfo.start_sec = curtime.tv_sec + 1;
     TimerInfo.next_wake = curtime;
     TimerInfo.next_wake_counter = timespec_to_time(curtime);
-    // Initialize t_alarm signal based timer
-    ret = timer_create(CLOCK_MONOTONIC, NULL, &TimerInfo.t_alarm);
-    if (ret < 0) {
-        report_errno("timer_create", ret);
-        return;
-    }
     struct sigaction act = {.sa_handler = timer_signal, .sa_flags = SA_RESTART};
     ret = sigaction(SIGALRM, &act, NULL);
     if (ret < 0) {
         report_errno("sigaction", ret);
         return;
     }
+    if (TimerInfo.simclock) {
+        TimerInfo.sim_waketime = TimerInfo.next_wake_counter;
+        TimerInfo.must_wake_timers = 1;
+        return;
+    }
+    // Initialize t_alarm signal based timer
+    ret = timer_create(CLOCK_MONOTONIC, NULL, &TimerInfo.t_alarm);
+    if (ret < 0) {
+        report_errno("timer_create", ret);
+        return;
+    }
     timer_kick();
 }
 DECL_INIT(timer_init);
 
+// Use a host driven clock stored in the shared file 'name'
+int
+timer_simclock_setup(char *name)
+{
+    int fd = open(name, O_RDWR);
+    if (fd < 0) {
+        report_errno("open simclock", fd);
+        return -1;
+    }
+    void *p = mmap(NULL, sizeof(struct simclock_s), PROT_READ | PROT_WRITE
+                   , MAP_SHARED, fd, 0);
+    close(fd);
+    if (p == MAP_FAILED) {
+        report_errno("mmap simclock", -1);
+        return -1;
+    }
+    struct simclock_s *sc = p;
+    sc->min_margin = 0x7fffffff;
+    TimerInfo.simclock = sc;
+    return 0;
+}
+
+// Advance a host driven clock to the next timer (if it is before the
+// time granted by the host) or to the granted time.  Returns non-zero
+// if a timer is ready to run.
+static int
+simclock_advance(struct simclock_s *sc)
+{
+    uint16_t used, count;
+    move_alloc_stats(&used, &count);
+    sc->move_used = used;
+    sc->move_count = count;
+    if (used > sc->max_move_used)
+        sc->max_move_used = used;
+
+    uint32_t seq = sc->grant_seq;
+    if (seq == sc->ack_seq)
+        // Nothing granted - wait for the host
+        return 0;
+    __sync_synchronize();
+    uint64_t limit = sc->limit_ns, next_wake = sc->next_wake_ns;
+    int ret = next_wake <= limit;
+    if (ret)
+        limit = next_wake;
+    if (limit > TimerInfo.sim_time_ns)
+        TimerInfo.sim_time_ns = limit;
+    sc->time_ns = TimerInfo.sim_time_ns;
+    timer_read_time();
+    if (ret) {
+        TimerInfo.must_wake_timers = 1;
+        return 1;
+    }
+    // Reached the granted time - report back to the host
+    __sync_synchronize();
+    sc->ack_seq = seq;
+    return 0;
+}
+
 // Block SIGALRM signal
 void
 timer_disable_signals(void)
@@ -270,7 +404,8 @@ irq_wait(void)
     // Must atomically sleep until signaled
     if (!readl(&TimerInfo.must_wake_timers)) {
         timer_disable_signals();
-        if (!TimerInfo.must_wake_timers)
+        struct simclock_s *sc = TimerInfo.simclock;
+        if (!TimerInfo.must_wake_timers && !(sc && simclock_advance(sc)))
             console_sleep(&TimerInfo.ss_sleep);
         timer_enable_signals();
     }
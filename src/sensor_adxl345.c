@@ -10,6 +10,7 @@
 #include "basecmd.h" // oid_alloc
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_TASK
+#include "sensor_bulk.h" // sensor_bulk_push
 #include "spicmds.h" // spidev_transfer
 
 struct adxl345 {
@@ -17,10 +18,14 @@ struct adxl345 {
     uint32_t rest_ticks;
     struct spidev_s *spi;
     uint16_t sequence, limit_count;
-    uint8_t flags, data_count;
-    uint8_t data[50];
+    uint8_t flags, lost_count;
+    struct sensor_bulk sb;
 };
 
+// Each adxl345_data message carries exactly ADXL_BLOCK_SIZE bytes
+#define BYTES_PER_SAMPLE 5
+#define ADXL_BLOCK_SIZE (10 * BYTES_PER_SAMPLE)
+
 enum {
     AX_HAVE_START = 1<<0, AX_RUNNING = 1<<1, AX_PENDING = 1<<2,
 };
@@ -47,16 +52,29 @@ command_config_adxl345(uint32_t *args)
 }
 DECL_COMMAND(command_config_adxl345, "config_adxl345 oid=%c spi_oid=%c");
 
-// Report local measurement buffer
+// Report a block from the local measurement buffer
 static void
 adxl_report(struct adxl345 *ax, uint8_t oid)
 {
+    uint8_t data[ADXL_BLOCK_SIZE];
+    uint_fast8_t count = sensor_bulk_count(&ax->sb);
+    if (count > sizeof(data))
+        count = sizeof(data);
+    sensor_bulk_pop(&ax->sb, data, count);
     sendf("adxl345_data oid=%c sequence=%hu data=%*s"
-          , oid, ax->sequence, ax->data_count, ax->data);
-    ax->data_count = 0;
+          , oid, ax->sequence, count, data);
     ax->sequence++;
 }
 
+// Store an error sample in place of each sample that did not fit
+static void
+adxl_add_lost(struct adxl345 *ax)
+{
+    uint8_t d[BYTES_PER_SAMPLE] = { 0xff, 0xff, 0xff, 0xff, 0xff };
+    while (ax->lost_count && !sensor_bulk_push(&ax->sb, d, sizeof(d)))
+        ax->lost_count--;
+}
+
 // Report buffer and fifo status
 static void
 adxl_status(struct adxl345 *ax, uint_fast8_t oid
@@ -65,7 +83,7 @@ adxl_status(struct adxl345 *ax, uint_fast8_t oid
     sendf("adxl345_status oid=%c clock=%u query_ticks=%u next_sequence=%hu"
           " buffered=%c fifo=%c limit_count=%hu"
           , oid, time1, time2-time1, ax->sequence
-          , ax->data_count, fifo, ax->limit_count);
+          , sensor_bulk_count(&ax->sb), fifo, ax->limit_count);
 }
 
 // Helper code to reschedule the adxl345_event() timer
@@ -96,7 +114,7 @@ adxl_query(struct adxl345 *ax, uint8_t oid)
     spidev_transfer(ax->spi, 1, sizeof(msg), msg);
     // Extract x, y, z measurements
     uint_fast8_t fifo_status = msg[8] & ~0x80; // Ignore trigger bit
-    uint8_t *d = &ax->data[ax->data_count];
+    uint8_t d[BYTES_PER_SAMPLE];
     if (((msg[2] & 0xf0) && (msg[2] & 0xf0) != 0xf0)
         || ((msg[4] & 0xf0) && (msg[4] & 0xf0) != 0xf0)
         || ((msg[6] & 0xf0) && (msg[6] & 0xf0) != 0xf0)
@@ -112,9 +130,12 @@ adxl_query(struct adxl345 *ax, uint8_t oid)
         d[3] = (msg[2] & 0x1f) | (msg[6] << 5); // x high bits and z high bits
         d[4] = (msg[4] & 0x1f) | ((msg[6] << 2) & 0x60); // y high and z high
     }
-    ax->data_count += 5;
-    if (ax->data_count + 5 > ARRAY_SIZE(ax->data))
+    if (sensor_bulk_push(&ax->sb, d, sizeof(d)))
+        // Keep the sample position - an error sample is stored below
+        ax->lost_count++;
+    if (sensor_bulk_count(&ax->sb) >= ADXL_BLOCK_SIZE)
         adxl_report(ax, oid);
+    adxl_add_lost(ax);
     // Check fifo status
     if (fifo_status >= 31)
         ax->limit_count++;
@@ -164,8 +185,10 @@ adxl_stop(struct adxl345 *ax, uint8_t oid)
             adxl_query(ax, oid);
     }
     // Report final data
-    if (ax->data_count)
+    while (sensor_bulk_count(&ax->sb)) {
         adxl_report(ax, oid);
+        adxl_add_lost(ax);
+    }
     adxl_status(ax, oid, end1_time, end2_time, msg[1]);
 }
 
@@ -184,8 +207,8 @@ command_query_adxl345(uint32_t *args)
     ax->timer.waketime = args[1];
     ax->rest_ticks = args[2];
     ax->flags = AX_HAVE_START;
-    ax->sequence = ax->limit_count = 0;
-    ax->data_count = 0;
+    ax->sequence = ax->limit_count = ax->lost_count = 0;
+    sensor_bulk_reset(&ax->sb);
     sched_add_timer(&ax->timer);
 }
 DECL_COMMAND(command_query_adxl345,
@@ -10,6 +10,7 @@
 #include "board/irq.h" // irq_disable
 #include "command.h" // DECL_COMMAND
 #include "sched.h" // DECL_TASK
+#include "sensor_bulk.h" // sensor_bulk_push
 #include "spicmds.h" // spidev_transfer
 
 enum { SA_CHIP_A1333, SA_CHIP_AS5047D, SA_CHIP_TLE5012B, SA_CHIP_MAX };
@@ -25,13 +26,17 @@ enum {
 
 #define MAX_SPI_READ_TIME timer_from_us(50)
 
+// Each spi_angle_data message carries 16 samples (see angle.py)
+#define BYTES_PER_SAMPLE 3
+#define ANGLE_BLOCK_SIZE (16 * BYTES_PER_SAMPLE)
+
 struct spi_angle {
     struct timer timer;
     uint32_t rest_ticks;
     struct spidev_s *spi;
     uint16_t sequence;
-    uint8_t flags, chip_type, data_count, time_shift, overflow;
-    uint8_t data[48];
+    uint8_t flags, chip_type, time_shift, overflow, lost_count;
+    struct sensor_bulk sb;
 };
 
 enum {
@@ -72,32 +77,47 @@ command_config_spi_angle(uint32_t *args)
 DECL_COMMAND(command_config_spi_angle,
              "config_spi_angle oid=%c spi_oid=%c spi_angle_type=%c");
 
-// Report local measurement buffer
+// Report a block from the local measurement buffer
 static void
 angle_report(struct spi_angle *sa, uint8_t oid)
 {
+    uint8_t data[ANGLE_BLOCK_SIZE];
+    uint_fast8_t count = sensor_bulk_count(&sa->sb);
+    if (count > sizeof(data))
+        count = sizeof(data);
+    sensor_bulk_pop(&sa->sb, data, count);
     sendf("spi_angle_data oid=%c sequence=%hu data=%*s"
-          , oid, sa->sequence, sa->data_count, sa->data);
-    sa->data_count = 0;
+          , oid, sa->sequence, count, data);
     sa->sequence++;
 }
 
-// Send spi_angle_data message if buffer is full
+// Store an overflow error in place of each sample that did not fit
+static void
+angle_add_lost(struct spi_angle *sa)
+{
+    uint8_t d[BYTES_PER_SAMPLE] = { TCODE_ERROR, SE_OVERFLOW, 0 };
+    while (sa->lost_count && !sensor_bulk_push(&sa->sb, d, sizeof(d)))
+        sa->lost_count--;
+}
+
+// Send spi_angle_data message if a full block is available
 static void
 angle_check_report(struct spi_angle *sa, uint8_t oid)
 {
-    if (sa->data_count + 3 > ARRAY_SIZE(sa->data))
+    if (sensor_bulk_count(&sa->sb) >= ANGLE_BLOCK_SIZE)
         angle_report(sa, oid);
+    angle_add_lost(sa);
 }
 
 // Add an entry to the measurement buffer
 static void
 angle_add(struct spi_angle *sa, uint_fast8_t tcode, uint_fast16_t data)
 {
-    sa->data[sa->data_count] = tcode;
-    sa->data[sa->data_count + 1] = data;
-    sa->data[sa->data_count + 2] = data >> 8;
-    sa->data_count += 3;
+    uint8_t d[BYTES_PER_SAMPLE] = { tcode, data, data >> 8 };
+    if (sensor_bulk_push(&sa->sb, d, sizeof(d)))
+        // Keep the sample position - angle_check_report() stores a
+        // marker once there is room
+        sa->lost_count++;
 }
 
 // Add an error indicator to the measurement buffer
@@ -232,16 +252,18 @@ command_query_spi_angle(uint32_t *args)
     sa->flags = 0;
     if (!args[2]) {
         // End measurements
-        if (sa->data_count)
+        while (sensor_bulk_count(&sa->sb)) {
             angle_report(sa, oid);
+            angle_add_lost(sa);
+        }
         sendf("spi_angle_end oid=%c sequence=%hu", oid, sa->sequence);
         return;
     }
     // Start new measurements query
     sa->timer.waketime = args[1];
     sa->rest_ticks = args[2];
-    sa->sequence = 0;
-    sa->data_count = 0;
+    sa->sequence = sa->lost_count = 0;
+    sensor_bulk_reset(&sa->sb);
     sa->time_shift = args[3];
     sched_add_timer(&sa->timer);
 }
@@ -0,0 +1,52 @@
+// Lock-free ring buffer for bulk sensor sample reporting
+//
+// This file may be distributed under the terms of the GNU GPLv3 license.
+
+#include "compiler.h" // barrier
+#include "sensor_bulk.h" // sensor_bulk_push
+
+#define SENSOR_BULK_MASK (SENSOR_BULK_SIZE - 1)
+
+// Discard all buffered data (producer must not be active)
+void
+sensor_bulk_reset(struct sensor_bulk *sb)
+{
+    sb->head = sb->tail = 0;
+}
+
+// Return the number of bytes available to the consumer
+uint_fast8_t
+sensor_bulk_count(struct sensor_bulk *sb)
+{
+    return (uint8_t)(sb->head - sb->tail);
+}
+
+// Add data to the ring (called from producer context only)
+int
+sensor_bulk_push(struct sensor_bulk *sb, const uint8_t *data
+                 , uint_fast8_t len)
+{
+    uint8_t head = sb->head;
+    if ((uint8_t)(head - sb->tail) + len > SENSOR_BULK_SIZE)
+        return -1;
+    uint_fast8_t i;
+    for (i=0; i<len; i++)
+        sb->data[(uint8_t)(head + i) & SENSOR_BULK_MASK] = data[i];
+    // Data must be visible before the consumer can observe the new head
+    barrier();
+    sb->head = head + len;
+    return 0;
+}
+
+// Remove data from the ring (called from consumer context only)
+void
+sensor_bulk_pop(struct sensor_bulk *sb, uint8_t *data, uint_fast8_t len)
+{
+    uint8_t tail = sb->tail;
+    uint_fast8_t i;
+    for (i=0; i<len; i++)
+        data[i] = sb->data[(uint8_t)(tail + i) & SENSOR_BULK_MASK];
+    // Data must be copied before the producer may overwrite it
+    barrier();
+    sb->tail = tail + len;
+}
@@ -0,0 +1,23 @@
+#ifndef __SENSOR_BULK_H
+#define __SENSOR_BULK_H
+
+#include <stdint.h> // uint8_t
+
+// Size of the bulk sample ring (must be a power of two)
+#define SENSOR_BULK_SIZE 64
+
+// Ring of raw sensor bytes.  Samples are added and report blocks are
+// removed by the sensor's task - the producer only advances 'head' and
+// the consumer only advances 'tail'.
+struct sensor_bulk {
+    volatile uint8_t head, tail;
+    uint8_t data[SENSOR_BULK_SIZE];
+};
+
+void sensor_bulk_reset(struct sensor_bulk *sb);
+uint_fast8_t sensor_bulk_count(struct sensor_bulk *sb);
+int sensor_bulk_push(struct sensor_bulk *sb, const uint8_t *data
+                     , uint_fast8_t len);
+void sensor_bulk_pop(struct sensor_bulk *sb, uint8_t *data, uint_fast8_t len);
+
+#endif // sensor_bulk.h
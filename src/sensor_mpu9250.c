@@ -14,6 +14,7 @@
 #include "sched.h" // DECL_TASK
 #include "board/gpio.h" // i2c_read
 #include "i2ccmds.h" // i2cdev_oid_lookup
+#include "sensor_bulk.h" // sensor_bulk_push
 
 // Chip registers
 #define AR_FIFO_SIZE 512
@@ -41,15 +42,17 @@
 
 #define BYTES_PER_FIFO_ENTRY 6
 
+// msg size must be <= 255 due to Klipper api
+// = SAMPLES_PER_BLOCK (from mpu9250.py) * BYTES_PER_FIFO_ENTRY
+#define MPU_BLOCK_SIZE (8 * BYTES_PER_FIFO_ENTRY)
+
 struct mpu9250 {
     struct timer timer;
     uint32_t rest_ticks;
     struct i2cdev_s *i2c;
     uint16_t sequence, limit_count, fifo_max, fifo_pkts_bytes;
-    uint8_t flags, data_count;
-    // msg size must be <= 255 due to Klipper api
-    // = SAMPLES_PER_BLOCK (from mpu9250.py) * BYTES_PER_FIFO_ENTRY + 1
-    uint8_t data[48];
+    uint8_t flags;
+    struct sensor_bulk sb;
 };
 
 enum {
@@ -91,13 +94,17 @@ command_config_mpu9250(uint32_t *args)
 }
 DECL_COMMAND(command_config_mpu9250, "config_mpu9250 oid=%c i2c_oid=%c");
 
-// Report local measurement buffer
+// Report a block from the local measurement buffer
 static void
 mp9250_report(struct mpu9250 *mp, uint8_t oid)
 {
+    uint8_t data[MPU_BLOCK_SIZE];
+    uint_fast8_t count = sensor_bulk_count(&mp->sb);
+    if (count > sizeof(data))
+        count = sizeof(data);
+    sensor_bulk_pop(&mp->sb, data, count);
     sendf("mpu9250_data oid=%c sequence=%hu data=%*s"
-          , oid, mp->sequence, mp->data_count, mp->data);
-    mp->data_count = 0;
+          , oid, mp->sequence, count, data);
     mp->sequence++;
 }
 
@@ -109,7 +116,7 @@ mp9250_status(struct mpu9250 *mp, uint_fast8_t oid
     sendf("mpu9250_status oid=%c clock=%u query_ticks=%u next_sequence=%hu"
           " buffered=%c fifo=%u limit_count=%hu"
           , oid, time1, time2-time1, mp->sequence
-          , mp->data_count, fifo, mp->limit_count);
+          , sensor_bulk_count(&mp->sb), fifo, mp->limit_count);
 }
 
 // Helper code to reschedule the mpu9250_event() timer
@@ -126,8 +133,8 @@ mp9250_reschedule_timer(struct mpu9250 *mp)
 static void
 mp9250_query(struct mpu9250 *mp, uint8_t oid)
 {
-    // Find remaining space in report buffer
-    uint8_t data_space = sizeof(mp->data) - mp->data_count;
+    // Find remaining space in report block
+    uint8_t data_space = MPU_BLOCK_SIZE - sensor_bulk_count(&mp->sb);
 
     // If not enough bytes to fill report read MPU FIFO's fill
     if (mp->fifo_pkts_bytes < data_space) {
@@ -135,12 +142,12 @@ mp9250_query(struct mpu9250 *mp, uint8_t oid)
                                 * BYTES_PER_FIFO_ENTRY;
     }
 
-    // If we have enough bytes to fill the buffer do it and send report
+    // If we have enough bytes to fill the block do it and send report
     if (mp->fifo_pkts_bytes >= data_space) {
-        uint8_t reg = AR_FIFO;
-        i2c_read(mp->i2c->i2c_config, sizeof(reg), &reg,
-                 data_space, &mp->data[mp->data_count]);
-        mp->data_count += data_space;
+        uint8_t reg = AR_FIFO, data[MPU_BLOCK_SIZE];
+        i2c_read(mp->i2c->i2c_config, sizeof(reg), &reg, data_space, data);
+        if (sensor_bulk_push(&mp->sb, data, data_space))
+            mp->limit_count++;
         mp->fifo_pkts_bytes -= data_space;
         mp9250_report(mp, oid);
     }
@@ -209,7 +216,7 @@ mp9250_stop(struct mpu9250 *mp, uint8_t oid)
         mp->limit_count++;
 
     // Report final data
-    if (mp->data_count > 0)
+    while (sensor_bulk_count(&mp->sb))
         mp9250_report(mp, oid);
     uint16_t bytes_to_read = get_fifo_status(mp);
     mp9250_status(mp, oid, end1_time, end2_time,
@@ -237,7 +244,7 @@ command_query_mpu9250(uint32_t *args)
     mp->flags = AX_HAVE_START;
     mp->sequence = 0;
     mp->limit_count = 0;
-    mp->data_count = 0;
+    sensor_bulk_reset(&mp->sb);
     mp->fifo_max = 0;
     mp->fifo_pkts_bytes = 0;
     sched_add_timer(&mp->timer);
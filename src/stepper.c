@@ -50,16 +50,83 @@ struct stepper {
     struct move_queue_head mq;
     struct trsync_signal stop_signal;
     // gcc (pre v6) does better optimization when uint8_t are bitfields
-    uint8_t flags : 8;
+    uint8_t flags : 8, oid : 8;
 };
 
 enum { POSITION_BIAS=0x40000000 };
 
 enum {
     SF_LAST_DIR=1<<0, SF_NEXT_DIR=1<<1, SF_INVERT_STEP=1<<2, SF_NEED_RESET=1<<3,
-    SF_SINGLE_SCHED=1<<4, SF_HAVE_ADD=1<<5
+    SF_SINGLE_SCHED=1<<4, SF_HAVE_ADD=1<<5, SF_TRACE=1<<6
 };
 
+
+/****************************************************************
+ * Step time tracing
+ ****************************************************************/
+
+#if CONFIG_WANT_STEPPER_TRACE
+
+// Ring of (oid, step clock) trace entries - the buffer is allocated
+// by a config command.  Only the step irq advances 'head' and only
+// the trace task advances 'tail' (the task accesses both with irqs
+// disabled as they may not be updated atomically).
+struct stepper_trace {
+    uint32_t *clocks;
+    uint8_t *oids;
+    uint16_t size;
+    volatile uint16_t head, tail;
+    uint16_t overflows;
+};
+
+// Each reported entry is the stepper oid followed by the 32bit clock
+#define TRACE_ENTRY_SIZE 5
+#define TRACE_BLOCK_ENTRIES 10
+
+static struct stepper_trace trace;
+static struct task_wake trace_wake;
+static uint16_t trace_sequence;
+
+static uint_fast16_t
+stepper_trace_count(uint_fast16_t head, uint_fast16_t tail)
+{
+    return head >= tail ? head - tail : head + trace.size - tail;
+}
+
+// Record the actual time of a step (called from irq context)
+static void
+stepper_trace_step(struct stepper *s)
+{
+    uint_fast16_t head = trace.head, next = head + 1;
+    if (next >= trace.size)
+        next = 0;
+    if (next == trace.tail) {
+        trace.overflows++;
+        return;
+    }
+    trace.clocks[head] = timer_read_time();
+    trace.oids[head] = s->oid;
+    trace.head = next;
+    if (stepper_trace_count(next, trace.tail) >= TRACE_BLOCK_ENTRIES)
+        sched_wake_task(&trace_wake);
+}
+
+#else
+
+static inline void
+stepper_trace_step(struct stepper *s)
+{
+}
+
+#endif
+
+// Check if step tracing is enabled for a stepper
+static inline int
+stepper_is_traced(struct stepper *s)
+{
+    return CONFIG_WANT_STEPPER_TRACE && s->flags & SF_TRACE;
+}
+
 // Setup a stepper for the next move in its queue
 static uint_fast8_t
 stepper_load_next(struct stepper *s)
@@ -105,6 +172,8 @@ stepper_event_edge(struct timer *t)
 {
     struct stepper *s = container_of(t, struct stepper, time);
     gpio_out_toggle_noirq(s->step_pin);
+    if (unlikely(stepper_is_traced(s)))
+        stepper_trace_step(s);
     uint32_t count = s->count - 1;
     if (likely(count)) {
         s->count = count;
@@ -123,6 +192,8 @@ stepper_event_avr(struct timer *t)
 {
     struct stepper *s = container_of(t, struct stepper, time);
     gpio_out_toggle_noirq(s->step_pin);
+    if (unlikely(stepper_is_traced(s)))
+        stepper_trace_step(s);
     uint16_t *pcount = (void*)&s->count, count = *pcount - 1;
     if (likely(count)) {
         *pcount = count;
@@ -146,9 +217,12 @@ stepper_event_full(struct timer *t)
     uint32_t curtime = timer_read_time();
     uint32_t min_next_time = curtime + s->step_pulse_ticks;
     s->count--;
-    if (likely(s->count & 1))
+    if (likely(s->count & 1)) {
+        if (unlikely(stepper_is_traced(s)))
+            stepper_trace_step(s);
         // Schedule unstep event
         goto reschedule_min;
+    }
     if (likely(s->count)) {
         s->next_step_time += s->interval;
         s->interval += s->add;
@@ -186,6 +260,7 @@ command_config_stepper(uint32_t *args)
 {
     struct stepper *s = oid_alloc(args[0], command_config_stepper, sizeof(*s));
     int_fast8_t invert_step = args[3];
+    s->oid = args[0];
     s->flags = invert_step > 0 ? SF_INVERT_STEP : 0;
     s->step_pin = gpio_out_setup(args[1], s->flags & SF_INVERT_STEP);
     s->dir_pin = gpio_out_setup(args[2], 0);
@@ -316,7 +391,8 @@ stepper_stop(struct trsync_signal *tss, uint8_t reason)
     s->next_step_time = s->time.waketime = 0;
     s->position = -stepper_get_position(s);
     s->count = 0;
-    s->flags = (s->flags & (SF_INVERT_STEP|SF_SINGLE_SCHED)) | SF_NEED_RESET;
+    s->flags = ((s->flags & (SF_INVERT_STEP|SF_SINGLE_SCHED|SF_TRACE))
+                | SF_NEED_RESET);
     gpio_out_write(s->dir_pin, 0);
     if (!(HAVE_EDGE_OPTIMIZATION && s->flags & SF_SINGLE_SCHED))
         gpio_out_write(s->step_pin, s->flags & SF_INVERT_STEP);
@@ -349,3 +425,97 @@ stepper_shutdown(void)
     }
 }
 DECL_SHUTDOWN(stepper_shutdown);
+
+#if CONFIG_WANT_STEPPER_TRACE
+
+void
+command_config_stepper_trace(uint32_t *args)
+{
+    if (trace.size)
+        shutdown("Stepper trace already configured");
+    uint16_t entries = args[0];
+    if (entries < TRACE_BLOCK_ENTRIES || entries > 0x7fff)
+        shutdown("Invalid stepper trace buffer size");
+    // One slot of the ring is always left empty
+    uint16_t size = entries + 1;
+    trace.clocks = alloc_chunk(sizeof(trace.clocks[0]) * size);
+    trace.oids = alloc_chunk(sizeof(trace.oids[0]) * size);
+    trace.size = size;
+}
+DECL_COMMAND(command_config_stepper_trace, "config_stepper_trace entries=%hu");
+
+// Report a block of step trace entries (and the number of entries
+// dropped since the last report)
+static void
+stepper_trace_report(uint_fast16_t count)
+{
+    uint8_t data[TRACE_BLOCK_ENTRIES * TRACE_ENTRY_SIZE], *p = data;
+    if (count > TRACE_BLOCK_ENTRIES)
+        count = TRACE_BLOCK_ENTRIES;
+    uint_fast16_t tail = trace.tail, i;
+    for (i=0; i<count; i++) {
+        uint32_t t = trace.clocks[tail];
+        *p++ = trace.oids[tail];
+        *p++ = t;
+        *p++ = t >> 8;
+        *p++ = t >> 16;
+        *p++ = t >> 24;
+        if (++tail >= trace.size)
+            tail = 0;
+    }
+    irq_disable();
+    trace.tail = tail;
+    uint16_t overflows = trace.overflows;
+    trace.overflows = 0;
+    irq_enable();
+    sendf("stepper_trace_data sequence=%hu overflows=%hu data=%*s"
+          , trace_sequence, overflows, p - data, data);
+    trace_sequence++;
+}
+
+// Enable or disable recording of actual step times for a stepper
+void
+command_stepper_trace(uint32_t *args)
+{
+    struct stepper *s = stepper_oid_lookup(args[0]);
+    if (!trace.size)
+        shutdown("Stepper trace not configured");
+    irq_disable();
+    s->flags = args[1] ? s->flags | SF_TRACE : s->flags & ~SF_TRACE;
+    irq_enable();
+    if (!args[1])
+        // Flush out any entries already recorded
+        sched_wake_task(&trace_wake);
+}
+DECL_COMMAND(command_stepper_trace, "stepper_trace oid=%c enable=%c");
+
+void
+stepper_trace_task(void)
+{
+    if (!sched_check_wake(&trace_wake))
+        return;
+    irq_disable();
+    uint_fast16_t count = stepper_trace_count(trace.head, trace.tail);
+    uint_fast8_t have_overflows = !!trace.overflows;
+    irq_enable();
+    if (count >= TRACE_BLOCK_ENTRIES) {
+        // Send one block per task invocation so other messages (and
+        // the serial transmit buffer) are not starved
+        stepper_trace_report(count);
+        sched_wake_task(&trace_wake);
+        return;
+    }
+    // Flush partial blocks (and report overflows) when no stepper is
+    // being traced
+    uint8_t i;
+    struct stepper *s;
+    foreach_oid(i, s, command_config_stepper) {
+        if (s->flags & SF_TRACE)
+            return;
+    }
+    if (count || have_overflows)
+        stepper_trace_report(count);
+}
+DECL_TASK(stepper_trace_task);
+
+#endif